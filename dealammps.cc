@@ -136,6 +136,9 @@ namespace HMM
 		unsigned int						machine_ppn;
 		int									fenodes;
 		unsigned int						batch_nnodes_min;
+		bool								md_proc_grid;
+		double								md_ghost_cutoff;
+		bool								md_rcb_balance;
 
 		ConditionalOStream 					hcout;
 
@@ -151,17 +154,39 @@ namespace HMM
 		int									quadrature_formula;
 
 		std::vector<std::string>			mdtype;
+		std::vector<std::string>			mdsym;
 		unsigned int						nrepl;
+		unsigned int						nrepl_min;
+		double								replica_tolerance;
 		Tensor<1,dim> 						cg_dir;
 
 		bool								activate_md_update;
 		bool								use_pjm_scheduler;
+		double								gp_surrogate_tolerance;
+		double								gp_surrogate_length_scale;
+		double								gp_surrogate_noise;
+		unsigned int						gp_surrogate_inducing_points;
+		double								nn_surrogate_tolerance;
+		unsigned int						nn_surrogate_hidden_units;
+		unsigned int						nn_surrogate_training_epochs;
+		double								elastic_domain_tolerance;
+		double								elastic_domain_check_rate;
 
 		double								md_timestep_length;
 		double								md_temperature;
 		int									md_nsteps_sample;
 		double								md_strain_rate;
 		std::string							md_force_field;
+		std::string							md_run_style;
+		double								kspace_tolerance;
+		unsigned int						surrogate_nneighbours;
+		double								surrogate_tolerance;
+		double								surrogate_history_weight;
+		double								md_job_budget;
+		int									lofi_nsteps_sample;
+		double								lofi_strain_rate;
+		double								lofi_tolerance;
+		double								dedup_quantum;
 
 		int									freq_checkpoint;
 		int									freq_output_visu;
@@ -179,6 +204,7 @@ namespace HMM
 		std::string							nanologloc;
 		std::string							nanologloctmp;
 		std::string							nanologlochom;
+		std::string							mddatabaseloc;
 
 		std::string							md_scripts_directory;
 
@@ -233,6 +259,15 @@ namespace HMM
 	    // Scale-bridging parameters
 	    activate_md_update = std::stoi(bptree_read(pt, "scale-bridging", "activate md update"));
 	    use_pjm_scheduler = std::stoi(bptree_read(pt, "scale-bridging", "use pjm scheduler"));
+	    gp_surrogate_tolerance = std::stod(bptree_read(pt, "scale-bridging", "gp surrogate tolerance"));
+	    gp_surrogate_length_scale = std::stod(bptree_read(pt, "scale-bridging", "gp surrogate length scale"));
+	    gp_surrogate_noise = std::stod(bptree_read(pt, "scale-bridging", "gp surrogate noise"));
+	    gp_surrogate_inducing_points = std::stoi(bptree_read(pt, "scale-bridging", "gp surrogate inducing points"));
+	    nn_surrogate_tolerance = std::stod(bptree_read(pt, "scale-bridging", "nn surrogate tolerance"));
+	    nn_surrogate_hidden_units = std::stoi(bptree_read(pt, "scale-bridging", "nn surrogate hidden units"));
+	    nn_surrogate_training_epochs = std::stoi(bptree_read(pt, "scale-bridging", "nn surrogate training epochs"));
+	    elastic_domain_tolerance = std::stod(bptree_read(pt, "scale-bridging", "elastic domain tolerance"));
+	    elastic_domain_check_rate = std::stod(bptree_read(pt, "scale-bridging", "elastic domain check rate"));
 
 	    // Continuum input, output, restart and log location
 		macrostatelocin = bptree_read(pt, "directory structure", "macroscale input");
@@ -245,13 +280,22 @@ namespace HMM
 		nanostatelocout = bptree_read(pt, "directory structure", "nanoscale output");
 		nanostatelocres = bptree_read(pt, "directory structure", "nanoscale restart");
 		nanologloc = bptree_read(pt, "directory structure", "nanoscale log");
+		mddatabaseloc = bptree_read(pt, "directory structure", "md database");
 
 		// Molecular dynamics material data
 		nrepl = std::stoi(bptree_read(pt, "molecular dynamics material", "number of replicas"));
+		nrepl_min = std::stoi(bptree_read(pt, "molecular dynamics material", "minimum number of replicas"));
+		replica_tolerance = std::stod(bptree_read(pt, "molecular dynamics material", "replicas stress tolerance"));
 		BOOST_FOREACH(boost::property_tree::ptree::value_type &v,
 				get_subbptree(pt, "molecular dynamics material").get_child("list of materials.")) {
 			mdtype.push_back(v.second.data());
 		}
+		// Symmetry of each material (none, isotropic or transverse) used to merge MD runs whose
+		// strains only differ by a rotation leaving the material invariant
+		BOOST_FOREACH(boost::property_tree::ptree::value_type &v,
+				get_subbptree(pt, "molecular dynamics material").get_child("list of materials symmetry.")) {
+			mdsym.push_back(v.second.data());
+		}
 		// Direction to which all MD data are rotated to, to later ease rotation in the FE problem. The
 		// replicas results are rotated to this referential before ensemble averaging, and the continuum
 		// tensors are rotated to this referential from the microstructure given orientation
@@ -272,12 +316,25 @@ namespace HMM
 		md_nsteps_sample = std::stoi(bptree_read(pt, "molecular dynamics parameters", "number of sampling steps"));
 		md_strain_rate = std::stod(bptree_read(pt, "molecular dynamics parameters", "strain rate"));
 		md_force_field = bptree_read(pt, "molecular dynamics parameters", "force field");
+		md_run_style = bptree_read(pt, "molecular dynamics parameters", "straining run style");
 		md_scripts_directory = bptree_read(pt, "molecular dynamics parameters", "scripts directory");
+		kspace_tolerance = std::stod(bptree_read(pt, "molecular dynamics parameters", "kspace tuning tolerance"));
+		surrogate_nneighbours = std::stoi(bptree_read(pt, "molecular dynamics parameters", "surrogate number of neighbours"));
+		surrogate_tolerance = std::stod(bptree_read(pt, "molecular dynamics parameters", "surrogate distance tolerance"));
+		surrogate_history_weight = std::stod(bptree_read(pt, "molecular dynamics parameters", "surrogate history weight"));
+		md_job_budget = std::stod(bptree_read(pt, "molecular dynamics parameters", "md job budget"));
+		lofi_nsteps_sample = std::stoi(bptree_read(pt, "molecular dynamics parameters", "low fidelity number of sampling steps"));
+		lofi_strain_rate = std::stod(bptree_read(pt, "molecular dynamics parameters", "low fidelity strain rate"));
+		lofi_tolerance = std::stod(bptree_read(pt, "molecular dynamics parameters", "low fidelity tolerance"));
+		dedup_quantum = std::stod(bptree_read(pt, "molecular dynamics parameters", "deduplication strain quantum"));
 
 		// Computational resources
 		machine_ppn = std::stoi(bptree_read(pt, "computational resources", "machine cores per node"));
 		fenodes = std::stoi(bptree_read(pt, "computational resources", "number of nodes for FEM simulation"));
 		batch_nnodes_min = std::stoi(bptree_read(pt, "computational resources", "minimum nodes per MD simulation"));
+		md_proc_grid = std::stoi(bptree_read(pt, "computational resources", "md processors grid selection"));
+		md_ghost_cutoff = std::stod(bptree_read(pt, "computational resources", "md ghost cutoff"));
+		md_rcb_balance = std::stoi(bptree_read(pt, "computational resources", "md rcb balancing of composites"));
 
 		// Output and checkpointing frequencies
 		freq_checkpoint = std::stoi(bptree_read(pt, "output data", "checkpoint frequency"));
@@ -289,14 +346,27 @@ namespace HMM
 		hcout << "Parameters listing:" << std::endl;
 		hcout << " - Activate MD updates (1 is true, 0 is false): "<< activate_md_update << std::endl;
 		hcout << " - Use Pilot Job Manager to schedule MD jobs: "<< use_pjm_scheduler << std::endl;
+		hcout << " - GP surrogate tolerance on stress standard deviation (0 disables): "<< gp_surrogate_tolerance << std::endl;
+		hcout << " - GP surrogate length scale (strain): "<< gp_surrogate_length_scale << std::endl;
+		hcout << " - GP surrogate noise on MD stress: "<< gp_surrogate_noise << std::endl;
+		hcout << " - GP surrogate maximum number of inducing points: "<< gp_surrogate_inducing_points << std::endl;
+		hcout << " - NN surrogate tolerance on relative held-out error (0 disables): "<< nn_surrogate_tolerance << std::endl;
+		hcout << " - NN surrogate hidden units per layer: "<< nn_surrogate_hidden_units << std::endl;
+		hcout << " - NN surrogate training epochs: "<< nn_surrogate_training_epochs << std::endl;
+		hcout << " - Linear elastic domain tolerance on stress (0 disables): "<< elastic_domain_tolerance << std::endl;
+		hcout << " - Linear elastic domain MD check rate: "<< elastic_domain_check_rate << std::endl;
 		hcout << " - FE timestep duration: "<< fe_timestep_length << std::endl;
 		hcout << " - Start timestep: "<< start_timestep << std::endl;
 		hcout << " - End timestep: "<< end_timestep << std::endl;
 		hcout << " - FE shape funciton degree: "<< fe_degree << std::endl;
 		hcout << " - FE quadrature formula: "<< quadrature_formula << std::endl;
 		hcout << " - Number of replicas: "<< nrepl << std::endl;
+		hcout << " - Minimum number of replicas: "<< nrepl_min << std::endl;
+		hcout << " - Tolerance on the standard error of the replicas stress (Pa): "<< replica_tolerance << std::endl;
 		hcout << " - List of material names: "<< std::flush;
 		for(unsigned int imd=0; imd<mdtype.size(); imd++) hcout << " " << mdtype[imd] << std::flush; hcout << std::endl;;
+		hcout << " - List of material symmetries: "<< std::flush;
+		for(unsigned int imd=0; imd<mdsym.size(); imd++) hcout << " " << mdsym[imd] << std::flush; hcout << std::endl;;
 		hcout << " - Direction use as a common ground/referential to transfer data between nano- and micro-structures : "<< std::flush;
 		for(unsigned int imd=0; imd<dim; imd++) hcout << " " << cg_dir[imd] << std::flush; hcout << std::endl;;
 		hcout << " - MD timestep duration: "<< md_timestep_length << std::endl;
@@ -304,10 +374,23 @@ namespace HMM
 		hcout << " - MD deformation rate: "<< md_strain_rate << std::endl;
 		hcout << " - MD number of sampling steps: "<< md_nsteps_sample << std::endl;
 		hcout << " - MD force field type: "<< md_force_field << std::endl;
+		hcout << " - MD straining run style (verlet or respa with its levels): "<< md_run_style << std::endl;
+		hcout << " - MD kspace tuning force error tolerance (0 disables the tuning): "<< kspace_tolerance << std::endl;
+		hcout << " - MD surrogate number of neighbours (0 disables the interpolation): "<< surrogate_nneighbours << std::endl;
+		hcout << " - MD surrogate distance tolerance: "<< surrogate_tolerance << std::endl;
+		hcout << " - MD surrogate strain history weight: "<< surrogate_history_weight << std::endl;
+		hcout << " - MD jobs wall-time budget per update (s): "<< md_job_budget << std::endl;
+		hcout << " - MD low-fidelity number of sampling steps: "<< lofi_nsteps_sample << std::endl;
+		hcout << " - MD low-fidelity strain rate: "<< lofi_strain_rate << std::endl;
+		hcout << " - MD low-fidelity tolerance (Pa): "<< lofi_tolerance << std::endl;
+		hcout << " - MD runs deduplication strain quantum: "<< dedup_quantum << std::endl;
 		hcout << " - MD scripts directory (contains in.set, in.strain, ELASTIC/, ffield parameters): "<< md_scripts_directory << std::endl;
 		hcout << " - Number of cores per node on the machine: "<< machine_ppn << std::endl;
 		hcout << " - Number of nodes for FEM simulation: "<< fenodes << std::endl;
 		hcout << " - Minimum number of nodes per MD simulation: "<< batch_nnodes_min << std::endl;
+		hcout << " - Select MD processors grid from box dimensions: "<< md_proc_grid << std::endl;
+		hcout << " - MD ghost atoms communication cutoff: "<< md_ghost_cutoff << std::endl;
+		hcout << " - MD rcb load balancing of composite replicas: "<< md_rcb_balance << std::endl;
 		hcout << " - Frequency of checkpointing: "<< freq_checkpoint << std::endl;
 		hcout << " - Frequency of writing FE data files: "<< freq_output_lhist << std::endl;
 		hcout << " - Frequency of writing FE visualisation files: "<< freq_output_visu << std::endl;
@@ -320,6 +403,7 @@ namespace HMM
 		hcout << " - MD output directory: "<< nanostatelocout << std::endl;
 		hcout << " - MD restart directory: "<< nanostatelocres << std::endl;
 		hcout << " - MD log directory: "<< nanologloc << std::endl;
+		hcout << " - MD results database directory: "<< mddatabaseloc << std::endl;
 	}
 
 
@@ -473,7 +557,11 @@ namespace HMM
 											   nanologloctmp, nanologlochom, macrostatelocout,
 											   md_scripts_directory, freq_checkpoint, freq_output_homog,
 											   batch_nnodes_min, machine_ppn, mdtype, cg_dir, nrepl,
-											   use_pjm_scheduler);
+											   use_pjm_scheduler, md_proc_grid, md_ghost_cutoff, md_rcb_balance,
+											   kspace_tolerance, md_run_style, mddatabaseloc,
+											   surrogate_nneighbours, surrogate_tolerance, surrogate_history_weight,
+											   md_job_budget, lofi_nsteps_sample, lofi_strain_rate, lofi_tolerance,
+											   nrepl_min, replica_tolerance, dedup_quantum, mdsym);
 
 		// Initialization of MMD must be done before initialization of FE, because FE needs initial
 		// materials properties obtained from MMD initialization
@@ -484,7 +572,12 @@ namespace HMM
 										 macrostatelocin, macrostatelocout,
 										 macrostatelocres, macrologloc,
 										 freq_checkpoint, freq_output_visu, freq_output_lhist,
-										 activate_md_update, mdtype, cg_dir);
+										 activate_md_update, mdtype, cg_dir,
+										 gp_surrogate_tolerance, gp_surrogate_length_scale,
+										 gp_surrogate_noise, gp_surrogate_inducing_points,
+										 nn_surrogate_tolerance, nn_surrogate_hidden_units,
+										 nn_surrogate_training_epochs,
+										 elastic_domain_tolerance, elastic_domain_check_rate);
 
 		MPI_Barrier(world_communicator);
 
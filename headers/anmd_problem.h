@@ -113,9 +113,13 @@ namespace HMM
 		sprintf(initdata, "%s/init.%s.bin", statelocout.c_str(), mdstate);
 
 		char straindata_last[1024];
-		sprintf(straindata_last, "%s/%s.%s.%s.dump", statelocres.c_str(), timeid.c_str(),
+		sprintf(straindata_last, "%s/%s.%s.%s.bin", statelocres.c_str(), timeid.c_str(),
+				cellid.c_str(), mdstate);
+
+		// State stored by previous versions (text dump for ReaxFF)
+		char straindata_legacy[1024];
+		sprintf(straindata_legacy, "%s/%s.%s.%s.dump", statelocres.c_str(), timeid.c_str(),
 				cellid.c_str(), mdstate);
-		// sprintf(straindata_last, "%s/last.%s.%s.bin", statelocout.c_str(), cellid, mdstate);
 
 		char cline[1024];
 		char cfile[1024];
@@ -148,15 +152,18 @@ namespace HMM
 		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.set.lammps");
 		lammps_file(lmp,cfile);
 
-		if (md_force_field == "reax"){
+		if (file_exists(straindata_last)){
+			sprintf(cline, "read_restart %s", straindata_last); lammps_command(lmp,cline);
+		}
+		else if (md_force_field == "reax"){
 			sprintf(cline, "read_restart %s", initdata); /*reaxff*/
 			lammps_command(lmp,cline); /*reaxff*/
-			sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_last); /*reaxff*/
+			sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_legacy); /*reaxff*/
 			lammps_command(lmp,cline); /*reaxff*/
 
 		}
 		else if (md_force_field == "opls"){
-			sprintf(cline, "read_restart %s", straindata_last); /*opls*/
+			sprintf(cline, "read_restart %s", straindata_legacy); /*opls*/
 			lammps_command(lmp,cline); /*opls*/
 		}
 
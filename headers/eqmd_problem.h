@@ -25,6 +25,7 @@
 
 // Specifically built header files
 #include "read_write.h"
+#include "lammps_script_cache.h"
 
 namespace HMM
 {
@@ -36,7 +37,7 @@ namespace HMM
 	class EQMDProblem
 	{
 	public:
-		EQMDProblem (MPI_Comm mdcomm, int pcolor);
+		EQMDProblem (MPI_Comm mdcomm, int pcolor, const LAMMPSScriptCache *mdscr = NULL);
 		~EQMDProblem ();
 
 		void equil (std::string cmat,
@@ -50,6 +51,8 @@ namespace HMM
 
 		void lammps_equilibration();
 
+		void run_script(LAMMPS *lmp, std::string name);
+
 		MPI_Comm 							md_batch_communicator;
 		const int 							md_batch_n_processes;
 		const int 							this_md_batch_process;
@@ -57,6 +60,9 @@ namespace HMM
 
 		ConditionalOStream 					mdcout;
 
+		const LAMMPSScriptCache				*md_scripts;
+		std::map<std::string,std::string>	script_vars;
+
 		Tensor<1,dim>						loc_rep_length;
 		SymmetricTensor<2,dim> 				loc_rep_stress;
 		SymmetricTensor<4,dim> 				loc_rep_stiff;
@@ -87,13 +93,14 @@ namespace HMM
 
 
 	template <int dim>
-	EQMDProblem<dim>::EQMDProblem (MPI_Comm mdcomm, int pcolor)
+	EQMDProblem<dim>::EQMDProblem (MPI_Comm mdcomm, int pcolor, const LAMMPSScriptCache *mdscr)
 	:
 		md_batch_communicator (mdcomm),
 		md_batch_n_processes (Utilities::MPI::n_mpi_processes(md_batch_communicator)),
 		this_md_batch_process (Utilities::MPI::this_mpi_process(md_batch_communicator)),
 		md_batch_pcolor (pcolor),
-		mdcout (std::cout,(this_md_batch_process == 0))
+		mdcout (std::cout,(this_md_batch_process == 0)),
+		md_scripts (mdscr)
 	{}
 
 
@@ -104,6 +111,23 @@ namespace HMM
 
 
 
+	// Running a script of the scripts directory, from the in-memory copy broadcast at the
+	// beginning of the run if available, otherwise reading it from the filesystem
+	template <int dim>
+	void EQMDProblem<dim>::run_script (LAMMPS *lmp, std::string name)
+	{
+		if(md_scripts != NULL && md_scripts->has(name)){
+			md_scripts->submit(lmp, name, script_vars);
+		}
+		else{
+			char cfile[1024];
+			sprintf(cfile, "%s/%s", scriptsloc.c_str(), name.c_str());
+			lammps_file(lmp,cfile);
+		}
+	}
+
+
+
 
 
 
@@ -126,7 +150,6 @@ namespace HMM
 		char locdata[1024];
 		sprintf(locdata, "%s/%s.data", statelocin.c_str(), mdstate);
 
-		char cfile[1024];
 		char cline[1024];
 		char sfile[1024];
 
@@ -160,7 +183,7 @@ namespace HMM
 
 		// Setting general parameters for LAMMPS independentely of what will be
 		// tested on the sample next.
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.set.lammps"); lammps_file(lmp,cfile);
+		run_script(lmp, "in.set.lammps");
 
 		// Setting testing temperature
 		sprintf(cline, "variable tempt equal %f", md_temperature); lammps_command(lmp,cline);
@@ -176,7 +199,7 @@ namespace HMM
 					<< "Compute state data...       " << std::endl;
 			// Compute initialization of the sample which minimizes the free energy,
 			// heat up and finally cool down the sample.
-			sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.init.lammps"); lammps_file(lmp,cfile);
+			run_script(lmp, "in.init.lammps");
 		}
 		else
 		{
@@ -214,6 +237,7 @@ namespace HMM
 		// Compute secant stiffness operator and initial stresses
 		sprintf(cline, "variable locbe string %s/%s", scriptsloc.c_str(), "ELASTIC");
 		lammps_command(lmp,cline);
+		script_vars["locbe"] = scriptsloc + "/ELASTIC";
 
 		// Set sampling and straining time-lengths
 		sprintf(cline, "variable nssample0 equal %d", md_nsteps_sample); lammps_command(lmp,cline);
@@ -230,8 +254,7 @@ namespace HMM
 		sprintf(cline, "variable up equal %f", md_strain_ampl); lammps_command(lmp,cline);
 
 		// Using a routine based on the example ELASTIC/ to compute the stress tensor
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "ELASTIC/in.homogenization.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "ELASTIC/in.homogenization.lammps");
 
 		// Filling 3x3 stress tensor and conversion from ATM to Pa
 		// Useless at the moment, since it cannot be used in the Newton-Raphson algorithm.
@@ -254,8 +277,7 @@ namespace HMM
 				lammps_command(lmp,cline);
 			}
 
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "ELASTIC/in.modulus.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "ELASTIC/in.modulus.lammps");
 
 		// Filling the 6x6 Voigt Sitffness tensor with its computed as variables
 		// by LAMMPS and conversion from GPa to Pa
@@ -352,6 +374,11 @@ namespace HMM
 			write_tensor<dim>(lengthoutputfile.c_str(), loc_rep_length);
 			write_tensor<dim>(stressoutputfile.c_str(), loc_rep_stress);
 			write_tensor<dim>(stiffoutputfile.c_str(), loc_rep_stiff);
+
+			// Amplitude of the strains applied to measure the stiffness, within which the
+			// replica is known to follow it
+			std::string amploutputfile = stiffoutputfile.substr(0, stiffoutputfile.size()-6) + ".strainampl";
+			write_tensor<dim>(amploutputfile.c_str(), md_strain_ampl);
 		}
 	}
 }
@@ -114,6 +114,7 @@ namespace HMM
 		std::string							nanologloctmp;
 
 		std::string							md_scripts_directory;
+		LAMMPSScriptCache					md_scripts;
 		bool								use_pjm_scheduler;
 
 	};
@@ -333,7 +334,7 @@ namespace HMM
 					int numrepl = repl+1;
 
 					// Executing directly from the current MPI_Communicator (not fault tolerant)
-					EQMDProblem<3> eqmd_problem (md_batch_communicator, md_batch_pcolor);
+					EQMDProblem<3> eqmd_problem (md_batch_communicator, md_batch_pcolor, &md_scripts);
 
 					eqmd_problem.equil(mdtype[imdt], nanostatelocin,
 								   qpreplogloc[imdrun], md_scripts_directory,
@@ -368,6 +369,10 @@ namespace HMM
 
 		md_scripts_directory = mdsdir;
 
+		// Loading the LAMMPS scripts once for the whole run, they are then submitted from
+		// memory by every MD simulation
+		md_scripts.load(mmd_communicator, md_scripts_directory);
+
 		batch_nnodes_min = bnmin;
 		machine_ppn = mppn;
 
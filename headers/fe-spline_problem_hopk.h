@@ -172,7 +172,10 @@ namespace HMM
 
 		void init (int sstp, double tlength, std::string mslocin, std::string mslocout,
 				   std::string mslocres, std::string mlogloc, int fchpt, int fovis, int folhis,
-				   bool actmdup, std::vector<std::string> mdt, Tensor<1,dim> cgd);
+				   bool actmdup, std::vector<std::string> mdt, Tensor<1,dim> cgd,
+				   double gptol, double gpls, double gpnoise, unsigned int gpmi,
+				   double nntol, unsigned int nnhid, unsigned int nnep,
+				   double eltol, double elrate);
 		void beginstep (int tstp, double ptime);
 		void solve (int nstp);
 		bool check ();
@@ -280,6 +283,14 @@ namespace HMM
 		int 								num_spline_points;
 		int 								min_num_steps_before_spline;
 		double								acceptable_diff_threshold;
+		unsigned int						num_lsh_tables;
+		unsigned int						num_lsh_projections;
+		unsigned int						num_pca_components;
+		MatHistPredict::ExchangePrecision	history_exchange_precision;
+		unsigned int						clustering_refresh_interval;
+		MatHistPredict::SimilarityClustering	*similarity_clustering;
+		double								history_compression_tolerance;
+		unsigned int						history_compression_max_knots;
 
 		std::string                         macrostatelocin;
 		std::string                         macrostatelocout;
@@ -308,7 +319,8 @@ namespace HMM
 		fe (FE_Q<dim>(fe_deg), dim),
 		quadrature_formula (quad_for),
 		history_fe (1),
-		history_dof_handler (triangulation)
+		history_dof_handler (triangulation),
+		similarity_clustering (NULL)
 	{}
 
 
@@ -317,6 +329,7 @@ namespace HMM
 	FEProblem<dim>::~FEProblem ()
 	{
 		dof_handler.clear ();
+		delete similarity_clustering;
 	}
 
 
@@ -617,6 +630,11 @@ namespace HMM
 		std::vector<Vector<double> > structure_data;
 		structure_data = get_microstructure();
 
+		// Strain histories are stored as a piecewise-linear simplification within this tolerance,
+		// on at most max_knots knots if not zero, or as all their steps if the tolerance is negative
+		history_compression_tolerance = -1.;
+		history_compression_max_knots = 0;
+
 		// Quadrature points data initialization and assigning material properties
 		dcout << "    Assigning microstructure..." << std::endl;
 		for (typename DoFHandler<dim>::active_cell_iterator
@@ -643,6 +661,9 @@ namespace HMM
 
 					// Tell strain history object what cell ID it belongs to
 					local_quadrature_points_history[q].hist_strain.set_ID(local_quadrature_points_history[q].qpid);
+					local_quadrature_points_history[q].hist_strain.set_compression(history_compression_tolerance,
+							history_compression_max_knots);
+					local_quadrature_points_history[q].hist_strain.set_record_all_similar_histories(false);
 
 					// Assign microstructure to the current cell (so far, mdtype
 					// and rotation from global to common ground direction)
@@ -1440,6 +1461,8 @@ namespace HMM
 	{
 		dcout << "           " << "...building splines..." << std::endl;
 
+		// All the histories of the rank are built together, sharing the factorisation of the spline system
+		std::vector<MatHistPredict::Strain6D*> histories;
 		for (typename DoFHandler<dim>::active_cell_iterator
 				cell = dof_handler.begin_active();
 				cell != dof_handler.end(); ++cell)
@@ -1456,10 +1479,10 @@ namespace HMM
 
 				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
 				{
-					local_quadrature_points_history[q].hist_strain.splinify(num_spline_points);
-
+					histories.push_back(&local_quadrature_points_history[q].hist_strain);
 				}
 			}
+		MatHistPredict::splinify_all(histories, num_spline_points);
 	}
 
 
@@ -1496,46 +1519,35 @@ namespace HMM
 				}
 			}
 
-		// Launch MPI communication to compare strain histories on this rank with histories on all other ranks (including this one).
-		// Results will be stored in the Strain6D objects - a vector of all other similar strain histories (i.e. within the given threshold difference).
-		MatHistPredict::compare_histories_with_all_ranks(histories, acceptable_diff_threshold, FE_communicator);
-
-		for(uint32_t i=0; i < histories.size(); i++) {
-			char outhistfname[1024];
-			sprintf(outhistfname, "%s/last.%d.similar_hist", macrostatelocout.c_str(), histories[i]->get_ID());
-			histories[i]->most_similar_histories_to_file(outhistfname);
-
-			sprintf(outhistfname, "%s/last.%d.all_similar_hist", macrostatelocout.c_str(), histories[i]->get_ID());
-			histories[i]->all_similar_histories_to_file(outhistfname);
-
-			/*sprintf(outhistfname, "%s/%d.%d.all_similar_hist", macrostatelocout.c_str(), timestep_no, histories[i]->get_ID());
-			histories[i]->all_similar_histories_to_file(outhistfname);*/
-		}
-
-		dcout << "           " << "...computing quadrature points reduced dependencies..." << std::endl;
-		// Use networkx to coarsegrain the strain similarity graph, outputting the final list of cells to update using MD (jobs_to_run.csv),
-		// and where to get the stress results for the cells to be updated (mapping.csv). Script must run on only one rank.
-		MPI_Barrier(FE_communicator);
-		if(this_FE_process == 0) {
-			char command[1024];
-			sprintf(command,
-					"python ../spline/coarsegrain_dependency_network.py %s %s/mapping.csv %d",
-					macrostatelocout.c_str(),
-					macrostatelocout.c_str(),
-					triangulation.n_active_cells()*quadrature_formula.size()
-					);
-			int ret = system(command);
-			if (ret!=0){
-				std::cerr << "Failed completing coarse-graining of the update list dependency!" << std::endl;
-				exit(1);
-			}
+		// Each history gets the history to get its stress results from (itself if it has to be updated using MD).
+		// The clusters of the previous call are reused: only the histories which drifted away from their
+		// representative are compared with all the histories of all the ranks (including this one) and
+		// coarsegrained, unless the whole similarity graph is refreshed at this call.
+		// With a non-zero number of LSH tables, only the histories sharing a bucket of the index are compared.
+		// With a non-zero number of PCA components, the histories are compared on their first coefficients in a
+		// basis of all the histories (fitted at each refresh), and exactly only when they might be within threshold.
+		if(similarity_clustering == NULL)
+		{
+			similarity_clustering = new MatHistPredict::SimilarityClustering(clustering_refresh_interval,
+					num_lsh_tables, num_lsh_projections, num_pca_components);
+			similarity_clustering->set_exchange_precision(history_exchange_precision);
 		}
-		MPI_Barrier(FE_communicator);
-
-		for(uint32_t i=0; i < histories.size(); i++) {
-			char mappingfname[1024];
-			sprintf(mappingfname, "%s/mapping.csv", macrostatelocout.c_str());
-			histories[i]->read_coarsegrain_dependency_mapping(mappingfname);
+		CLUSTERING_CHURN churn = similarity_clustering->update(histories, acceptable_diff_threshold, FE_communicator);
+
+		dcout << "           " << "...number of cells to be updated: " << churn.num_histories
+				<< " - number of simulations required: " << churn.num_representatives << std::endl;
+		dcout << "           " << "...clusters " << (churn.full_refresh ? "refreshed" : "reused")
+				<< " - kept: " << churn.num_kept << " - reassigned: " << churn.num_reassigned
+				<< " - reclustered: " << churn.num_reclustered << std::endl;
+
+		// Cluster churn log, to tune the refresh interval
+		if(this_FE_process == 0){
+			std::ofstream churnout(macrologloc + "/clustering_churn.csv", std::ios_base::app);
+			if (churnout.tellp() == 0)
+				churnout << "timestep,full_refresh,histories,representatives,kept,reassigned,reclustered" << std::endl;
+			churnout << timestep << "," << churn.full_refresh << "," << churn.num_histories << ","
+					<< churn.num_representatives << "," << churn.num_kept << "," << churn.num_reassigned << ","
+					<< churn.num_reclustered << std::endl;
 		}
 	}
 
@@ -1548,6 +1560,14 @@ namespace HMM
 		dcout << "        " << "...comparing strain history of quadrature points to be updated..." << std::endl;
 
 		acceptable_diff_threshold = 0.000001;
+		num_lsh_tables = 0;
+		num_lsh_projections = 4;
+		num_pca_components = 0;
+		// Histories exchanged between the ranks in double precision, or quantised (EXCHANGE_FLOAT, EXCHANGE_INT16)
+		history_exchange_precision = MatHistPredict::EXCHANGE_DOUBLE;
+		// Number of calls between two full comparisons of the histories (only the first one if 0),
+		// 1 comparing all the histories at every call, the clusters being kept in between otherwise
+		clustering_refresh_interval = 1;
 
 		// Fit spline to all histories, and determine similarity graph (over all ranks)
 		if(timestep > min_num_steps_before_spline) {
@@ -1814,6 +1834,8 @@ namespace HMM
 						// Removing stress passing file
 						sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id);
 						remove(filename);
+						sprintf(filename, "%s/last.%s.synthetic", macrostatelocout.c_str(), cell_id);
+						remove(filename);
 
 						// Removing updstrain passing file
 						sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id);
@@ -2319,7 +2341,10 @@ namespace HMM
 							   std::string mslocin, std::string mslocout,
 							   std::string mslocres, std::string mlogloc,
 							   int fchpt, int fovis, int folhis, bool actmdup,
-							   std::vector<std::string> mdt, Tensor<1,dim> cgd){
+							   std::vector<std::string> mdt, Tensor<1,dim> cgd,
+							   double gptol, double gpls, double gpnoise, unsigned int gpmi,
+							   double nntol, unsigned int nnhid, unsigned int nnep,
+							   double eltol, double elrate){
 
 		// Setting up checkpoint and output frequencies
 		freq_checkpoint = fchpt;
@@ -2345,6 +2370,11 @@ namespace HMM
 		// Setting up common ground direction for rotation from microstructure given orientation
 		cg_dir = cgd;
 
+		// The strain history problem has no surrogates of the materials stress increment, their
+		// settings are only taken for the FE problems to be interchangeable
+		if (gptol > 0. || nntol > 0. || eltol > 0.)
+			dcout << " Surrogates of the materials stress increment not available with strain histories, ignored" << std::endl;
+
 		dcout << " Initiation of the Mesh...       " << std::endl;
 		make_grid ();
 
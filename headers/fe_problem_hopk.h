@@ -8,6 +8,10 @@
 #include <algorithm>
 #include <iomanip>
 #include <string>
+#include <map>
+#include <future>
+#include <chrono>
+#include <limits>
 #include <sys/stat.h>
 #include <math.h>
 
@@ -21,6 +25,8 @@
 // Specifically built header files
 #include "read_write.h"
 #include "tensor_calc.h"
+#include "gp_surrogate.h"
+#include "nn_surrogate.h"
 
 // To avoid conflicts...
 // pointers.h in input.h defines MIN and MAX
@@ -88,7 +94,11 @@ namespace HMM
 		SymmetricTensor<2,dim> inc_strain;
 		SymmetricTensor<2,dim> upd_strain;
 		SymmetricTensor<2,dim> newton_strain;
+		SymmetricTensor<2,dim> upd_stress;
+		SymmetricTensor<2,dim> surrogate_stress;
 		bool to_be_updated;
+		bool surrogate_update;
+		bool elastic;
 
 		// Characteristics
 		double rho;
@@ -167,7 +177,10 @@ namespace HMM
 
 		void init (int sstp, double tlength, std::string mslocin, std::string mslocout,
 				   std::string mslocres, std::string mlogloc, int fchpt, int fovis, int folhis,
-				   bool actmdup, std::vector<std::string> mdt, Tensor<1,dim> cgd);
+				   bool actmdup, std::vector<std::string> mdt, Tensor<1,dim> cgd,
+				   double gptol, double gpls, double gpnoise, unsigned int gpmi,
+				   double nntol, unsigned int nnhid, unsigned int nnep,
+				   double eltol, double elrate);
 		void beginstep (int tstp, double ptime);
 		void solve (int nstp);
 		bool check ();
@@ -197,6 +210,18 @@ namespace HMM
 		(const Vector<double>& displacement_update);
 		void clean_transfer();
 
+		void setup_surrogates ();
+		bool predict_surrogate_stress (std::string mat, SymmetricTensor<2,dim> cg_strain,
+				SymmetricTensor<2,dim> &cg_stress, double &cg_stddev) const;
+		void add_surrogate_sample (std::string mat, SymmetricTensor<2,dim> cg_history,
+				SymmetricTensor<2,dim> cg_strain, SymmetricTensor<2,dim> cg_stress);
+		void train_surrogates ();
+		void predict_nn_stress (std::map<unsigned int, SymmetricTensor<2,dim> > &nn_stress) const;
+		void train_nn_surrogate (const std::vector<double> &samples);
+		bool in_elastic_domain (std::string mat, SymmetricTensor<2,dim> cg_strain) const;
+		bool elastic_spot_check (unsigned int cell_index) const;
+		void update_elastic_domains (const std::vector<double> &samples);
+
 		Vector<double>  compute_internal_forces () const;
 		std::vector< std::vector< Vector<double> > >
 		compute_history_projection_from_qp_to_nodes (FE_DGQ<dim> &history_fe, DoFHandler<dim> &history_dof_handler, std::string stensor) const;
@@ -277,6 +302,37 @@ namespace HMM
 		int									freq_output_lhist;
 
 		bool 								activate_md_update;
+
+		// Gaussian process surrogates of the stress increment of each material
+		std::vector<SymmetricTensor<4,dim> > init_stiffness;
+		std::vector<GPSurrogate>			gp_models;
+		std::vector<double>					surrogate_samples;
+		double								gp_tolerance;
+		double								gp_length_scale;
+		double								gp_noise;
+		unsigned int						gp_max_inducing;
+
+		// Neural network surrogate of the stress increment of all the materials, trained in
+		// the background by the first FE process
+		NNSurrogate							nn_model;
+		std::future<NNSurrogate>			nn_training;
+		std::vector<double>					nn_train_x, nn_train_y;
+		std::vector<double>					nn_valid_x, nn_valid_y;
+		double								nn_valid_scale;
+		double								nn_valid_error;
+		unsigned int						nn_nsamples;
+		unsigned int						nn_pending;
+		double								nn_tolerance;
+		unsigned int						nn_hidden;
+		unsigned int						nn_epochs;
+
+		// Linear elastic domain of each material: bounds of the strain components, in the
+		// common ground orientation and (00, 01, 02, 11, 12, 22) order, within which the
+		// initial stiffness predicts the MD stress increments within the tolerance
+		std::vector<std::vector<double> >	elastic_lower;
+		std::vector<std::vector<double> >	elastic_upper;
+		double								elastic_tolerance;
+		double								elastic_check_rate;
 	};
 
 
@@ -544,6 +600,9 @@ namespace HMM
 		// Set materials initial stiffness tensors
 		std::vector<SymmetricTensor<4,dim> > stiffness_tensors (mdtype.size());
 		std::vector<double > densities (mdtype.size());
+		init_stiffness.resize(mdtype.size());
+		elastic_lower.resize(mdtype.size());
+		elastic_upper.resize(mdtype.size());
 
 		dcout << "    Importing initial stiffnesses and densities..." << std::endl;
 		for(unsigned int imd=0;imd<mdtype.size();imd++){
@@ -566,6 +625,19 @@ namespace HMM
 			sprintf(filename, "%s/last.%s.stiff", macrostatelocout.c_str(), mdtype[imd].c_str());
 				write_tensor<dim>(filename, stiffness_tensors[imd]);
 
+			// Kept as prior of the surrogates of the material stress increment
+			init_stiffness[imd] = stiffness_tensors[imd];
+
+			// Initial linear elastic domain, given by the amplitude of the strains applied to
+			// measure the stiffness at equilibration (empty if unknown)
+			double strain_ampl = 0.;
+			sprintf(filename, "%s/init.%s.strainampl", macrostatelocout.c_str(), mdtype[imd].c_str());
+			if (file_exists(filename)) read_tensor<dim>(filename, strain_ampl);
+			elastic_lower[imd].assign(6, -strain_ampl);
+			elastic_upper[imd].assign(6, strain_ampl);
+
+			dcout << "          * linear elastic strain amplitude: " << strain_ampl << std::endl;
+
 			// Reading initial material density
 			sprintf(filename, "%s/init.%s.density", macrostatelocout.c_str(), mdtype[imd].c_str());
 				read_tensor<dim>(filename, densities[imd]);
@@ -624,7 +696,10 @@ namespace HMM
 					local_quadrature_points_history[q].new_strain = 0;
 					local_quadrature_points_history[q].upd_strain = 0;
 					local_quadrature_points_history[q].to_be_updated = false;
+					local_quadrature_points_history[q].surrogate_update = false;
+					local_quadrature_points_history[q].elastic = true;
 					local_quadrature_points_history[q].new_stress = 0;
+					local_quadrature_points_history[q].upd_stress = 0;
 
 					// Assign microstructure to the current cell (so far, mdtype
 					// and rotation from global to common ground direction)
@@ -759,6 +834,8 @@ namespace HMM
 
 		// If openend, restore local data history...
 		int ncell_lhistory=0;
+		bool lhistory_upd_stress=false;
+		bool lhistory_elastic=false;
 		if (lhprocin.good()){
 			std::string line;
 			// Compute number of cells in local history ()
@@ -809,8 +886,17 @@ namespace HMM
 					else if(item_count==13) proc_lhistory[cell][qpoint].new_stress[1][1] = std::stod(var);
 					else if(item_count==14) proc_lhistory[cell][qpoint].new_stress[1][2] = std::stod(var);
 					else if(item_count==15) proc_lhistory[cell][qpoint].new_stress[2][2] = std::stod(var);
+					else if(item_count==16) proc_lhistory[cell][qpoint].upd_stress[0][0] = std::stod(var);
+					else if(item_count==17) proc_lhistory[cell][qpoint].upd_stress[0][1] = std::stod(var);
+					else if(item_count==18) proc_lhistory[cell][qpoint].upd_stress[0][2] = std::stod(var);
+					else if(item_count==19) proc_lhistory[cell][qpoint].upd_stress[1][1] = std::stod(var);
+					else if(item_count==20) proc_lhistory[cell][qpoint].upd_stress[1][2] = std::stod(var);
+					else if(item_count==21) proc_lhistory[cell][qpoint].upd_stress[2][2] = std::stod(var);
+					else if(item_count==22) proc_lhistory[cell][qpoint].elastic = std::stoi(var);
 					item_count++;
 				}
+				if(item_count>21) lhistory_upd_stress = true;
+				if(item_count>22) lhistory_elastic = true;
 //				if(cell%90 == 0) std::cout << cell<<","<<qpoint<<","<<proc_lhistory[cell][qpoint].upd_strain[0][0]
 //				    <<","<<proc_lhistory[cell][qpoint].new_stress[0][0] << std::endl;
 			}
@@ -839,6 +925,16 @@ namespace HMM
 						// Assigning update strain and stress tensor
 						local_quadrature_points_history[q].upd_strain=proc_lhistory[cell->active_cell_index()][q].upd_strain;
 						local_quadrature_points_history[q].new_stress=proc_lhistory[cell->active_cell_index()][q].new_stress;
+
+						// Stress at the last MD update, assumed to be the current stress if the
+						// history file predates its storage
+						if(lhistory_upd_stress)
+							local_quadrature_points_history[q].upd_stress=proc_lhistory[cell->active_cell_index()][q].upd_stress;
+						else
+							local_quadrature_points_history[q].upd_stress=proc_lhistory[cell->active_cell_index()][q].new_stress;
+
+						if(lhistory_elastic)
+							local_quadrature_points_history[q].elastic=proc_lhistory[cell->active_cell_index()][q].elastic;
 					}
 				}
 			lhprocin.close();
@@ -1314,6 +1410,12 @@ namespace HMM
 		sprintf(mat_update_local_filename, "%s/last.%d.matqpupdates", macrostatelocout.c_str(), this_FE_process);
 		omatfile.open (mat_update_local_filename);
 
+		// Create file with the uncertainty of the surrogates for qptid to update at timeid
+		std::ofstream ouncfile;
+		char unc_update_local_filename[1024];
+		sprintf(unc_update_local_filename, "%s/last.%d.uncqpupdates", macrostatelocout.c_str(), this_FE_process);
+		ouncfile.open (unc_update_local_filename);
+
 		// Preparing requirements for strain update
 		FEValues<dim> fe_values (fe, quadrature_formula,
 				update_values | update_gradients);
@@ -1323,6 +1425,9 @@ namespace HMM
 
 		if (newtonstep > 0) dcout << "        " << "...checking quadrature points requiring update..." << std::endl;
 
+		int ngpcells = 0;
+		int nelcells = 0;
+
 		for (typename DoFHandler<dim>::active_cell_iterator
 				cell = dof_handler.begin_active();
 				cell != dof_handler.end(); ++cell)
@@ -1381,13 +1486,61 @@ namespace HMM
 						avg_new_stress_tensor[k][l] /= quadrature_formula.size();
 					}
 
+				// The stress increment of the cell can be interpolated by the Gaussian process
+				// surrogate of its material, if the uncertainty of the prediction is low enough.
+				// The MD state of the cell is then left untouched, and its update strain keeps
+				// accumulating until an MD simulation is required.
+				// Cells which never left the linear elastic domain of their material keep the
+				// tangent update while their strain remains in it, apart from periodic MD
+				// simulations checking that the domain is still valid.
+				// A spot check of the elastic domain is always answered by MD, never by the surrogates.
+				bool elastic_update = false;
+				bool spot_check = false;
+				if (activate_md_update && elastic_tolerance > 0.
+					&& local_quadrature_points_history[0].elastic){
+					if (in_elastic_domain(local_quadrature_points_history[0].mat,
+							rotate_tensor(avg_new_strain_tensor, local_quadrature_points_history[0].rotam))){
+						spot_check = elastic_spot_check(cell->active_cell_index());
+						elastic_update = !spot_check;
+					}
+					else
+						for (unsigned int qc=0; qc<quadrature_formula.size(); ++qc)
+							local_quadrature_points_history[qc].elastic = false;
+				}
+
+				bool gp_interpolated = false;
+				SymmetricTensor<2,dim> gp_stress_increment;
+				double surrogate_stddev = -1.;
+				if (activate_md_update && gp_tolerance > 0. && !elastic_update && !spot_check
+					&& avg_upd_strain_tensor.norm() > 1.0e-10)
+					gp_interpolated = predict_surrogate_stress(local_quadrature_points_history[0].mat,
+							rotate_tensor(avg_upd_strain_tensor, local_quadrature_points_history[0].rotam),
+							gp_stress_increment, surrogate_stddev);
+
+				for (unsigned int qc=0; qc<quadrature_formula.size(); ++qc)
+					local_quadrature_points_history[qc].surrogate_update = gp_interpolated;
+
+				if (elastic_update){
+					for (unsigned int qc=0; qc<quadrature_formula.size(); ++qc)
+						local_quadrature_points_history[qc].to_be_updated = false;
+					nelcells++;
+				}
+				else if (gp_interpolated){
+					for (unsigned int qc=0; qc<quadrature_formula.size(); ++qc){
+						local_quadrature_points_history[qc].to_be_updated = false;
+						local_quadrature_points_history[qc].surrogate_stress =
+							local_quadrature_points_history[qc].upd_stress
+							+ rotate_tensor(gp_stress_increment, transpose(local_quadrature_points_history[qc].rotam));
+					}
+					ngpcells++;
+				}
 				// Uncomment one on the 4 following "if" statement to derive stress tensor from MD for:
 				//   (i) all cells,
 				//  (ii) cells in given location,
 				// (iii) cells based on their id
-				if (activate_md_update
+				else if (activate_md_update
 				    // otherwise MD simulation unecessary, because no significant volume change and MD will fail
-                                    && avg_upd_strain_tensor.norm() > 1.0e-10
+                                    && (spot_check || avg_upd_strain_tensor.norm() > 1.0e-10)
 					)
 				//if (activate_md_update && cell->barycenter()(1) <  3.0*tt && cell->barycenter()(0) <  1.10*(ww - aa) && cell->barycenter()(0) > 0.0*(ww - aa))
 				/*if (activate_md_update && (cell->active_cell_index() == 2922 || cell->active_cell_index() == 2923
@@ -1421,8 +1574,19 @@ namespace HMM
 						sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id);
 						write_tensor<dim>(filename, rot_avg_upd_strain_tensor);
 
+						// Uncertainty of the surrogates on the stress increment of the cell, ranking
+						// the MD simulations under a budget: standard deviation of the GP prediction,
+						// otherwise the held-out relative error of the NN applied to the elastic
+						// increment, negative if neither is available
+						if (surrogate_stddev < 0. && nn_tolerance > 0. && nn_model.trained()
+								&& nn_valid_error < std::numeric_limits<double>::max())
+							for(unsigned int imd=0;imd<mdtype.size();imd++)
+								if(local_quadrature_points_history[0].mat==mdtype[imd])
+									surrogate_stddev = nn_valid_error*(init_stiffness[imd]*rot_avg_upd_strain_tensor).norm();
+
 						ofile << cell_id << std::endl;
 						omatfile << local_quadrature_points_history[0].mat << std::endl;
+						ouncfile << surrogate_stddev << std::endl;
 					}
 				}
 				else{
@@ -1431,8 +1595,20 @@ namespace HMM
 				}
 			}
 		ofile.close();
+		omatfile.close();
+		ouncfile.close();
 		MPI_Barrier(FE_communicator);
 
+		if (elastic_tolerance > 0.){
+			nelcells = Utilities::MPI::sum(nelcells, FE_communicator);
+			dcout << "        " << "...cells in the linear elastic domain: " << nelcells << std::endl;
+		}
+
+		if (gp_tolerance > 0.){
+			ngpcells = Utilities::MPI::sum(ngpcells, FE_communicator);
+			dcout << "        " << "...cells interpolated by the GP surrogates: " << ngpcells << std::endl;
+		}
+
 		// Gathering in a single file all the quadrature points to be updated...
 		// Might be worth replacing indivual local file writings by a parallel vector of string
 		// and globalizing this vector before this final writing step.
@@ -1470,6 +1646,16 @@ namespace HMM
 				infile.close();
 			}
 			outfile.close();
+
+			sprintf(update_filename, "%s/last.uncqpupdates", macrostatelocout.c_str());
+			outfile.open (update_filename);
+			for (int ip=0; ip<n_FE_processes; ip++){
+				sprintf(update_local_filename, "%s/last.%d.uncqpupdates", macrostatelocout.c_str(), ip);
+				infile.open (update_local_filename);
+				while (getline(infile, iline)) outfile << iline << std::endl;
+				infile.close();
+			}
+			outfile.close();
 		}
 	}
 
@@ -1487,6 +1673,12 @@ namespace HMM
 
 		char time_id[1024]; sprintf(time_id, "%d-%d", timestep, newtonstep);
 
+		// Stress of the cells updated neither by MD nor by the GP surrogates, predicted in a
+		// single batch by the neural network surrogate, if accurate enough on held-out MD results
+		std::map<unsigned int, SymmetricTensor<2,dim> > nn_stress_increments;
+		if (nn_tolerance > 0. && nn_model.trained() && nn_valid_error <= nn_tolerance)
+			predict_nn_stress(nn_stress_increments);
+
 		// Retrieving all quadrature points computation and storing them in the
 		// quadrature_points_history structure
 		for (typename DoFHandler<dim>::active_cell_iterator
@@ -1494,7 +1686,7 @@ namespace HMM
 				cell != dof_handler.end(); ++cell)
 			if (cell->is_locally_owned())
 			{
-				SymmetricTensor<2,dim> avg_upd_strain_tensor;
+				SymmetricTensor<2,dim> avg_upd_strain_tensor, avg_new_strain_tensor;
 				//SymmetricTensor<2,dim> avg_stress_tensor;
 
 				PointHistory<dim> *local_quadrature_points_history
@@ -1513,6 +1705,19 @@ namespace HMM
 				char cell_id[1024]; sprintf(cell_id, "%d", cell->active_cell_index());
 				char filename[1024];
 
+				// Update strain applied to the MD simulation of the cell (before being reset)
+				avg_upd_strain_tensor = 0.;
+				avg_new_strain_tensor = 0.;
+				for (unsigned int q=0; q<quadrature_formula.size(); ++q){
+					avg_upd_strain_tensor += local_quadrature_points_history[q].upd_strain;
+					avg_new_strain_tensor += local_quadrature_points_history[q].new_strain;
+				}
+				avg_upd_strain_tensor /= quadrature_formula.size();
+				avg_new_strain_tensor /= quadrature_formula.size();
+
+				typename std::map<unsigned int, SymmetricTensor<2,dim> >::const_iterator
+					nn_cell = nn_stress_increments.find(cell->active_cell_index());
+
 				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
 				{
 					if (newtonstep == 0) local_quadrature_points_history[q].inc_stress = 0.;
@@ -1540,15 +1745,51 @@ namespace HMM
 						sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id);
 						load_stress = read_tensor<dim>(filename, loc_stress);
 
+						// Stresses interpolated or predicted on the MD side instead of simulated
+						sprintf(filename, "%s/last.%s.synthetic", macrostatelocout.c_str(), cell_id);
+						bool md_stress = !file_exists(filename);
+
 						// Rotate the output stress wrt the flake angles
-						if (load_stress) local_quadrature_points_history[q].new_stress =
+						if (load_stress){
+							// The stress increment since the last MD update trains the surrogates
+							// of the material (once per cell)
+							if (md_stress && (gp_tolerance > 0. || nn_tolerance > 0. || elastic_tolerance > 0.) && q == 0)
+								add_surrogate_sample(local_quadrature_points_history[q].mat,
+									rotate_tensor(avg_new_strain_tensor - avg_upd_strain_tensor, local_quadrature_points_history[q].rotam),
+									rotate_tensor(avg_upd_strain_tensor, local_quadrature_points_history[q].rotam),
+									loc_stress - rotate_tensor(local_quadrature_points_history[q].upd_stress,
+																local_quadrature_points_history[q].rotam));
+
+							// A cell leaves the linear elastic domain for good if the initial stiffness
+							// does not predict its stress increment
+							if (md_stress && elastic_tolerance > 0. &&
+									(rotate_tensor(loc_stress, transpose(local_quadrature_points_history[q].rotam))
+									- local_quadrature_points_history[q].upd_stress
+									- local_quadrature_points_history[q].new_stiff*avg_upd_strain_tensor).norm()
+									> elastic_tolerance)
+								local_quadrature_points_history[q].elastic = false;
+
+							local_quadrature_points_history[q].new_stress =
 									rotate_tensor(loc_stress, transpose(local_quadrature_points_history[q].rotam));
+							local_quadrature_points_history[q].upd_stress =
+									local_quadrature_points_history[q].new_stress;
+						}
 						else local_quadrature_points_history[q].new_stress +=
                                                         0.00*local_quadrature_points_history[q].new_stiff*local_quadrature_points_history[q].newton_strain;
 
 						// Resetting the update strain tensor
 						local_quadrature_points_history[q].upd_strain = 0;
 					}
+					else if (local_quadrature_points_history[q].surrogate_update){
+						// Stress interpolated by the surrogate of the material
+						local_quadrature_points_history[q].new_stress =
+							local_quadrature_points_history[q].surrogate_stress;
+					}
+					else if (nn_cell != nn_stress_increments.end()){
+						// Stress predicted by the neural network surrogate
+						local_quadrature_points_history[q].new_stress =
+							local_quadrature_points_history[q].upd_stress + nn_cell->second;
+					}
 					else{
 						// Tangent stiffness computation of the new stress tensor
 						local_quadrature_points_history[q].new_stress +=
@@ -1594,6 +1835,8 @@ namespace HMM
 					= rotated_upd_strain;*/
 				}
 			}
+
+		if (gp_tolerance > 0. || nn_tolerance > 0. || elastic_tolerance > 0.) train_surrogates();
 	}
 
 
@@ -1607,6 +1850,10 @@ namespace HMM
 		sprintf(filename, "%s/last.%d.matqpupdates", macrostatelocout.c_str(), this_FE_process);
 		remove(filename);
 
+		// Removing lists of surrogate uncertainties of quadrature points to update per procs
+		sprintf(filename, "%s/last.%d.uncqpupdates", macrostatelocout.c_str(), this_FE_process);
+		remove(filename);
+
 		// Removing lists of quadrature points to update per procs
 		sprintf(filename, "%s/last.%d.qpupdates", macrostatelocout.c_str(), this_FE_process);
 		remove(filename);
@@ -1625,6 +1872,8 @@ namespace HMM
 				// Removing stress passing file
 				sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id);
 				remove(filename);
+				sprintf(filename, "%s/last.%s.synthetic", macrostatelocout.c_str(), cell_id);
+				remove(filename);
 
 				// Removing updstrain passing file
 				sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id);
@@ -1634,6 +1883,392 @@ namespace HMM
 
 
 
+	// The surrogates model the departure of the MD stress increment from the linear elastic
+	// increment given by the initial stiffness of the material. For the GP surrogates, hence
+	// the prior standard deviation of the elastic stress for a strain of the length scale.
+	// Inducing points are added for samples with a conditional variance above 10% of the
+	// prior variance.
+	template <int dim>
+	void FEProblem<dim>::setup_surrogates ()
+	{
+		gp_models.clear();
+		surrogate_samples.clear();
+
+		if (gp_tolerance > 0.){
+			dcout << "    Setting up the GP surrogates of the materials..." << std::endl;
+			gp_models.resize(mdtype.size());
+			for(unsigned int imd=0;imd<mdtype.size();imd++){
+				double sigf = init_stiffness[imd].norm()*gp_length_scale;
+				gp_models[imd].init(gp_length_scale, sigf, gp_noise, gp_max_inducing, 0.1);
+			}
+		}
+
+		// Inputs of the network: strain at the last MD update, update strain and material
+		nn_train_x.clear(); nn_train_y.clear();
+		nn_valid_x.clear(); nn_valid_y.clear();
+		nn_valid_scale = 0.;
+		nn_valid_error = std::numeric_limits<double>::max();
+		nn_nsamples = 0;
+		nn_pending = 0;
+
+		if (nn_tolerance > 0.){
+			dcout << "    Setting up the NN surrogate of the materials..." << std::endl;
+			nn_model.init(12 + mdtype.size(), nn_hidden, 6, 1);
+
+			if (this_FE_process == 0){
+				char filename[1024];
+				sprintf(filename, "%s/alltime_nnsurrogate.dat", macrologloc.c_str());
+				std::ofstream outfile (filename, std::ofstream::app);
+				outfile << "timestep,newtonstep,ntrain,nvalid,valid_error" << std::endl;
+				outfile.close();
+			}
+		}
+	}
+
+
+
+	// Stress increment predicted by the GP surrogate of the material, if its standard deviation
+	// (returned anyway, negative if the surrogate has no data yet) is within the tolerance
+	template <int dim>
+	bool FEProblem<dim>::predict_surrogate_stress (std::string mat, SymmetricTensor<2,dim> cg_strain,
+			SymmetricTensor<2,dim> &cg_stress, double &cg_stddev) const
+	{
+		cg_stddev = -1.;
+		for(unsigned int imd=0;imd<mdtype.size();imd++)
+			if(mat==mdtype[imd]){
+				double x[6], y[6], var;
+				unsigned int c = 0;
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++) x[c++] = cg_strain[k][l];
+
+				if (!gp_models[imd].predict(x, y, var)) return false;
+				cg_stddev = sqrt(var);
+				if (cg_stddev > gp_tolerance) return false;
+
+				cg_stress = init_stiffness[imd]*cg_strain;
+				c = 0;
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++) cg_stress[k][l] += y[c++];
+				return true;
+			}
+		return false;
+	}
+
+
+
+	// Samples are stored as: material index, strain at the last MD update, update strain
+	// and departure of the stress increment from the linear elastic one
+	template <int dim>
+	void FEProblem<dim>::add_surrogate_sample (std::string mat, SymmetricTensor<2,dim> cg_history,
+			SymmetricTensor<2,dim> cg_strain, SymmetricTensor<2,dim> cg_stress)
+	{
+		for(unsigned int imd=0;imd<mdtype.size();imd++)
+			if(mat==mdtype[imd]){
+				SymmetricTensor<2,dim> residual = cg_stress - init_stiffness[imd]*cg_strain;
+
+				surrogate_samples.push_back(imd);
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++) surrogate_samples.push_back(cg_history[k][l]);
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++) surrogate_samples.push_back(cg_strain[k][l]);
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++) surrogate_samples.push_back(residual[k][l]);
+			}
+	}
+
+
+
+	// Samples of all the FE processes are added in the same order on every process, so that
+	// the surrogates remain identical across the FE communicator
+	template <int dim>
+	void FEProblem<dim>::train_surrogates ()
+	{
+		int nloc = surrogate_samples.size();
+		std::vector<int> counts (n_FE_processes), displs (n_FE_processes);
+		MPI_Allgather(&nloc, 1, MPI_INT, &counts[0], 1, MPI_INT, FE_communicator);
+
+		int ntot = 0;
+		for (int ip=0; ip<n_FE_processes; ip++){
+			displs[ip] = ntot;
+			ntot += counts[ip];
+		}
+
+		std::vector<double> all_samples (ntot);
+		MPI_Allgatherv(surrogate_samples.data(), nloc, MPI_DOUBLE,
+				all_samples.data(), &counts[0], &displs[0], MPI_DOUBLE, FE_communicator);
+		surrogate_samples.clear();
+
+		if (elastic_tolerance > 0.) update_elastic_domains(all_samples);
+
+		if (nn_tolerance > 0.) train_nn_surrogate(all_samples);
+
+		if (gp_tolerance <= 0.) return;
+
+		for (int i=0; i+19<=ntot; i+=19)
+			gp_models[int(all_samples[i])].add(&all_samples[i+7], &all_samples[i+13]);
+
+		if (ntot > 0){
+			dcout << "        " << "...GP surrogates trained with " << ntot/19 << " new MD results (inducing points:";
+			for(unsigned int imd=0;imd<mdtype.size();imd++)
+				dcout << " " << mdtype[imd] << " " << gp_models[imd].n_inducing() << "/" << gp_models[imd].n_samples();
+			dcout << ")" << std::endl;
+		}
+	}
+
+
+
+	// Only the first FE process holds the training data. It trains the network in a background
+	// thread, from the current weights, and the trained network replaces the current one at
+	// the first call after the end of the training. Every fifth MD result is held out to check
+	// the accuracy of the network, as the error relative to the held-out stress increments.
+	template <int dim>
+	void FEProblem<dim>::train_nn_surrogate (const std::vector<double> &samples)
+	{
+		unsigned int nin = nn_model.n_inputs();
+		int adopted = 0;
+
+		if (this_FE_process == 0){
+			unsigned int nvalid_new = 0;
+			for (unsigned int i=0; i+19<=samples.size(); i+=19){
+				unsigned int imd = samples[i];
+				std::vector<double> x (nin, 0.);
+				std::copy(samples.begin()+i+1, samples.begin()+i+13, x.begin());
+				x[12+imd] = 1.0;
+
+				if (nn_nsamples%5 == 4){
+					nn_valid_x.insert(nn_valid_x.end(), x.begin(), x.end());
+					nn_valid_y.insert(nn_valid_y.end(), samples.begin()+i+13, samples.begin()+i+19);
+
+					SymmetricTensor<2,dim> cg_strain, cg_residual;
+					unsigned int c = 0;
+					for(unsigned int k=0;k<dim;k++)
+						for(unsigned int l=k;l<dim;l++){
+							cg_strain[k][l] = samples[i+7+c];
+							cg_residual[k][l] = samples[i+13+c];
+							c++;
+						}
+					nn_valid_scale += (cg_residual + init_stiffness[imd]*cg_strain).norm_square();
+					nvalid_new++;
+				}
+				else{
+					nn_train_x.insert(nn_train_x.end(), x.begin(), x.end());
+					nn_train_y.insert(nn_train_y.end(), samples.begin()+i+13, samples.begin()+i+19);
+					nn_pending++;
+				}
+				nn_nsamples++;
+			}
+
+			if (nn_training.valid()
+					&& nn_training.wait_for(std::chrono::seconds(0)) == std::future_status::ready){
+				nn_model = nn_training.get();
+				adopted = 1;
+			}
+
+			unsigned int nvalid = nn_valid_x.size()/nin;
+			if (nn_model.trained() && (adopted || nvalid_new > 0) && nvalid >= 5){
+				nn_valid_error = nn_model.error(nn_valid_x, nn_valid_y)/sqrt(nn_valid_scale/nvalid);
+
+				char filename[1024];
+				sprintf(filename, "%s/alltime_nnsurrogate.dat", macrologloc.c_str());
+				std::ofstream outfile (filename, std::ofstream::app);
+				outfile << timestep << "," << newtonstep << "," << nn_train_x.size()/nin
+						<< "," << nvalid << "," << nn_valid_error << std::endl;
+				outfile.close();
+			}
+
+			if (!nn_training.valid() && nn_pending > 0 && nn_train_x.size()/nin >= 10){
+				NNSurrogate model = nn_model;
+				std::vector<double> X = nn_train_x, Y = nn_train_y;
+				unsigned int nep = nn_epochs, seed = nn_nsamples;
+				nn_training = std::async(std::launch::async, [model, X, Y, nep, seed]() mutable {
+					model.train(X, Y, nep, 1.0e-3, seed);
+					return model;
+				});
+				nn_pending = 0;
+			}
+		}
+
+		MPI_Bcast(&adopted, 1, MPI_INT, 0, FE_communicator);
+		MPI_Bcast(&nn_valid_error, 1, MPI_DOUBLE, 0, FE_communicator);
+
+		if (adopted){
+			std::vector<double> data;
+			if (this_FE_process == 0) nn_model.pack(data);
+			int ndata = data.size();
+			MPI_Bcast(&ndata, 1, MPI_INT, 0, FE_communicator);
+			data.resize(ndata);
+			MPI_Bcast(&data[0], ndata, MPI_DOUBLE, 0, FE_communicator);
+			if (this_FE_process != 0) nn_model.unpack(data);
+
+			dcout << "        " << "...NN surrogate updated, relative error on held-out MD results: "
+					<< nn_valid_error << std::endl;
+		}
+	}
+
+
+
+	template <int dim>
+	bool FEProblem<dim>::in_elastic_domain (std::string mat, SymmetricTensor<2,dim> cg_strain) const
+	{
+		for(unsigned int imd=0;imd<mdtype.size();imd++)
+			if(mat==mdtype[imd]){
+				unsigned int c = 0;
+				for(unsigned int k=0;k<dim;k++)
+					for(unsigned int l=k;l<dim;l++){
+						if (cg_strain[k][l] < elastic_lower[imd][c] || cg_strain[k][l] > elastic_upper[imd][c])
+							return false;
+						c++;
+					}
+				return true;
+			}
+		return false;
+	}
+
+
+
+	// Cells of the linear elastic domain are sent to MD once every 1/rate timesteps, at
+	// staggered timesteps, so that the checks are spread over the run and reproducible
+	template <int dim>
+	bool FEProblem<dim>::elastic_spot_check (unsigned int cell_index) const
+	{
+		if (elastic_check_rate <= 0.) return false;
+		unsigned int period = std::max(1, int(round(1.0/elastic_check_rate)));
+		return ((cell_index + timestep)%period == 0);
+	}
+
+
+
+	// The domain of a material grows to include the final strain of the MD results whose
+	// stress increment is predicted by the initial stiffness, when starting from the domain.
+	// Otherwise, along the dominant components of the final strain, the domain shrinks to
+	// halfway between the starting and final strains. All FE processes process the same
+	// samples in the same order, so the domains remain identical.
+	template <int dim>
+	void FEProblem<dim>::update_elastic_domains (const std::vector<double> &samples)
+	{
+		std::vector<bool> changed (mdtype.size(), false);
+
+		for (unsigned int i=0; i+19<=samples.size(); i+=19){
+			unsigned int imd = samples[i];
+
+			SymmetricTensor<2,dim> cg_history, cg_residual;
+			unsigned int c = 0;
+			for(unsigned int k=0;k<dim;k++)
+				for(unsigned int l=k;l<dim;l++){
+					cg_history[k][l] = samples[i+1+c];
+					cg_residual[k][l] = samples[i+13+c];
+					c++;
+				}
+
+			std::vector<double> start (samples.begin()+i+1, samples.begin()+i+7);
+			std::vector<double> end (6);
+			double maxend = 0.;
+			for (c=0; c<6; c++){
+				end[c] = start[c] + samples[i+7+c];
+				maxend = std::max(maxend, fabs(end[c]));
+			}
+
+			if (cg_residual.norm() <= elastic_tolerance){
+				if (!in_elastic_domain(mdtype[imd], cg_history)) continue;
+				for (c=0; c<6; c++){
+					if (end[c] < elastic_lower[imd][c]){ elastic_lower[imd][c] = end[c]; changed[imd] = true; }
+					if (end[c] > elastic_upper[imd][c]){ elastic_upper[imd][c] = end[c]; changed[imd] = true; }
+				}
+			}
+			else{
+				for (c=0; c<6; c++){
+					if (fabs(end[c]) < 0.5*maxend) continue;
+					double bound = 0.5*(start[c] + end[c]);
+					if (end[c] > 0. && end[c] > start[c] && bound < elastic_upper[imd][c]){
+						elastic_upper[imd][c] = std::max(0., bound); changed[imd] = true;
+					}
+					if (end[c] < 0. && end[c] < start[c] && bound > elastic_lower[imd][c]){
+						elastic_lower[imd][c] = std::min(0., bound); changed[imd] = true;
+					}
+				}
+			}
+		}
+
+		for(unsigned int imd=0;imd<mdtype.size();imd++)
+			if (changed[imd]){
+				dcout << "        " << "...linear elastic domain of " << mdtype[imd] << ":";
+				for (unsigned int c=0; c<6; c++)
+					dcout << " [" << elastic_lower[imd][c] << "," << elastic_upper[imd][c] << "]";
+				dcout << std::endl;
+			}
+	}
+
+
+
+	template <int dim>
+	void FEProblem<dim>::predict_nn_stress (std::map<unsigned int, SymmetricTensor<2,dim> > &nn_stress) const
+	{
+		unsigned int nin = nn_model.n_inputs();
+		std::vector<double> X;
+		std::vector<unsigned int> cells, mats;
+		std::vector<SymmetricTensor<2,dim> > cg_strains;
+		std::vector<Tensor<2,dim> > rotams;
+
+		for (typename DoFHandler<dim>::active_cell_iterator
+				cell = dof_handler.begin_active();
+				cell != dof_handler.end(); ++cell)
+			if (cell->is_locally_owned())
+			{
+				PointHistory<dim> *local_quadrature_points_history
+				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
+
+				// Cells in the linear elastic domain keep the tangent update
+				if (local_quadrature_points_history[0].to_be_updated
+						|| local_quadrature_points_history[0].surrogate_update
+						|| (elastic_tolerance > 0. && local_quadrature_points_history[0].elastic)) continue;
+
+				for(unsigned int imd=0;imd<mdtype.size();imd++)
+					if(local_quadrature_points_history[0].mat==mdtype[imd]){
+						SymmetricTensor<2,dim> avg_upd_strain_tensor, avg_new_strain_tensor;
+						for (unsigned int q=0; q<quadrature_formula.size(); ++q){
+							avg_upd_strain_tensor += local_quadrature_points_history[q].upd_strain;
+							avg_new_strain_tensor += local_quadrature_points_history[q].new_strain;
+						}
+						avg_upd_strain_tensor /= quadrature_formula.size();
+						avg_new_strain_tensor /= quadrature_formula.size();
+
+						SymmetricTensor<2,dim> cg_history = rotate_tensor(avg_new_strain_tensor - avg_upd_strain_tensor,
+								local_quadrature_points_history[0].rotam);
+						SymmetricTensor<2,dim> cg_strain = rotate_tensor(avg_upd_strain_tensor,
+								local_quadrature_points_history[0].rotam);
+
+						std::vector<double> x (nin, 0.);
+						unsigned int c = 0;
+						for(unsigned int k=0;k<dim;k++)
+							for(unsigned int l=k;l<dim;l++){
+								x[c] = cg_history[k][l];
+								x[6+c] = cg_strain[k][l];
+								c++;
+							}
+						x[12+imd] = 1.0;
+						X.insert(X.end(), x.begin(), x.end());
+
+						cells.push_back(cell->active_cell_index());
+						mats.push_back(imd);
+						cg_strains.push_back(cg_strain);
+						rotams.push_back(local_quadrature_points_history[0].rotam);
+					}
+			}
+
+		std::vector<double> Y;
+		nn_model.predict(X, cells.size(), Y);
+
+		for (unsigned int i=0; i<cells.size(); i++){
+			SymmetricTensor<2,dim> cg_stress = init_stiffness[mats[i]]*cg_strains[i];
+			unsigned int c = 0;
+			for(unsigned int k=0;k<dim;k++)
+				for(unsigned int l=k;l<dim;l++) cg_stress[k][l] += Y[i*6+c++];
+			nn_stress[cells[i]] = rotate_tensor(cg_stress, transpose(rotams[i]));
+		}
+	}
+
+
+
 
 	template <int dim>
 	Vector<double> FEProblem<dim>::compute_internal_forces () const
@@ -2113,6 +2748,11 @@ namespace HMM
 						for(unsigned int l=k;l<dim;l++){
 							lhprocoutbin << "," << std::setprecision(16) << local_qp_hist[q].new_stress[k][l];
 						}
+					for(unsigned int k=0;k<dim;k++)
+						for(unsigned int l=k;l<dim;l++){
+							lhprocoutbin << "," << std::setprecision(16) << local_qp_hist[q].upd_stress[k][l];
+						}
+					lhprocoutbin << "," << local_qp_hist[q].elastic;
 					lhprocoutbin << std::endl;
 				}
 			}
@@ -2127,7 +2767,10 @@ namespace HMM
 							   std::string mslocin, std::string mslocout,
 							   std::string mslocres, std::string mlogloc,
 							   int fchpt, int fovis, int folhis, bool actmdup,
-							   std::vector<std::string> mdt, Tensor<1,dim> cgd){
+							   std::vector<std::string> mdt, Tensor<1,dim> cgd,
+							   double gptol, double gpls, double gpnoise, unsigned int gpmi,
+							   double nntol, unsigned int nnhid, unsigned int nnep,
+							   double eltol, double elrate){
 
 		// Setting up checkpoint and output frequencies
 		freq_checkpoint = fchpt;
@@ -2153,6 +2796,17 @@ namespace HMM
 		// Setting up common ground direction for rotation from microstructure given orientation
 		cg_dir = cgd;
 
+		// Setting up the surrogates of the materials stress increment
+		gp_tolerance = gptol;
+		gp_length_scale = gpls;
+		gp_noise = gpnoise;
+		gp_max_inducing = gpmi;
+		nn_tolerance = nntol;
+		nn_hidden = nnhid;
+		nn_epochs = nnep;
+		elastic_tolerance = eltol;
+		elastic_check_rate = elrate;
+
 		dcout << " Initiation of the Mesh...       " << std::endl;
 		make_grid ();
 
@@ -2163,6 +2817,8 @@ namespace HMM
 		setup_quadrature_point_history ();
 		MPI_Barrier(FE_communicator);
 
+		setup_surrogates ();
+
 		dcout << " Loading previous simulation data...       " << std::endl;
 		restart ();
 	}
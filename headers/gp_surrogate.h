@@ -0,0 +1,305 @@
+#ifndef GP_SURROGATE_H
+#define GP_SURROGATE_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace HMM
+{
+	// Sparse Gaussian process regression (Kriging) of a 6 components output (stress) as a
+	// function of a 6 components input (strain, in the (00, 01, 02, 11, 12, 22) order), using
+	// a squared exponential kernel shared by the output components.
+	//
+	// The deterministic training conditional approximation is used: the process is
+	// represented on at most 'mmax' inducing points, chosen online among the samples whose
+	// variance conditioned on the current inducing points is still large. Training is
+	// incremental: a new sample is a rank-1 update of the Cholesky factor of
+	// A = Kmm + Kmn Knm / sn^2, and a new inducing point extends the Cholesky factors of
+	// Kmm and A by one row. The cost of a sample is therefore O(m^2), and O(n m) for the
+	// (bounded number of) samples becoming inducing points.
+	class GPSurrogate
+	{
+	public:
+		GPSurrogate ();
+
+		void init (double lscale, double sigf, double sign, unsigned int mmax, double ithres);
+
+		void add (const double x[6], const double y[6]);
+		bool predict (const double x[6], double mean[6], double &var) const;
+
+		unsigned int n_samples () const;
+		unsigned int n_inducing () const;
+
+	private:
+		double kernel (const double *a, const double *b) const;
+		void kernel_vector (const double *x, std::vector<double> &k) const;
+		double conditional_variance (const double *x) const;
+		void add_inducing (const double *z);
+
+		void forward_solve (const std::vector<double> &L, const std::vector<double> &b,
+				std::vector<double> &x) const;
+		void backward_solve (const std::vector<double> &L, const std::vector<double> &b,
+				std::vector<double> &x) const;
+		void append_row (std::vector<double> &L, const std::vector<double> &a, double alpha);
+		void rank1_update (std::vector<double> &L, std::vector<double> v);
+
+		double								length_scale;
+		double								signal_var;
+		double								noise_var;
+		double								jitter;
+		unsigned int						max_inducing;
+		double								inducing_threshold;
+
+		unsigned int						m;
+		std::vector<double>					X;		// samples inputs (n x 6)
+		std::vector<double>					Y;		// samples outputs (n x 6)
+		std::vector<double>					Z;		// inducing points (m x 6)
+		std::vector<double>					Lmm;	// Cholesky factor of Kmm (mmax x mmax)
+		std::vector<double>					La;		// Cholesky factor of A (mmax x mmax)
+		std::vector<double>					B;		// Kmn Y (mmax x 6)
+	};
+
+
+
+	inline
+	GPSurrogate::GPSurrogate ()
+	:
+		length_scale (1.0),
+		signal_var (1.0),
+		noise_var (1.0),
+		jitter (1.0e-8),
+		max_inducing (0),
+		inducing_threshold (0.1),
+		m (0)
+	{}
+
+
+
+	inline
+	void GPSurrogate::init (double lscale, double sigf, double sign, unsigned int mmax, double ithres)
+	{
+		length_scale = lscale;
+		signal_var = sigf*sigf;
+		noise_var = sign*sign;
+		jitter = 1.0e-8*signal_var;
+		max_inducing = mmax;
+		inducing_threshold = ithres;
+
+		m = 0;
+		X.clear(); Y.clear(); Z.clear();
+		Lmm.assign(mmax*mmax, 0.);
+		La.assign(mmax*mmax, 0.);
+		B.assign(mmax*6, 0.);
+	}
+
+
+
+	inline
+	unsigned int GPSurrogate::n_samples () const
+	{
+		return X.size()/6;
+	}
+
+
+
+	inline
+	unsigned int GPSurrogate::n_inducing () const
+	{
+		return m;
+	}
+
+
+
+	// Off-diagonal strain components counted twice, as in the norm of the strain tensor
+	inline
+	double GPSurrogate::kernel (const double *a, const double *b) const
+	{
+		double d2 = 0.;
+		for (unsigned int i=0; i<6; i++){
+			double w = (i==1 || i==2 || i==4) ? 2.0 : 1.0;
+			d2 += w*(a[i]-b[i])*(a[i]-b[i]);
+		}
+		return signal_var*exp(-0.5*d2/(length_scale*length_scale));
+	}
+
+
+
+	inline
+	void GPSurrogate::kernel_vector (const double *x, std::vector<double> &k) const
+	{
+		k.resize(m);
+		for (unsigned int j=0; j<m; j++) k[j] = kernel(&Z[6*j], x);
+	}
+
+
+
+	// Matrices are stored row-major with a leading dimension of 'max_inducing'
+	inline
+	void GPSurrogate::forward_solve (const std::vector<double> &L, const std::vector<double> &b,
+			std::vector<double> &x) const
+	{
+		x.resize(m);
+		for (unsigned int i=0; i<m; i++){
+			double s = b[i];
+			for (unsigned int j=0; j<i; j++) s -= L[i*max_inducing+j]*x[j];
+			x[i] = s/L[i*max_inducing+i];
+		}
+	}
+
+
+
+	inline
+	void GPSurrogate::backward_solve (const std::vector<double> &L, const std::vector<double> &b,
+			std::vector<double> &x) const
+	{
+		x.resize(m);
+		for (int i=m-1; i>=0; i--){
+			double s = b[i];
+			for (unsigned int j=i+1; j<m; j++) s -= L[j*max_inducing+i]*x[j];
+			x[i] = s/L[i*max_inducing+i];
+		}
+	}
+
+
+
+	// Extending the Cholesky factor of a symmetric matrix by a row/column: 'a' holds the
+	// new off-diagonal terms and 'alpha' the new diagonal term
+	inline
+	void GPSurrogate::append_row (std::vector<double> &L, const std::vector<double> &a, double alpha)
+	{
+		std::vector<double> l;
+		forward_solve(L, a, l);
+
+		double d = alpha;
+		for (unsigned int j=0; j<m; j++){
+			L[m*max_inducing+j] = l[j];
+			d -= l[j]*l[j];
+		}
+		L[m*max_inducing+m] = sqrt(std::max(d, jitter));
+	}
+
+
+
+	// Cholesky factor of L L^T + v v^T
+	inline
+	void GPSurrogate::rank1_update (std::vector<double> &L, std::vector<double> v)
+	{
+		for (unsigned int k=0; k<m; k++){
+			double lkk = L[k*max_inducing+k];
+			double r = sqrt(lkk*lkk + v[k]*v[k]);
+			double c = r/lkk;
+			double s = v[k]/lkk;
+			L[k*max_inducing+k] = r;
+			for (unsigned int i=k+1; i<m; i++){
+				L[i*max_inducing+k] = (L[i*max_inducing+k] + s*v[i])/c;
+				v[i] = c*v[i] - s*L[i*max_inducing+k];
+			}
+		}
+	}
+
+
+
+	inline
+	double GPSurrogate::conditional_variance (const double *x) const
+	{
+		std::vector<double> k, l;
+		kernel_vector(x, k);
+		forward_solve(Lmm, k, l);
+
+		double v = signal_var;
+		for (unsigned int j=0; j<m; j++) v -= l[j]*l[j];
+		return v;
+	}
+
+
+
+	inline
+	void GPSurrogate::add_inducing (const double *z)
+	{
+		unsigned int n = n_samples();
+
+		std::vector<double> kz;
+		kernel_vector(z, kz);
+		double kzz = signal_var + jitter;
+
+		// Contribution of the samples already used for training to the new row of A and B
+		std::vector<double> a (kz);
+		double alpha = kzz;
+		double bz[6] = {0., 0., 0., 0., 0., 0.};
+		std::vector<double> kx;
+		for (unsigned int i=0; i<n; i++){
+			double kzx = kernel(z, &X[6*i]);
+			kernel_vector(&X[6*i], kx);
+			for (unsigned int j=0; j<m; j++) a[j] += kx[j]*kzx/noise_var;
+			alpha += kzx*kzx/noise_var;
+			for (unsigned int c=0; c<6; c++) bz[c] += kzx*Y[6*i+c];
+		}
+
+		append_row(Lmm, kz, kzz);
+		append_row(La, a, alpha);
+		for (unsigned int c=0; c<6; c++) B[6*m+c] = bz[c];
+
+		Z.insert(Z.end(), z, z+6);
+		m++;
+	}
+
+
+
+	inline
+	void GPSurrogate::add (const double x[6], const double y[6])
+	{
+		if (max_inducing == 0) return;
+
+		if (m < max_inducing && (m == 0 || conditional_variance(x) > inducing_threshold*signal_var))
+			add_inducing(x);
+
+		std::vector<double> k;
+		kernel_vector(x, k);
+
+		std::vector<double> v (m);
+		for (unsigned int j=0; j<m; j++) v[j] = k[j]/sqrt(noise_var);
+		rank1_update(La, v);
+
+		for (unsigned int j=0; j<m; j++)
+			for (unsigned int c=0; c<6; c++)
+				B[6*j+c] += k[j]*y[c];
+
+		X.insert(X.end(), x, x+6);
+		Y.insert(Y.end(), y, y+6);
+	}
+
+
+
+	// Predictive mean and variance (of the latent process, without the noise) at x
+	inline
+	bool GPSurrogate::predict (const double x[6], double mean[6], double &var) const
+	{
+		for (unsigned int c=0; c<6; c++) mean[c] = 0.;
+		var = signal_var;
+		if (m == 0) return false;
+
+		std::vector<double> k, l, u, w;
+		kernel_vector(x, k);
+
+		// k^T Kmm^-1 k and k^T A^-1 k
+		forward_solve(Lmm, k, l);
+		forward_solve(La, k, u);
+		double qkk = 0., skk = 0.;
+		for (unsigned int j=0; j<m; j++){
+			qkk += l[j]*l[j];
+			skk += u[j]*u[j];
+		}
+		var = std::max(0., signal_var - qkk + skk);
+
+		// Mean: k^T A^-1 B / sn^2
+		backward_solve(La, u, w);
+		for (unsigned int j=0; j<m; j++)
+			for (unsigned int c=0; c<6; c++)
+				mean[c] += w[j]*B[6*j+c]/noise_var;
+
+		return true;
+	}
+}
+
+#endif
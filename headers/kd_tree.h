@@ -0,0 +1,193 @@
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cmath>
+
+namespace HMM
+{
+	// Static k-d tree over points of a fixed dimension, for k-nearest-neighbour queries
+	// (euclidean distance). Points are stored contiguously and associated with an
+	// identifier given by the caller (e.g. a record of the MD results database).
+	class KDTree
+	{
+	public:
+		KDTree (unsigned int d = 1);
+
+		void clear (unsigned int d);
+		void add (const std::vector<double> &p, unsigned long long id);
+		void build ();
+
+		unsigned int size () const;
+
+		void nearest (const std::vector<double> &p, unsigned int k,
+				std::vector<unsigned long long> &ids, std::vector<double> &dists) const;
+
+	private:
+		struct Node
+		{
+			unsigned int		point;
+			unsigned int		axis;
+			int					left;
+			int					right;
+		};
+
+		int build (std::vector<unsigned int> &pts, unsigned int begin, unsigned int end);
+		void search (int inode, const std::vector<double> &p, unsigned int k,
+				std::priority_queue<std::pair<double, unsigned int> > &best) const;
+
+		unsigned int						ndim;
+		std::vector<double>					coords;
+		std::vector<unsigned long long>		pids;
+		std::vector<Node>					nodes;
+		int									root;
+	};
+
+
+
+	inline
+	KDTree::KDTree (unsigned int d)
+	:
+		ndim (d),
+		root (-1)
+	{}
+
+
+
+	inline
+	void KDTree::clear (unsigned int d)
+	{
+		ndim = d;
+		coords.clear();
+		pids.clear();
+		nodes.clear();
+		root = -1;
+	}
+
+
+
+	inline
+	void KDTree::add (const std::vector<double> &p, unsigned long long id)
+	{
+		coords.insert(coords.end(), p.begin(), p.begin()+ndim);
+		pids.push_back(id);
+	}
+
+
+
+	inline
+	unsigned int KDTree::size () const
+	{
+		return pids.size();
+	}
+
+
+
+	// Splitting along the axis of largest spread at the median point
+	inline
+	int KDTree::build (std::vector<unsigned int> &pts, unsigned int begin, unsigned int end)
+	{
+		if (begin >= end) return -1;
+
+		unsigned int axis = 0;
+		double spread = -1.0;
+		for (unsigned int a=0; a<ndim; a++){
+			double lo = coords[pts[begin]*ndim+a], hi = lo;
+			for (unsigned int i=begin+1; i<end; i++){
+				double x = coords[pts[i]*ndim+a];
+				lo = std::min(lo, x); hi = std::max(hi, x);
+			}
+			if (hi - lo > spread){ spread = hi - lo; axis = a; }
+		}
+
+		unsigned int mid = begin + (end - begin)/2;
+		const std::vector<double> &c = coords;
+		unsigned int nd = ndim;
+		std::nth_element(pts.begin()+begin, pts.begin()+mid, pts.begin()+end,
+				[&c, nd, axis](unsigned int a, unsigned int b){ return c[a*nd+axis] < c[b*nd+axis]; });
+
+		Node node;
+		node.point = pts[mid];
+		node.axis = axis;
+		int inode = nodes.size();
+		nodes.push_back(node);
+
+		int left = build(pts, begin, mid);
+		int right = build(pts, mid+1, end);
+		nodes[inode].left = left;
+		nodes[inode].right = right;
+
+		return inode;
+	}
+
+
+
+	inline
+	void KDTree::build ()
+	{
+		nodes.clear();
+		nodes.reserve(pids.size());
+
+		std::vector<unsigned int> pts (pids.size());
+		for (unsigned int i=0; i<pts.size(); i++) pts[i] = i;
+
+		root = build(pts, 0, pts.size());
+	}
+
+
+
+	inline
+	void KDTree::search (int inode, const std::vector<double> &p, unsigned int k,
+			std::priority_queue<std::pair<double, unsigned int> > &best) const
+	{
+		if (inode < 0) return;
+		const Node &node = nodes[inode];
+
+		double d2 = 0.;
+		for (unsigned int a=0; a<ndim; a++){
+			double dx = coords[node.point*ndim+a] - p[a];
+			d2 += dx*dx;
+		}
+		if (best.size() < k) best.push(std::make_pair(d2, node.point));
+		else if (d2 < best.top().first){
+			best.pop();
+			best.push(std::make_pair(d2, node.point));
+		}
+
+		double delta = p[node.axis] - coords[node.point*ndim+node.axis];
+		int near = (delta < 0.) ? node.left : node.right;
+		int far = (delta < 0.) ? node.right : node.left;
+
+		search(near, p, k, best);
+		// The other side can only hold closer points if the splitting plane is closer
+		// than the current k-th neighbour
+		if (best.size() < k || delta*delta < best.top().first) search(far, p, k, best);
+	}
+
+
+
+	// Identifiers and distances of the (at most) k nearest points, sorted by distance
+	inline
+	void KDTree::nearest (const std::vector<double> &p, unsigned int k,
+			std::vector<unsigned long long> &ids, std::vector<double> &dists) const
+	{
+		ids.clear();
+		dists.clear();
+		if (root < 0 || k == 0) return;
+
+		std::priority_queue<std::pair<double, unsigned int> > best;
+		search(root, p, k, best);
+
+		while (!best.empty()){
+			ids.push_back(pids[best.top().second]);
+			dists.push_back(sqrt(best.top().first));
+			best.pop();
+		}
+		std::reverse(ids.begin(), ids.end());
+		std::reverse(dists.begin(), dists.end());
+	}
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef LAMMPS_SCRIPT_CACHE_H
+#define LAMMPS_SCRIPT_CACHE_H
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "mpi.h"
+#include "library.h"
+
+namespace HMM
+{
+	// In-memory copy of the LAMMPS input scripts of a run. The scripts (*.lammps files of the
+	// scripts directory and of its sub-directories, e.g. ELASTIC/) are read once by the first
+	// process of the communicator and broadcast to the others. MD jobs then submit them as a
+	// single block of commands with 'lammps_commands_string', instead of having every process
+	// of every batch re-reading them from the shared filesystem with 'lammps_file'.
+	//
+	// When preparing a block: continuation lines ('&') are joined, the variables provided by the
+	// caller are substituted, and the 'include' commands pointing to a cached script are inlined.
+	// Any other variable is left for LAMMPS to substitute when the command is executed.
+	class LAMMPSScriptCache
+	{
+	public:
+		LAMMPSScriptCache ();
+		~LAMMPSScriptCache ();
+
+		void load (MPI_Comm comm, std::string scrloc);
+
+		bool has (std::string name) const;
+		std::string block (std::string name, const std::map<std::string,std::string> &vars) const;
+		void submit (void *lmp, std::string name, const std::map<std::string,std::string> &vars) const;
+
+	private:
+		void read_directory (std::string subdir);
+		void expand (std::string name, const std::map<std::string,std::string> &vars,
+				std::string &cmds, int depth) const;
+
+		std::string 						scriptsloc;
+		std::map<std::string,std::string>	scripts;
+	};
+
+
+
+	inline
+	LAMMPSScriptCache::LAMMPSScriptCache ()
+	{}
+
+
+
+	inline
+	LAMMPSScriptCache::~LAMMPSScriptCache ()
+	{}
+
+
+
+	inline
+	void LAMMPSScriptCache::read_directory (std::string subdir)
+	{
+		std::string dirloc = scriptsloc;
+		if (subdir != "") dirloc += "/" + subdir;
+
+		DIR *dir = opendir(dirloc.c_str());
+		if (dir == NULL) return;
+
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL){
+			std::string fname = ent->d_name;
+			if (fname == "." || fname == "..") continue;
+
+			std::string name = (subdir == "") ? fname : subdir + "/" + fname;
+			std::string floc = scriptsloc + "/" + name;
+
+			struct stat buf;
+			if (stat(floc.c_str(), &buf) != 0) continue;
+
+			// Only one level of sub-directories is used by the scripts (ELASTIC/)
+			if (S_ISDIR(buf.st_mode)){
+				if (subdir == "") read_directory(name);
+			}
+			else if (fname.size() > 7 && fname.compare(fname.size()-7, 7, ".lammps") == 0){
+				std::ifstream ifile (floc.c_str());
+				if (!ifile.is_open()) continue;
+
+				// Joining continuation lines, so that each stored line is a full command
+				std::string content, cmd, line;
+				while (std::getline(ifile, line)){
+					size_t last = line.find_last_not_of(" \t\r");
+					if (last != std::string::npos && line[last] == '&'){
+						cmd += line.substr(0, last) + " ";
+						continue;
+					}
+					cmd += line;
+					content += cmd + "\n";
+					cmd.clear();
+				}
+				if (cmd != "") content += cmd + "\n";
+				ifile.close();
+
+				scripts[name] = content;
+			}
+		}
+		closedir(dir);
+	}
+
+
+
+	inline
+	void LAMMPSScriptCache::load (MPI_Comm comm, std::string scrloc)
+	{
+		int this_process;
+		MPI_Comm_rank(comm, &this_process);
+
+		scriptsloc = scrloc;
+		scripts.clear();
+
+		// Serialization of the scripts as a sequence of null terminated (name, content) pairs
+		std::string buffer;
+		if (this_process == 0){
+			read_directory("");
+			for (std::map<std::string,std::string>::const_iterator it=scripts.begin(); it!=scripts.end(); ++it){
+				buffer += it->first; buffer.push_back('\0');
+				buffer += it->second; buffer.push_back('\0');
+			}
+		}
+
+		int nchars = buffer.size();
+		MPI_Bcast(&nchars, 1, MPI_INT, 0, comm);
+
+		std::vector<char> data (nchars);
+		if (this_process == 0) std::copy(buffer.begin(), buffer.end(), data.begin());
+		if (nchars > 0) MPI_Bcast(&data[0], nchars, MPI_CHAR, 0, comm);
+
+		if (this_process != 0){
+			size_t pos = 0;
+			while (pos < data.size()){
+				std::string name (&data[pos]); pos += name.size() + 1;
+				std::string content (&data[pos]); pos += content.size() + 1;
+				scripts[name] = content;
+			}
+		}
+	}
+
+
+
+	inline
+	bool LAMMPSScriptCache::has (std::string name) const
+	{
+		return (scripts.find(name) != scripts.end());
+	}
+
+
+
+	inline
+	void LAMMPSScriptCache::expand (std::string name, const std::map<std::string,std::string> &vars,
+			std::string &cmds, int depth) const
+	{
+		std::map<std::string,std::string>::const_iterator its = scripts.find(name);
+		if (its == scripts.end()) return;
+
+		std::istringstream iss (its->second);
+		std::string line;
+		while (std::getline(iss, line)){
+			for (std::map<std::string,std::string>::const_iterator itv=vars.begin(); itv!=vars.end(); ++itv){
+				std::string key = "${" + itv->first + "}";
+				size_t pos = 0;
+				while ((pos = line.find(key, pos)) != std::string::npos){
+					line.replace(pos, key.size(), itv->second);
+					pos += itv->second.size();
+				}
+			}
+
+			// Inlining of the scripts included from the scripts directory, if cached
+			std::istringstream lss (line);
+			std::string word, incloc;
+			lss >> word >> incloc;
+			if (word == "include" && depth < 8
+					&& incloc.compare(0, scriptsloc.size()+1, scriptsloc + "/") == 0
+					&& has(incloc.substr(scriptsloc.size()+1))){
+				expand(incloc.substr(scriptsloc.size()+1), vars, cmds, depth+1);
+				continue;
+			}
+
+			cmds += line + "\n";
+		}
+	}
+
+
+
+	inline
+	std::string LAMMPSScriptCache::block (std::string name, const std::map<std::string,std::string> &vars) const
+	{
+		std::string cmds;
+		expand(name, vars, cmds, 0);
+		return cmds;
+	}
+
+
+
+	inline
+	void LAMMPSScriptCache::submit (void *lmp, std::string name, const std::map<std::string,std::string> &vars) const
+	{
+		std::string cmds = block(name, vars);
+
+		std::vector<char> cstr (cmds.begin(), cmds.end());
+		cstr.push_back('\0');
+		lammps_commands_string(lmp, &cstr[0]);
+	}
+}
+
+#endif
@@ -0,0 +1,449 @@
+#ifndef MD_DATABASE_H
+#define MD_DATABASE_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+namespace HMM
+{
+	// Result of one MD straining job, as stored in the database. Strains and stresses are
+	// stored in the common ground orientation, in the (00, 01, 02, 11, 12, 22) order, so
+	// that results of different replicas of a material can be compared.
+	struct MDRecord
+	{
+		char					mat[32];
+		int						repl;
+		char					cell[32];
+		char					time[32];
+
+		// Starting state: fingerprint of the strain history applied to the replica of the
+		// cell before the job (0 for the equilibrated initial state)
+		unsigned long long		state_key;
+		// Fingerprint of the strain history including the increment applied by the job
+		unsigned long long		history_fp;
+
+		double					strain[6];		// applied strain increment
+		double					history[6];		// cumulative strain at the start of the job
+		double					stress[6];		// returned stress (Pa), initial stress removed
+		double					runtime;		// wall-clock time of the job (s)
+	};
+
+	struct MDDatabaseHeader
+	{
+		char					magic[8];
+		unsigned int			version;
+		unsigned int			record_size;
+		unsigned long long		nrecords;
+	};
+
+	// Entry of the on-disk index, sorted by material and by norm of the strain increment.
+	// A query by material and strain increment only visits the entries of the material
+	// whose norm is within the distance tolerance of the norm of the queried increment.
+	struct MDIndexEntry
+	{
+		char					mat[32];
+		double					norm;
+		unsigned long long		id;
+	};
+
+	inline
+	bool operator< (const MDIndexEntry &a, const MDIndexEntry &b)
+	{
+		int cmp = strncmp(a.mat, b.mat, sizeof(a.mat));
+		if (cmp != 0) return (cmp < 0);
+		return (a.norm < b.norm);
+	}
+
+
+
+	inline
+	double md_strain_norm (const double strain[6])
+	{
+		// Off-diagonal components counted twice, as in the Frobenius norm of the tensor
+		double n = 0.;
+		for (unsigned int i=0; i<6; i++){
+			double w = (i==1 || i==2 || i==4) ? 2.0 : 1.0;
+			n += w*strain[i]*strain[i];
+		}
+		return sqrt(n);
+	}
+
+	inline
+	double md_strain_distance (const double a[6], const double b[6])
+	{
+		double d[6];
+		for (unsigned int i=0; i<6; i++) d[i] = a[i] - b[i];
+		return md_strain_norm(d);
+	}
+
+	// Chaining the fingerprint of a strain history with a new increment (FNV-1a over the
+	// increment rounded to 1e-9), so that identical sequences of increments give the same key
+	inline
+	unsigned long long md_history_fingerprint (unsigned long long fp, const double strain[6])
+	{
+		if (fp == 0) fp = 14695981039346656037ULL;
+		for (unsigned int i=0; i<6; i++){
+			long long q = llround(strain[i]*1.0e9);
+			const unsigned char *b = (const unsigned char *) &q;
+			for (unsigned int j=0; j<sizeof(q); j++){
+				fp ^= b[j];
+				fp *= 1099511628211ULL;
+			}
+		}
+		return fp;
+	}
+
+
+
+	// Embedded, file-backed store of the results of the MD jobs, shared by all the runs
+	// using the same database directory. Records are appended to 'md_results.db', which is
+	// memory-mapped, and 'md_results.idx' holds the sorted index of the records. Records
+	// appended after the last build of the index are found by a linear scan. The runs
+	// serialize on an advisory lock of the records file: exclusive to initialize it, append
+	// or build the index, shared to count and query the records.
+	class MDDatabase
+	{
+	public:
+		MDDatabase ();
+		~MDDatabase ();
+
+		bool open (std::string dbloc, bool writable);
+		void close ();
+
+		unsigned long long size () const;
+		const MDRecord &record (unsigned long long id) const;
+
+		void append (const std::vector<MDRecord> &records);
+		void build_index ();
+
+		void query (std::string mat, int repl, const double strain[6], double tol,
+				std::vector<unsigned long long> &ids) const;
+
+	private:
+		void lock (int operation) const;
+		void map_records ();
+		void map_index ();
+		unsigned long long count_records () const;
+
+		std::string 						dbfile;
+		std::string 						idxfile;
+		bool								writable;
+
+		int									dbfd;
+		size_t								dbsize;
+		char								*dbmap;
+
+		size_t								idxsize;
+		char								*idxmap;
+		unsigned long long					nindexed;
+	};
+
+
+
+	inline
+	MDDatabase::MDDatabase ()
+	:
+		writable (false),
+		dbfd (-1),
+		dbsize (0),
+		dbmap (NULL),
+		idxsize (0),
+		idxmap (NULL),
+		nindexed (0)
+	{}
+
+
+
+	inline
+	MDDatabase::~MDDatabase ()
+	{
+		close();
+	}
+
+
+
+	inline
+	void MDDatabase::lock (int operation) const
+	{
+		while (flock(dbfd, operation) != 0){
+			if (errno == EINTR) continue;
+			std::cerr << "Failed locking the MD database file " << dbfile << std::endl;
+			exit(1);
+		}
+	}
+
+
+
+	inline
+	void MDDatabase::map_records ()
+	{
+		if (dbmap != NULL) munmap(dbmap, dbsize);
+		dbmap = NULL;
+
+		struct stat buf;
+		fstat(dbfd, &buf);
+		dbsize = buf.st_size;
+
+		int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+		void *m = mmap(NULL, dbsize, prot, MAP_SHARED, dbfd, 0);
+		if (m == MAP_FAILED){
+			std::cerr << "Failed mapping the MD database file " << dbfile << std::endl;
+			exit(1);
+		}
+		dbmap = (char *) m;
+	}
+
+
+
+	inline
+	void MDDatabase::map_index ()
+	{
+		if (idxmap != NULL) munmap(idxmap, idxsize);
+		idxmap = NULL;
+		idxsize = 0;
+		nindexed = 0;
+
+		int fd = ::open(idxfile.c_str(), O_RDONLY);
+		if (fd < 0) return;
+
+		struct stat buf;
+		fstat(fd, &buf);
+		if ((size_t) buf.st_size >= sizeof(unsigned long long)){
+			void *m = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (m != MAP_FAILED){
+				idxmap = (char *) m;
+				idxsize = buf.st_size;
+				nindexed = *((unsigned long long *) idxmap);
+
+				// Discarding an index inconsistent with the records (e.g. interrupted build)
+				if (idxsize != sizeof(unsigned long long) + nindexed*sizeof(MDIndexEntry)
+						|| nindexed > count_records()){
+					munmap(idxmap, idxsize);
+					idxmap = NULL; idxsize = 0; nindexed = 0;
+				}
+			}
+		}
+		::close(fd);
+	}
+
+
+
+	inline
+	bool MDDatabase::open (std::string dbloc, bool wrt)
+	{
+		close();
+
+		dbfile = dbloc + "/md_results.db";
+		idxfile = dbloc + "/md_results.idx";
+		writable = wrt;
+
+		dbfd = ::open(dbfile.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+		if (dbfd < 0) return false;
+
+		// Only one of the runs creating the database at once writes its header
+		lock(writable ? LOCK_EX : LOCK_SH);
+
+		struct stat buf;
+		fstat(dbfd, &buf);
+		if (buf.st_size == 0){
+			if (!writable){ lock(LOCK_UN); ::close(dbfd); dbfd = -1; return false; }
+			MDDatabaseHeader hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			strncpy(hdr.magic, "HMMMDDB", sizeof(hdr.magic));
+			hdr.version = 1;
+			hdr.record_size = sizeof(MDRecord);
+			hdr.nrecords = 0;
+			if (write(dbfd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+				std::cerr << "Failed initializing the MD database file " << dbfile << std::endl;
+				exit(1);
+			}
+		}
+
+		map_records();
+
+		const MDDatabaseHeader *hdr = (const MDDatabaseHeader *) dbmap;
+		if (dbsize >= sizeof(MDDatabaseHeader)
+				&& (strncmp(hdr->magic, "HMMMDDB", sizeof(hdr->magic)) != 0
+						|| hdr->record_size != sizeof(MDRecord))){
+			std::cerr << "Incompatible MD database file " << dbfile << std::endl;
+			exit(1);
+		}
+
+		// Rejecting a truncated file (e.g. partly copied), whose header or records are not all mapped
+		if (dbsize < sizeof(MDDatabaseHeader)
+				|| hdr->nrecords > (dbsize - sizeof(MDDatabaseHeader))/sizeof(MDRecord)){
+			std::cerr << "Truncated MD database file " << dbfile << std::endl;
+			lock(LOCK_UN);
+			close();
+			return false;
+		}
+
+		map_index();
+		lock(LOCK_UN);
+		return true;
+	}
+
+
+
+	inline
+	void MDDatabase::close ()
+	{
+		if (dbmap != NULL) munmap(dbmap, dbsize);
+		if (idxmap != NULL) munmap(idxmap, idxsize);
+		if (dbfd >= 0) ::close(dbfd);
+		dbmap = NULL; idxmap = NULL; dbfd = -1;
+		dbsize = 0; idxsize = 0; nindexed = 0;
+	}
+
+
+
+	// Number of records, at most those within the mapped file (the header of a file grown by
+	// another process after it was mapped may already count records which are not mapped here).
+	// The caller holds the lock.
+	inline
+	unsigned long long MDDatabase::count_records () const
+	{
+		if (dbmap == NULL || dbsize < sizeof(MDDatabaseHeader)) return 0;
+		unsigned long long nmapped = (dbsize - sizeof(MDDatabaseHeader))/sizeof(MDRecord);
+		return std::min(((const MDDatabaseHeader *) dbmap)->nrecords, nmapped);
+	}
+
+
+
+	inline
+	unsigned long long MDDatabase::size () const
+	{
+		if (dbmap == NULL) return 0;
+		lock(LOCK_SH);
+		unsigned long long n = count_records();
+		lock(LOCK_UN);
+		return n;
+	}
+
+
+
+	inline
+	const MDRecord &MDDatabase::record (unsigned long long id) const
+	{
+		return ((const MDRecord *) (dbmap + sizeof(MDDatabaseHeader)))[id];
+	}
+
+
+
+	// Records are copied to the grown mapped file before the number of records in the header
+	// is updated, so that an interrupted append leaves the database in its previous state.
+	// The file is mapped again under the lock, to append after the records of the other runs.
+	inline
+	void MDDatabase::append (const std::vector<MDRecord> &records)
+	{
+		if (!writable || records.size() == 0) return;
+
+		lock(LOCK_EX);
+		map_records();
+
+		unsigned long long n = count_records();
+		size_t newsize = sizeof(MDDatabaseHeader) + (n + records.size())*sizeof(MDRecord);
+		if (ftruncate(dbfd, newsize) != 0){
+			std::cerr << "Failed growing the MD database file " << dbfile << std::endl;
+			exit(1);
+		}
+		map_records();
+
+		memcpy(dbmap + sizeof(MDDatabaseHeader) + n*sizeof(MDRecord), &records[0],
+				records.size()*sizeof(MDRecord));
+		msync(dbmap, dbsize, MS_SYNC);
+
+		((MDDatabaseHeader *) dbmap)->nrecords = n + records.size();
+		msync(dbmap, sizeof(MDDatabaseHeader), MS_SYNC);
+
+		lock(LOCK_UN);
+	}
+
+
+
+	inline
+	void MDDatabase::build_index ()
+	{
+		lock(LOCK_EX);
+		map_records();
+
+		unsigned long long n = count_records();
+
+		std::vector<MDIndexEntry> entries (n);
+		for (unsigned long long i=0; i<n; i++){
+			memset(entries[i].mat, 0, sizeof(entries[i].mat));
+			strncpy(entries[i].mat, record(i).mat, sizeof(entries[i].mat)-1);
+			entries[i].norm = md_strain_norm(record(i).strain);
+			entries[i].id = i;
+		}
+		std::sort(entries.begin(), entries.end());
+
+		// Written aside then renamed, not to disturb concurrent readers
+		std::string tmpfile = idxfile + ".tmp";
+		std::ofstream ofile (tmpfile.c_str(), std::ios::binary);
+		ofile.write((const char *) &n, sizeof(n));
+		if (n > 0) ofile.write((const char *) &entries[0], n*sizeof(MDIndexEntry));
+		ofile.close();
+		rename(tmpfile.c_str(), idxfile.c_str());
+
+		map_index();
+		lock(LOCK_UN);
+	}
+
+
+
+	// Identifiers of the records of a material (and of a replica, if 'repl' > 0) with a
+	// strain increment within 'tol' of the given increment
+	inline
+	void MDDatabase::query (std::string mat, int repl, const double strain[6], double tol,
+			std::vector<unsigned long long> &ids) const
+	{
+		ids.clear();
+		if (dbmap == NULL) return;
+		double qnorm = md_strain_norm(strain);
+
+		lock(LOCK_SH);
+		unsigned long long n = count_records();
+
+		if (nindexed > 0){
+			const MDIndexEntry *entries = (const MDIndexEntry *) (idxmap + sizeof(unsigned long long));
+
+			// The distance between two increments is at least the difference of their norms
+			MDIndexEntry lo;
+			memset(lo.mat, 0, sizeof(lo.mat));
+			strncpy(lo.mat, mat.c_str(), sizeof(lo.mat)-1);
+			lo.norm = qnorm - tol;
+			lo.id = 0;
+
+			const MDIndexEntry *it = std::lower_bound(entries, entries + nindexed, lo);
+			for (; it != entries + nindexed; ++it){
+				if (strncmp(it->mat, lo.mat, sizeof(lo.mat)) != 0 || it->norm > qnorm + tol) break;
+				const MDRecord &r = record(it->id);
+				if (repl > 0 && r.repl != repl) continue;
+				if (md_strain_distance(r.strain, strain) <= tol) ids.push_back(it->id);
+			}
+		}
+
+		for (unsigned long long i=nindexed; i<n; i++){
+			const MDRecord &r = record(i);
+			if (mat != r.mat) continue;
+			if (repl > 0 && r.repl != repl) continue;
+			if (md_strain_distance(r.strain, strain) <= tol) ids.push_back(i);
+		}
+
+		lock(LOCK_UN);
+	}
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef NN_SURROGATE_H
+#define NN_SURROGATE_H
+
+#include <vector>
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+namespace HMM
+{
+	// Small feed-forward neural network (two tanh hidden layers, linear output) for the
+	// regression of the stress of a material as a function of a strain history descriptor
+	// and of a strain increment. Inputs and outputs are standardized with the statistics of
+	// the first training set, which are then kept, so that later trainings can start from
+	// the current weights.
+	//
+	// Inference is batched: the activations of a layer are stored for the whole batch with
+	// the batch index running fastest, so that the innermost loops are contiguous and
+	// vectorized by the compiler.
+	class NNSurrogate
+	{
+	public:
+		NNSurrogate ();
+
+		void init (unsigned int nin, unsigned int nhid, unsigned int nout, unsigned int seed);
+
+		void train (const std::vector<double> &X, const std::vector<double> &Y,
+				unsigned int nepochs, double lrate, unsigned int seed);
+		void predict (const std::vector<double> &X, unsigned int n, std::vector<double> &Y) const;
+
+		double error (const std::vector<double> &X, const std::vector<double> &Y) const;
+
+		bool trained () const;
+		unsigned int n_inputs () const;
+		unsigned int n_outputs () const;
+
+		void pack (std::vector<double> &data) const;
+		void unpack (const std::vector<double> &data);
+
+	private:
+		void standardize (const std::vector<double> &X, const std::vector<double> &Y);
+		void forward (const double *x, double *h1, double *h2, double *y) const;
+
+		unsigned int						ninp;
+		unsigned int						nhid;
+		unsigned int						nout;
+		bool								is_trained;
+
+		// Parameters of the layers, weights stored row-major (output x input), then biases
+		std::vector<double>					params;
+		unsigned int						ow1, ob1, ow2, ob2, ow3, ob3;
+
+		std::vector<double>					xmean, xstd;
+		std::vector<double>					ymean, ystd;
+	};
+
+
+
+	inline
+	NNSurrogate::NNSurrogate ()
+	:
+		ninp (0),
+		nhid (0),
+		nout (0),
+		is_trained (false),
+		ow1 (0), ob1 (0), ow2 (0), ob2 (0), ow3 (0), ob3 (0)
+	{}
+
+
+
+	inline
+	void NNSurrogate::init (unsigned int ni, unsigned int nh, unsigned int no, unsigned int seed)
+	{
+		ninp = ni; nhid = nh; nout = no;
+		is_trained = false;
+
+		ow1 = 0; ob1 = ow1 + nhid*ninp;
+		ow2 = ob1 + nhid; ob2 = ow2 + nhid*nhid;
+		ow3 = ob2 + nhid; ob3 = ow3 + nout*nhid;
+		params.assign(ob3 + nout, 0.);
+
+		// Glorot initialization of the weights, zero biases
+		std::mt19937 gen (seed);
+		std::normal_distribution<double> dist1 (0., sqrt(2.0/(ninp+nhid)));
+		std::normal_distribution<double> dist2 (0., sqrt(1.0/nhid));
+		std::normal_distribution<double> dist3 (0., sqrt(2.0/(nhid+nout)));
+		for (unsigned int i=ow1; i<ob1; i++) params[i] = dist1(gen);
+		for (unsigned int i=ow2; i<ob2; i++) params[i] = dist2(gen);
+		for (unsigned int i=ow3; i<ob3; i++) params[i] = dist3(gen);
+
+		xmean.assign(ninp, 0.); xstd.assign(ninp, 1.);
+		ymean.assign(nout, 0.); ystd.assign(nout, 1.);
+	}
+
+
+
+	inline
+	bool NNSurrogate::trained () const
+	{
+		return is_trained;
+	}
+
+
+
+	inline
+	unsigned int NNSurrogate::n_inputs () const
+	{
+		return ninp;
+	}
+
+
+
+	inline
+	unsigned int NNSurrogate::n_outputs () const
+	{
+		return nout;
+	}
+
+
+
+	inline
+	void NNSurrogate::standardize (const std::vector<double> &X, const std::vector<double> &Y)
+	{
+		unsigned int n = X.size()/ninp;
+
+		for (unsigned int j=0; j<ninp; j++){
+			double m = 0., v = 0.;
+			for (unsigned int i=0; i<n; i++) m += X[i*ninp+j];
+			m /= n;
+			for (unsigned int i=0; i<n; i++) v += (X[i*ninp+j]-m)*(X[i*ninp+j]-m);
+			xmean[j] = m;
+			xstd[j] = (v > 0.) ? sqrt(v/n) : 1.0;
+		}
+		for (unsigned int j=0; j<nout; j++){
+			double m = 0., v = 0.;
+			for (unsigned int i=0; i<n; i++) m += Y[i*nout+j];
+			m /= n;
+			for (unsigned int i=0; i<n; i++) v += (Y[i*nout+j]-m)*(Y[i*nout+j]-m);
+			ymean[j] = m;
+			ystd[j] = (v > 0.) ? sqrt(v/n) : 1.0;
+		}
+	}
+
+
+
+	// Forward pass of a single standardized input, keeping the activations for training
+	inline
+	void NNSurrogate::forward (const double *x, double *h1, double *h2, double *y) const
+	{
+		for (unsigned int i=0; i<nhid; i++){
+			double s = params[ob1+i];
+			for (unsigned int j=0; j<ninp; j++) s += params[ow1+i*ninp+j]*x[j];
+			h1[i] = tanh(s);
+		}
+		for (unsigned int i=0; i<nhid; i++){
+			double s = params[ob2+i];
+			for (unsigned int j=0; j<nhid; j++) s += params[ow2+i*nhid+j]*h1[j];
+			h2[i] = tanh(s);
+		}
+		for (unsigned int i=0; i<nout; i++){
+			double s = params[ob3+i];
+			for (unsigned int j=0; j<nhid; j++) s += params[ow3+i*nhid+j]*h2[j];
+			y[i] = s;
+		}
+	}
+
+
+
+	// Mini-batch training with Adam on the mean squared error of the standardized outputs
+	inline
+	void NNSurrogate::train (const std::vector<double> &X, const std::vector<double> &Y,
+			unsigned int nepochs, double lrate, unsigned int seed)
+	{
+		unsigned int n = X.size()/ninp;
+		if (n == 0) return;
+		if (!is_trained) standardize(X, Y);
+
+		std::vector<double> xs (n*ninp), ys (n*nout);
+		for (unsigned int i=0; i<n; i++){
+			for (unsigned int j=0; j<ninp; j++) xs[i*ninp+j] = (X[i*ninp+j]-xmean[j])/xstd[j];
+			for (unsigned int j=0; j<nout; j++) ys[i*nout+j] = (Y[i*nout+j]-ymean[j])/ystd[j];
+		}
+
+		const unsigned int nbatch = 32;
+		const double beta1 = 0.9, beta2 = 0.999, eps = 1.0e-8;
+		std::vector<double> grad (params.size()), mom (params.size(), 0.), vel (params.size(), 0.);
+		std::vector<double> h1 (nhid), h2 (nhid), y (nout), d1 (nhid), d2 (nhid), d3 (nout);
+
+		std::vector<unsigned int> order (n);
+		for (unsigned int i=0; i<n; i++) order[i] = i;
+		std::mt19937 gen (seed);
+
+		unsigned long long t = 0;
+		for (unsigned int e=0; e<nepochs; e++){
+			std::shuffle(order.begin(), order.end(), gen);
+			for (unsigned int b=0; b<n; b+=nbatch){
+				unsigned int be = std::min(n, b+nbatch);
+				std::fill(grad.begin(), grad.end(), 0.);
+
+				// Backpropagation, accumulated over the batch
+				for (unsigned int ib=b; ib<be; ib++){
+					const double *x = &xs[order[ib]*ninp];
+					forward(x, &h1[0], &h2[0], &y[0]);
+
+					for (unsigned int i=0; i<nout; i++) d3[i] = (y[i] - ys[order[ib]*nout+i])/(be-b);
+					for (unsigned int j=0; j<nhid; j++){
+						double s = 0.;
+						for (unsigned int i=0; i<nout; i++) s += params[ow3+i*nhid+j]*d3[i];
+						d2[j] = s*(1.0 - h2[j]*h2[j]);
+					}
+					for (unsigned int j=0; j<nhid; j++){
+						double s = 0.;
+						for (unsigned int i=0; i<nhid; i++) s += params[ow2+i*nhid+j]*d2[i];
+						d1[j] = s*(1.0 - h1[j]*h1[j]);
+					}
+
+					for (unsigned int i=0; i<nout; i++){
+						for (unsigned int j=0; j<nhid; j++) grad[ow3+i*nhid+j] += d3[i]*h2[j];
+						grad[ob3+i] += d3[i];
+					}
+					for (unsigned int i=0; i<nhid; i++){
+						for (unsigned int j=0; j<nhid; j++) grad[ow2+i*nhid+j] += d2[i]*h1[j];
+						grad[ob2+i] += d2[i];
+					}
+					for (unsigned int i=0; i<nhid; i++){
+						for (unsigned int j=0; j<ninp; j++) grad[ow1+i*ninp+j] += d1[i]*x[j];
+						grad[ob1+i] += d1[i];
+					}
+				}
+
+				t++;
+				double c1 = 1.0 - pow(beta1, t), c2 = 1.0 - pow(beta2, t);
+				for (unsigned int p=0; p<params.size(); p++){
+					mom[p] = beta1*mom[p] + (1.0-beta1)*grad[p];
+					vel[p] = beta2*vel[p] + (1.0-beta2)*grad[p]*grad[p];
+					params[p] -= lrate*(mom[p]/c1)/(sqrt(vel[p]/c2) + eps);
+				}
+			}
+		}
+
+		is_trained = true;
+	}
+
+
+
+	// Batched inference of 'n' inputs stored row-major in X
+	inline
+	void NNSurrogate::predict (const std::vector<double> &X, unsigned int n, std::vector<double> &Y) const
+	{
+		Y.assign(n*nout, 0.);
+		if (n == 0) return;
+
+		// Layer activations stored as (unit x batch)
+		std::vector<double> a0 (ninp*n), a1 (nhid*n), a2 (nhid*n);
+		for (unsigned int j=0; j<ninp; j++){
+			double m = xmean[j], s = xstd[j];
+			double *a = &a0[j*n];
+			for (unsigned int k=0; k<n; k++) a[k] = (X[k*ninp+j]-m)/s;
+		}
+
+		for (unsigned int i=0; i<nhid; i++){
+			double *a = &a1[i*n];
+			for (unsigned int k=0; k<n; k++) a[k] = params[ob1+i];
+			for (unsigned int j=0; j<ninp; j++){
+				double w = params[ow1+i*ninp+j];
+				const double *x = &a0[j*n];
+				for (unsigned int k=0; k<n; k++) a[k] += w*x[k];
+			}
+			for (unsigned int k=0; k<n; k++) a[k] = tanh(a[k]);
+		}
+
+		for (unsigned int i=0; i<nhid; i++){
+			double *a = &a2[i*n];
+			for (unsigned int k=0; k<n; k++) a[k] = params[ob2+i];
+			for (unsigned int j=0; j<nhid; j++){
+				double w = params[ow2+i*nhid+j];
+				const double *x = &a1[j*n];
+				for (unsigned int k=0; k<n; k++) a[k] += w*x[k];
+			}
+			for (unsigned int k=0; k<n; k++) a[k] = tanh(a[k]);
+		}
+
+		std::vector<double> a3 (n);
+		for (unsigned int i=0; i<nout; i++){
+			for (unsigned int k=0; k<n; k++) a3[k] = params[ob3+i];
+			for (unsigned int j=0; j<nhid; j++){
+				double w = params[ow3+i*nhid+j];
+				const double *x = &a2[j*n];
+				for (unsigned int k=0; k<n; k++) a3[k] += w*x[k];
+			}
+			for (unsigned int k=0; k<n; k++) Y[k*nout+i] = a3[k]*ystd[i] + ymean[i];
+		}
+	}
+
+
+
+	// Root mean square error of the predictions of a set of samples
+	inline
+	double NNSurrogate::error (const std::vector<double> &X, const std::vector<double> &Y) const
+	{
+		unsigned int n = X.size()/ninp;
+		if (n == 0) return 0.;
+
+		std::vector<double> P;
+		predict(X, n, P);
+
+		double e = 0.;
+		for (unsigned int i=0; i<n*nout; i++) e += (P[i]-Y[i])*(P[i]-Y[i]);
+		return sqrt(e/n);
+	}
+
+
+
+	// Serialization of the network, e.g. to broadcast it
+	inline
+	void NNSurrogate::pack (std::vector<double> &data) const
+	{
+		data.clear();
+		data.push_back(ninp); data.push_back(nhid); data.push_back(nout);
+		data.push_back(is_trained ? 1.0 : 0.0);
+		data.insert(data.end(), params.begin(), params.end());
+		data.insert(data.end(), xmean.begin(), xmean.end());
+		data.insert(data.end(), xstd.begin(), xstd.end());
+		data.insert(data.end(), ymean.begin(), ymean.end());
+		data.insert(data.end(), ystd.begin(), ystd.end());
+	}
+
+
+
+	inline
+	void NNSurrogate::unpack (const std::vector<double> &data)
+	{
+		init(data[0], data[1], data[2], 0);
+		is_trained = (data[3] > 0.5);
+
+		unsigned int p = 4;
+		std::copy(data.begin()+p, data.begin()+p+params.size(), params.begin()); p += params.size();
+		std::copy(data.begin()+p, data.begin()+p+ninp, xmean.begin()); p += ninp;
+		std::copy(data.begin()+p, data.begin()+p+ninp, xstd.begin()); p += ninp;
+		std::copy(data.begin()+p, data.begin()+p+nout, ymean.begin()); p += nout;
+		std::copy(data.begin()+p, data.begin()+p+nout, ystd.begin());
+	}
+}
+
+#endif
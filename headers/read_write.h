@@ -81,6 +81,15 @@ bool file_exists(const char* file) {
 }
 
 
+bool copy_file(const char* src, const char* dst) {
+	std::ifstream in (src, std::ios::binary);
+	if (!in.is_open()) return false;
+	std::ofstream out (dst, std::ios::binary);
+	out << in.rdbuf();
+	return out.good();
+}
+
+
 template <int dim>
 inline
 void
@@ -120,6 +129,32 @@ read_tensor (const char *filename, Tensor<1,dim> &tensor)
 	else std::cout << "Unable to open" << filename << " to read it" << std::endl;
 }
 
+template <int dim>
+inline
+bool
+read_tensor (const char *filename, Tensor<2,dim> &tensor)
+{
+	std::ifstream ifile;
+
+	bool load_ok = false;
+
+	ifile.open (filename);
+	if (ifile.is_open())
+	{
+		load_ok = true;
+		for(unsigned int k=0;k<dim;k++)
+			for(unsigned int l=0;l<dim;l++)
+			{
+				char line[1024];
+				if(ifile.getline(line, sizeof(line)))
+					tensor[k][l] = std::strtod(line, NULL);
+			}
+		ifile.close();
+	}
+	else std::cout << "Unable to open" << filename << " to read it" << std::endl;
+return load_ok;
+}
+
 template <int dim>
 inline
 bool
@@ -204,6 +239,24 @@ write_tensor (const char *filename, Tensor<1,dim> &tensor)
 	else std::cout << "Unable to open" << filename << " to write in it" << std::endl;
 }
 
+template <int dim>
+inline
+void
+write_tensor (const char *filename, Tensor<2,dim> &tensor)
+{
+	std::ofstream ofile;
+
+	ofile.open (filename);
+	if (ofile.is_open())
+	{
+		for(unsigned int k=0;k<dim;k++)
+			for(unsigned int l=0;l<dim;l++)
+				ofile << std::setprecision(16) << tensor[k][l] << std::endl;
+		ofile.close();
+	}
+	else std::cout << "Unable to open" << filename << " to write in it" << std::endl;
+}
+
 template <int dim>
 inline
 void
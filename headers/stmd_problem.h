@@ -25,6 +25,7 @@
 
 // Specifically built header files
 #include "read_write.h"
+#include "lammps_script_cache.h"
 
 namespace HMM
 {
@@ -36,19 +37,36 @@ namespace HMM
 	class STMDProblem
 	{
 	public:
-		STMDProblem (MPI_Comm mdcomm, int pcolor);
+		STMDProblem (MPI_Comm mdcomm, int pcolor, const LAMMPSScriptCache *mdscr = NULL);
 		~STMDProblem ();
 		void strain (std::string cid, std::string 	tid, std::string cmat,
 				  std::string slocout, std::string slocres, std::string llochom,
 				  std::string qplogloc, std::string scrloc,
 				  std::string strainif, std::string stressof,
 				  unsigned int rep, double mdts, double mdtem, unsigned int mdnss,
-				  double mdss, std::string mdff, bool outhom, bool checksav);
+				  double mdss, std::string mdff, std::string mdrs, bool outhom, bool checksav,
+				  bool pgrid, double ghcut, bool lbal, bool prb = false);
+		void tune_kspace (std::string cmat, std::string slocout, std::string scrloc,
+				  unsigned int rep, double mdts, double mdtem, double kacc);
 
 	private:
 
 		void lammps_straining();
 
+		void run_script(LAMMPS *lmp, std::string name);
+
+		void read_last_state(LAMMPS *lmp, const char *initdata, const char *straindata_last,
+				const char *straindata_legacy);
+
+		double outer_timestep_factor();
+
+		void load_kspace_settings();
+		void set_kspace_settings(LAMMPS *lmp);
+		void apply_kspace_settings(LAMMPS *lmp);
+
+		bool estimate_box_lengths(const char *lengthfile, std::vector<double> &lbox);
+		void set_processor_grid(LAMMPS *lmp, const std::vector<double> &lbox);
+
 		MPI_Comm 							md_batch_communicator;
 		const int 							md_batch_n_processes;
 		const int 							this_md_batch_process;
@@ -56,6 +74,9 @@ namespace HMM
 
 		ConditionalOStream 					mdcout;
 
+		const LAMMPSScriptCache				*md_scripts;
+		std::map<std::string,std::string>	script_vars;
+
 		SymmetricTensor<2,dim> 				loc_rep_strain;
 		SymmetricTensor<2,dim> 				loc_rep_stress;
 
@@ -79,22 +100,35 @@ namespace HMM
 		unsigned int 						md_nsteps_sample;
 		double								md_strain_rate;
 		std::string							md_force_field;
+		std::string							md_run_style;
 
 		bool								output_homog;
 		bool								checkpoint_save;
+		bool								probe;
+
+		bool								select_proc_grid;
+		double								md_ghost_cutoff;
+		bool								rcb_balance;
+
+		bool								kspace_tuned;
+		double								kspace_accuracy;
+		double								kspace_cutoff;
+		int									kspace_order;
 
 	};
 
 
 
 	template <int dim>
-	STMDProblem<dim>::STMDProblem (MPI_Comm mdcomm, int pcolor)
+	STMDProblem<dim>::STMDProblem (MPI_Comm mdcomm, int pcolor, const LAMMPSScriptCache *mdscr)
 	:
 		md_batch_communicator (mdcomm),
 		md_batch_n_processes (Utilities::MPI::n_mpi_processes(md_batch_communicator)),
 		this_md_batch_process (Utilities::MPI::this_mpi_process(md_batch_communicator)),
 		md_batch_pcolor (pcolor),
-		mdcout (std::cout,(this_md_batch_process == 0))
+		mdcout (std::cout,(this_md_batch_process == 0)),
+		md_scripts (mdscr),
+		kspace_tuned (false)
 	{}
 
 
@@ -105,6 +139,308 @@ namespace HMM
 
 
 
+	// Running a script of the scripts directory, from the in-memory copy broadcast at the
+	// beginning of the run if available, otherwise reading it from the filesystem
+	template <int dim>
+	void STMDProblem<dim>::run_script (LAMMPS *lmp, std::string name)
+	{
+		if(md_scripts != NULL && md_scripts->has(name)){
+			md_scripts->submit(lmp, name, script_vars);
+		}
+		else{
+			char cfile[1024];
+			sprintf(cfile, "%s/%s", scriptsloc.c_str(), name.c_str());
+			lammps_file(lmp,cfile);
+		}
+	}
+
+
+
+	// Reading the box dimensions of the state to be restarted from, written at the end
+	// of the previous straining of this cell or during the equilibration. The reading is
+	// done by the first process of the batch, then shared so that every process issues
+	// the same 'processors' command.
+	template <int dim>
+	bool STMDProblem<dim>::estimate_box_lengths (const char *lengthfile, std::vector<double> &lbox)
+	{
+		int load_ok = 0;
+		Tensor<1,dim> lbt;
+
+		if(this_md_batch_process == 0){
+			if(file_exists(lengthfile)){
+				read_tensor<dim>(lengthfile, lbt);
+				load_ok = 1;
+			}
+		}
+		MPI_Bcast(&load_ok, 1, MPI_INT, 0, md_batch_communicator);
+
+		if(load_ok){
+			lbox.resize(dim);
+			for(unsigned int i=0;i<dim;i++) lbox[i] = lbt[i];
+			MPI_Bcast(&lbox[0], dim, MPI_DOUBLE, 0, md_batch_communicator);
+		}
+
+		return load_ok;
+	}
+
+
+
+	// Selecting the decomposition of the box on the processes of the batch. Among all the
+	// factorizations Px*Py*Pz of the number of processes, the one minimizing the volume of
+	// the ghost shell around a sub-domain, (a+2r)(b+2r)(c+2r)-abc with a=lx/Px..., is kept.
+	// Strongly anisotropic boxes (large strains applied with fix deform) are then cut along
+	// their longest dimensions instead of following the default 'processors * * *' choice.
+	// Has to be called before the box is defined (read_restart).
+	template <int dim>
+	void STMDProblem<dim>::set_processor_grid (LAMMPS *lmp, const std::vector<double> &lbox)
+	{
+		int np = md_batch_n_processes;
+		double rc = md_ghost_cutoff;
+
+		int best_grid[3] = {1, 1, np};
+		double best_cost = -1.0;
+
+		for(int px=1; px<=np; px++){
+			if(np%px != 0) continue;
+			for(int py=1; py<=np/px; py++){
+				if((np/px)%py != 0) continue;
+				int pz = np/(px*py);
+
+				double a = lbox[0]/px, b = lbox[1]/py, c = lbox[2]/pz;
+
+				// Ghost shell volume, or subdomain surface if no cutoff is provided
+				double cost;
+				if(rc > 0.0) cost = (a+2*rc)*(b+2*rc)*(c+2*rc) - a*b*c;
+				else cost = a*b + b*c + a*c;
+
+				if(best_cost < 0.0 || cost < best_cost){
+					best_cost = cost;
+					best_grid[0] = px; best_grid[1] = py; best_grid[2] = pz;
+				}
+			}
+		}
+
+		char cline[1024];
+		sprintf(cline, "processors %d %d %d", best_grid[0], best_grid[1], best_grid[2]);
+		lammps_command(lmp,cline);
+	}
+
+
+
+	// Ratio between the outer timestep of the straining run and the timestep of the
+	// bonded interactions, i.e. the product of the loop factors n2...nN of the run style
+	// 'respa N n2 ... nN ...', or 1 for the Verlet integrator
+	template <int dim>
+	double STMDProblem<dim>::outer_timestep_factor ()
+	{
+		std::istringstream iss(md_run_style);
+		std::string rsname;
+		iss >> rsname;
+
+		double factor = 1.0;
+		if(rsname == "respa"){
+			int nlevels = 0;
+			iss >> nlevels;
+			for(int il=1; il<nlevels; il++){
+				int loop = 1;
+				iss >> loop;
+				factor *= loop;
+			}
+		}
+		else if(rsname != "verlet"){
+			std::cerr << "Error: Run style is " << md_run_style
+					  << " but only 'verlet' and 'respa' are implemented... "
+					  << std::endl;
+			exit(1);
+		}
+
+		return factor;
+	}
+
+
+
+	// Restoring the last state of the system of this cell. States are binary restart files,
+	// written with write_restart for both force fields, and include the velocities and
+	// the charges (ReaxFF). States written by previous versions as a custom dump (ReaxFF)
+	// or as a restart file with a .dump extension (OPLS) are still restored.
+	template <int dim>
+	void STMDProblem<dim>::read_last_state (LAMMPS *lmp, const char *initdata, const char *straindata_last,
+			const char *straindata_legacy)
+	{
+		char cline[1024];
+
+		if (file_exists(straindata_last)){
+			sprintf(cline, "read_restart %s", straindata_last); lammps_command(lmp,cline);
+		}
+		else if (md_force_field == "reax") {
+			sprintf(cline, "read_restart %s", initdata); lammps_command(lmp,cline); /*reaxff*/
+			sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_legacy); /*reaxff*/
+			lammps_command(lmp,cline); /*reaxff*/
+		}
+		else if (md_force_field == "opls") {
+			sprintf(cline, "read_restart %s", straindata_legacy); /*opls*/
+			lammps_command(lmp,cline); /*opls*/
+		}
+	}
+
+
+
+	// Loading the long-range solver settings tuned for the material of the cell and
+	// the number of processes of the batch, if they exist (see tune_kspace)
+	template <int dim>
+	void STMDProblem<dim>::load_kspace_settings ()
+	{
+		char tunefile[1024];
+		sprintf(tunefile, "%s/kspace.%s.%d.tune", statelocout.c_str(), cellmat.c_str(),
+				md_batch_n_processes);
+
+		double ksettings[3];
+		int load_ok = 0;
+		if(this_md_batch_process == 0){
+			std::ifstream ifile(tunefile);
+			if (ifile.is_open()){
+				if(ifile >> ksettings[0] >> ksettings[1] >> ksettings[2]) load_ok = 1;
+				ifile.close();
+			}
+		}
+		MPI_Bcast(&load_ok, 1, MPI_INT, 0, md_batch_communicator);
+		MPI_Bcast(ksettings, 3, MPI_DOUBLE, 0, md_batch_communicator);
+
+		kspace_tuned = load_ok;
+		if(kspace_tuned){
+			kspace_accuracy = ksettings[0];
+			kspace_cutoff = ksettings[1];
+			kspace_order = int(ksettings[2]);
+		}
+	}
+
+
+
+	// Defining the tuned settings as index variables before reading in.set.lammps, which
+	// then ignores its own default definitions of these variables
+	template <int dim>
+	void STMDProblem<dim>::set_kspace_settings (LAMMPS *lmp)
+	{
+		if(!kspace_tuned) return;
+
+		char cline[1024];
+		sprintf(cline, "variable kacc index %e", kspace_accuracy); lammps_command(lmp,cline);
+		sprintf(cline, "variable kcut index %f", kspace_cutoff); lammps_command(lmp,cline);
+		sprintf(cline, "variable kord index %d", kspace_order); lammps_command(lmp,cline);
+	}
+
+
+
+	// A restart file restores the pair style and coulombic cutoff it was written with, thus
+	// the long-range solver settings (the kacc, kcut and kord variables) are issued again
+	// by in.kspace.lammps once the state has been read (OPLS only)
+	template <int dim>
+	void STMDProblem<dim>::apply_kspace_settings (LAMMPS *lmp)
+	{
+		run_script(lmp, "in.kspace.lammps");
+	}
+
+
+
+	// Benchmarking a few combinations of real-space coulombic cutoff and PPPM interpolation
+	// order on the initial system of a replica of a given material. The PPPM grid is set by
+	// LAMMPS from the requested accuracy, therefore every combination stays within the force
+	// error tolerance 'kacc', and the fastest one is stored for all the later simulations
+	// of the material on batches of the same number of processes.
+	template <int dim>
+	void STMDProblem<dim>::tune_kspace (std::string cmat, std::string slocout, std::string scrloc,
+			  unsigned int rep, double mdts, double mdtem, double kacc)
+	{
+		// Coulombic cutoff cannot exceed the LJ cutoff (12.0) of the scripts
+		std::vector<double> kcuts = {8.0, 9.0, 10.0, 12.0};
+		std::vector<int> kords = {3, 5, 7};
+		int nsteps = 100;
+
+		char initdata[1024];
+		sprintf(initdata, "%s/init.%s_%d.bin", slocout.c_str(), cmat.c_str(), rep);
+
+		char tunefile[1024];
+		sprintf(tunefile, "%s/kspace.%s.%d.tune", slocout.c_str(), cmat.c_str(),
+				md_batch_n_processes);
+
+		scriptsloc = scrloc;
+
+		char cline[1024];
+
+		int nargs = 5;
+		char **lmparg = new char*[nargs];
+		lmparg[0] = NULL;
+		lmparg[1] = (char *) "-screen";
+		lmparg[2] = (char *) "none";
+		lmparg[3] = (char *) "-log";
+		lmparg[4] = (char *) "none";
+
+		double best_time = -1.0;
+		double best_cut = 9.0;
+		int best_ord = 5;
+
+		for(unsigned int ic=0; ic<kcuts.size(); ic++)
+			for(unsigned int io=0; io<kords.size(); io++)
+			{
+				LAMMPS *lmp = NULL;
+				lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
+
+				sprintf(cline, "variable kacc index %e", kacc); lammps_command(lmp,cline);
+				sprintf(cline, "variable kcut index %f", kcuts[ic]); lammps_command(lmp,cline);
+				sprintf(cline, "variable kord index %d", kords[io]); lammps_command(lmp,cline);
+
+				sprintf(cline, "variable tempt equal %f", mdtem); lammps_command(lmp,cline);
+
+				run_script(lmp, "in.set.lammps");
+
+				sprintf(cline, "read_restart %s", initdata); lammps_command(lmp,cline);
+				apply_kspace_settings(lmp);
+
+				sprintf(cline, "fix 3 all nvt temp %f %f 100.0", mdtem, mdtem); lammps_command(lmp,cline);
+				sprintf(cline, "timestep %f", mdts); lammps_command(lmp,cline);
+
+				// Setup (including PPPM grid) is excluded from the timing
+				sprintf(cline, "run 0"); lammps_command(lmp,cline);
+
+				MPI_Barrier(md_batch_communicator);
+				double tstart = MPI_Wtime();
+				sprintf(cline, "run %d pre no post no", nsteps); lammps_command(lmp,cline);
+				double ltime = MPI_Wtime() - tstart;
+
+				double rtime;
+				MPI_Allreduce(&ltime, &rtime, 1, MPI_DOUBLE, MPI_MAX, md_batch_communicator);
+
+				delete lmp;
+
+				mdcout << "               "
+						<< "(MD - kspace tuning " << cmat << ") "
+						<< "cutoff " << kcuts[ic] << " order " << kords[io]
+						<< ": " << rtime << " s" << std::endl;
+
+				if(best_time < 0.0 || rtime < best_time){
+					best_time = rtime;
+					best_cut = kcuts[ic];
+					best_ord = kords[io];
+				}
+			}
+
+		if(this_md_batch_process == 0){
+			std::ofstream ofile(tunefile);
+			if (ofile.is_open()){
+				ofile << std::setprecision(16) << kacc << std::endl;
+				ofile << best_cut << std::endl;
+				ofile << best_ord << std::endl;
+				ofile << best_time/nsteps << std::endl;
+				ofile.close();
+			}
+			else std::cout << "Unable to open" << tunefile << " to write in it" << std::endl;
+		}
+
+		delete[] lmparg;
+	}
+
+
+
 	// The straining function is ran on every quadrature point which
 	// requires a stress_update. Since a quandrature point is only reached*
 	// by a subset of processes N, we should automatically see lammps be
@@ -125,26 +461,43 @@ namespace HMM
 		sprintf(initdata, "%s/init.%s.bin", statelocout.c_str(), mdstate);
 
 		char straindata_last[1024];
-		sprintf(straindata_last, "%s/last.%s.%s.dump", statelocout.c_str(),
+		sprintf(straindata_last, "%s/last.%s.%s.bin", statelocout.c_str(),
+				cellid.c_str(), mdstate);
+
+		// State stored by previous versions (text dump for ReaxFF)
+		char straindata_legacy[1024];
+		sprintf(straindata_legacy, "%s/last.%s.%s.dump", statelocout.c_str(),
 				cellid.c_str(), mdstate);
-		// sprintf(straindata_last, "%s/last.%s.%s.bin", statelocout.c_str(), cellid, mdstate);
 
 		char straindata_time[1024];
-		sprintf(straindata_time, "%s/%s.%s.%s.dump", statelocres.c_str(),
+		sprintf(straindata_time, "%s/%s.%s.%s.bin", statelocres.c_str(),
 				timeid.c_str(), cellid.c_str(), mdstate);
-		// sprintf(straindata_lcts, "%s/lcts.%s.%s.bin", statelocres.c_str(), cellid, mdstate);
 
 		char straindata_lcts[1024];
-		sprintf(straindata_lcts, "%s/lcts.%s.%s.dump", statelocres.c_str(),
+		sprintf(straindata_lcts, "%s/lcts.%s.%s.bin", statelocres.c_str(),
+				cellid.c_str(), mdstate);
+
+		// State at the end of a probing simulation, only used for its homogenization
+		char straindata_probe[1024];
+		sprintf(straindata_probe, "%s/probe.%s.%s.bin", statelocout.c_str(),
+				cellid.c_str(), mdstate);
+
+		char initlength[1024];
+		sprintf(initlength, "%s/init.%s.length", statelocout.c_str(), mdstate);
+
+		char lengthdata_last[1024];
+		sprintf(lengthdata_last, "%s/last.%s.%s.length", statelocout.c_str(),
+				cellid.c_str(), mdstate);
+
+		char lengthdata_lcts[1024];
+		sprintf(lengthdata_lcts, "%s/lcts.%s.%s.length", statelocres.c_str(),
 				cellid.c_str(), mdstate);
-		// sprintf(straindata_lcts, "%s/lcts.%s.%s.bin", statelocres.c_str(), cellid, mdstate);
 
 		char homogdata_time[1024];
 		sprintf(homogdata_time, "%s/%s.%s.%s.lammpstrj", loglochom.c_str(),
 				timeid.c_str(), cellid.c_str(), mdstate);
 
 		char cline[1024];
-		char cfile[1024];
 
 		// Specifying the command line options for screen and log output file
 		int nargs = 5;
@@ -160,6 +513,9 @@ namespace HMM
 		LAMMPS *lmp = NULL;
 		lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
 
+		// Long-range solver settings tuned for this material
+		set_kspace_settings(lmp);
+
 		// Passing location for output as variable
 		sprintf(cline, "variable mdt string %s", cellmat.c_str()); lammps_command(lmp,cline);
 		sprintf(cline, "variable loco string %s", qpreplogloc.c_str()); lammps_command(lmp,cline);
@@ -173,8 +529,23 @@ namespace HMM
 
 		// Setting general parameters for LAMMPS independentely of what will be
 		// tested on the sample next.
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.set.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "in.set.lammps");
+
+		// Choosing the processors grid from the box dimensions expected during the
+		// straining: the current box (from the last state, or initial state) plus half
+		// of the length variation to be applied (the strain is passed as a length variation)
+		if(select_proc_grid){
+			bool last_exists = file_exists(straindata_last) || file_exists(straindata_legacy);
+			std::vector<double> lbox;
+			bool lbox_ok = false;
+			if(last_exists) lbox_ok = estimate_box_lengths(lengthdata_last, lbox);
+			if(!lbox_ok) lbox_ok = estimate_box_lengths(initlength, lbox);
+			if(lbox_ok){
+				for(unsigned int i=0;i<dim;i++)
+					lbox[i] = std::max(lbox[i] + 0.5*loc_rep_strain[i][i], 0.5*lbox[i]);
+				set_processor_grid(lmp, lbox);
+			}
+		}
 
 		/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
@@ -187,21 +558,11 @@ namespace HMM
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "   ... from previous state data...   " << std::flush;*/
 
-		// Check the presence of a dump file to restart from
-		std::ifstream ifile(straindata_last);
-		if (ifile.good()){
+		// Check the presence of a state file to restart from
+		if (file_exists(straindata_last) || file_exists(straindata_legacy)){
 			/*mdcout << "  specifically computed." << std::endl;*/
-			ifile.close();
 
-			if (md_force_field == "reax") {
-				sprintf(cline, "read_restart %s", initdata); lammps_command(lmp,cline); /*reaxff*/
-				sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_last); /*reaxff*/
-				lammps_command(lmp,cline); /*reaxff*/
-			}
-			else if (md_force_field == "opls") {
-				sprintf(cline, "read_restart %s", straindata_last); /*opls*/
-				lammps_command(lmp,cline); /*opls*/
-			}
+			read_last_state(lmp, initdata, straindata_last, straindata_legacy);
 
 			sprintf(cline, "print 'specifically computed'"); lammps_command(lmp,cline);
 		}
@@ -213,6 +574,23 @@ namespace HMM
 			sprintf(cline, "print 'initially computed'"); lammps_command(lmp,cline);
 		}
 
+		// Tuned coulombic cutoff instead of the one restored from the state
+		if (md_force_field == "opls" && kspace_tuned) apply_kspace_settings(lmp);
+
+		// Ghost atoms communication cutoff, LAMMPS keeps the largest of this value and
+		// of the neighbor list cutoff
+		if(md_ghost_cutoff > 0.0){
+			sprintf(cline, "comm_modify cutoff %f", md_ghost_cutoff); lammps_command(lmp,cline);
+		}
+
+		// Recursive coordinate bisection for boxes with an inhomogeneous density of atoms
+		// (flake composites), repeated every 1000 steps during the straining
+		if(rcb_balance){
+			sprintf(cline, "comm_style tiled"); lammps_command(lmp,cline);
+			sprintf(cline, "balance 1.1 rcb"); lammps_command(lmp,cline);
+			sprintf(cline, "fix lbal all balance 1000 1.1 rcb"); lammps_command(lmp,cline);
+		}
+
 		// Query box dimensions
 		char vdir[1024];
 		std::vector<double> lbdim (dim);
@@ -230,16 +608,21 @@ namespace HMM
 			loc_rep_strain[i][(i+1)%dim] /= lbdim[(i+2)%dim];
 		}
 
+		// Timestep of the straining run, with rRESPA the timestep provided is the one of
+		// the innermost level (bonded interactions) and the outer timestep is larger
+		double strain_timestep_length = md_timestep_length*outer_timestep_factor();
+
 		// Number of timesteps in the MD simulation, enforcing at least one.
-		int nts = std::max(int(std::ceil(loc_rep_strain.norm()/(md_timestep_length*md_strain_rate)/10)*10),1);
+		int nts = std::max(int(std::ceil(loc_rep_strain.norm()/(strain_timestep_length*md_strain_rate)/10)*10),1);
 
-		sprintf(cline, "variable dts equal %f", md_timestep_length); lammps_command(lmp,cline);
+		sprintf(cline, "variable rstyle index \"%s\"", md_run_style.c_str()); lammps_command(lmp,cline);
+		sprintf(cline, "variable dts equal %f", strain_timestep_length); lammps_command(lmp,cline);
 		sprintf(cline, "variable nts equal %d", nts); lammps_command(lmp,cline);
 
 		for(unsigned int k=0;k<dim;k++)
 			for(unsigned int l=k;l<dim;l++)
 			{
-				sprintf(cline, "variable ceeps_%d%d equal %.6e", k, l, loc_rep_strain[k][l]/(nts*md_timestep_length));
+				sprintf(cline, "variable ceeps_%d%d equal %.6e", k, l, loc_rep_strain[k][l]/(nts*strain_timestep_length));
 				lammps_command(lmp,cline);
 			}
 
@@ -247,31 +630,43 @@ namespace HMM
 		/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "   ... reading and executing in.strain.lammps.       " << std::endl;*/
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.strain.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "in.strain.lammps");
+
+		if(rcb_balance){
+			sprintf(cline, "unfix lbal"); lammps_command(lmp,cline);
+		}
+
+		// Box dimensions at the end of the straining, stored with the state of the system
+		// to set the processors grid of the next simulations of this cell
+		for(unsigned int i=0;i<dim;i++){
+			sprintf(vdir, "ll%d",i+1);
+			lbdim[i] = *((double *) lammps_extract_variable(lmp,vdir,NULL));
+		}
+		if(this_md_batch_process == 0 && !probe){
+			Tensor<1,dim> lbt;
+			for(unsigned int i=0;i<dim;i++) lbt[i] = lbdim[i];
+			write_tensor<dim>(lengthdata_last, lbt);
+			if(checkpoint_save) write_tensor<dim>(lengthdata_lcts, lbt);
+		}
 
 		/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "Saving state data...       " << std::endl;*/
-		// Save data to specific file for this quadrature point
-		if (md_force_field == "opls"){
-			sprintf(cline, "write_restart %s", straindata_last); /*opls*/
-			lammps_command(lmp,cline); /*opls*/
+		// Save data to specific file for this quadrature point, as a binary restart file
+		// for both force fields (the QEq history of fix qeq/reax is not part of it and is
+		// rebuilt at the first step of the next simulation)
+		// A probing simulation leaves the state of the cell untouched
+		if(probe){
+			sprintf(cline, "write_restart %s", straindata_probe); lammps_command(lmp,cline);
 		}
-		else if (md_force_field == "reax"){
-			sprintf(cline, "write_dump all custom %s id type xs ys zs vx vy vz ix iy iz", straindata_last); /*reaxff*/
-			lammps_command(lmp,cline); /*reaxff*/
+		else{
+			sprintf(cline, "write_restart %s", straindata_last); lammps_command(lmp,cline);
+			if(this_md_batch_process == 0) remove(straindata_legacy);
 		}
 
-		if(checkpoint_save){
-			if (md_force_field == "opls") {
-				sprintf(cline, "write_restart %s", straindata_lcts); lammps_command(lmp,cline); /*opls*/
-				sprintf(cline, "write_restart %s", straindata_time); lammps_command(lmp,cline); /*opls*/
-			}
-			else if (md_force_field == "reax") {
-				sprintf(cline, "write_dump all custom %s id type xs ys zs vx vy vz ix iy iz", straindata_lcts); lammps_command(lmp,cline); /*reaxff*/
-				sprintf(cline, "write_dump all custom %s id type xs ys zs vx vy vz ix iy iz", straindata_time); lammps_command(lmp,cline); /*reaxff*/
-			}
+		if(checkpoint_save && !probe){
+			sprintf(cline, "write_restart %s", straindata_lcts); lammps_command(lmp,cline);
+			sprintf(cline, "write_restart %s", straindata_time); lammps_command(lmp,cline);
 		}
 		// close down LAMMPS
 		delete lmp;
@@ -284,6 +679,8 @@ namespace HMM
 		sprintf(lmparg[4], "%s/log.homogenization", qpreplogloc.c_str());
 		lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
 
+		set_kspace_settings(lmp);
+
 		if (md_force_field == "reax"){
 			sprintf(cline, "variable locf string %s", locff); /*reaxff*/
 			lammps_command(lmp,cline); /*reaxff*/
@@ -295,19 +692,21 @@ namespace HMM
 
 		// Setting general parameters for LAMMPS independentely of what will be
 		// tested on the sample next.
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "in.set.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "in.set.lammps");
 
-		if (md_force_field == "reax"){
-			sprintf(cline, "read_restart %s", initdata); /*reaxff*/
-			lammps_command(lmp,cline); /*reaxff*/
-			sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_last); /*reaxff*/
-			lammps_command(lmp,cline); /*reaxff*/
+		// The box is now exactly known
+		if(select_proc_grid) set_processor_grid(lmp, lbdim);
+
+		if(probe) read_last_state(lmp, initdata, straindata_probe, straindata_legacy);
+		else read_last_state(lmp, initdata, straindata_last, straindata_legacy);
 
+		if(md_ghost_cutoff > 0.0){
+			sprintf(cline, "comm_modify cutoff %f", md_ghost_cutoff); lammps_command(lmp,cline);
 		}
-		else if (md_force_field == "opls"){
-			sprintf(cline, "read_restart %s", straindata_last); /*opls*/
-			lammps_command(lmp,cline); /*opls*/
+
+		if(rcb_balance){
+			sprintf(cline, "comm_style tiled"); lammps_command(lmp,cline);
+			sprintf(cline, "balance 1.1 rcb"); lammps_command(lmp,cline);
 		}
 
 		sprintf(cline, "variable dts equal %f", md_timestep_length); lammps_command(lmp,cline);
@@ -321,14 +720,14 @@ namespace HMM
 		// Compute the secant stiffness tensor at the given stress/strain state
 		sprintf(cline, "variable locbe string %s/%s", scriptsloc.c_str(), "ELASTIC");
 		lammps_command(lmp,cline);
+		script_vars["locbe"] = scriptsloc + "/ELASTIC";
 
 		// Set sampling and straining time-lengths
 		sprintf(cline, "variable nssample0 equal %d", md_nsteps_sample); lammps_command(lmp,cline);
 		sprintf(cline, "variable nssample  equal %d", md_nsteps_sample); lammps_command(lmp,cline);
 
 		// Using a routine based on the example ELASTIC/ to compute the stress tensor
-		sprintf(cfile, "%s/%s", scriptsloc.c_str(), "ELASTIC/in.homogenization.lammps");
-		lammps_file(lmp,cfile);
+		run_script(lmp, "ELASTIC/in.homogenization.lammps");
 
 		// Filling 3x3 stress tensor and conversion from ATM to Pa
 		// Useless at the moment, since it cannot be used in the Newton-Raphson algorithm.
@@ -349,17 +748,22 @@ namespace HMM
 
 		// close down LAMMPS
 		delete lmp;
+
+		if(probe && this_md_batch_process == 0) remove(straindata_probe);
 	}
 
 
 
+	// A probing simulation (low-fidelity estimate of the stress) does not update the state
+	// of the cell, nor its checkpoint and homogenization trajectory
 	template <int dim>
 	void STMDProblem<dim>::strain (std::string cid, std::string 	tid, std::string cmat,
 							  std::string slocout, std::string slocres, std::string llochom,
 							  std::string qplogloc, std::string scrloc,
 							  std::string strainif, std::string stressof,
 							  unsigned int rep, double mdts, double mdtem, unsigned int mdnss,
-							  double mdss, std::string mdff, bool outhom, bool checksav)
+							  double mdss, std::string mdff, std::string mdrs, bool outhom, bool checksav,
+							  bool pgrid, double ghcut, bool lbal, bool prb)
 	{
 		cellid = cid;
 		timeid = tid;
@@ -381,10 +785,16 @@ namespace HMM
 		md_nsteps_sample = mdnss;
 		md_strain_rate = mdss;
 		md_force_field = mdff;
+		md_run_style = mdrs;
 
-		output_homog = outhom;
+		probe = prb;
+		output_homog = outhom && !probe;
 		checkpoint_save = checksav;
 
+		select_proc_grid = pgrid;
+		md_ghost_cutoff = ghcut;
+		rcb_balance = lbal;
+
 		if (md_force_field != "opls" && md_force_field != "reax"){
 			std::cerr << "Error: Force field is " << md_force_field
 					  << " but only 'opls' and 'reax' are implemented... "
@@ -392,6 +802,8 @@ namespace HMM
 			exit(1);
 		}
 
+		if (md_force_field == "opls") load_kspace_settings();
+
 		// Argument of the MD simulation: strain to apply
 		//sprintf(filename, "%s/last.%s.%d.upstrain", macrostatelocout.c_str(), cellid, repl);
 		read_tensor<dim>(straininputfile.c_str(), loc_rep_strain);
@@ -400,7 +812,9 @@ namespace HMM
 		// microstructure and applying the complete new_strain or starting from
 		// the microstructure at the old_strain and applying the difference between
 		// the new_ and _old_strains, returns the new_stress state.
+		double tstart = MPI_Wtime();
 		lammps_straining();
+		double runtime = MPI_Wtime() - tstart;
 
 		if(this_md_batch_process == 0)
 		{
@@ -408,6 +822,13 @@ namespace HMM
 
 			//sprintf(filename, "%s/last.%s.%d.stress", macrostatelocout.c_str(), cellid, repl);
 			write_tensor<dim>(stressoutputfile.c_str(), loc_rep_stress);
+
+			// Runtime of the job, stored in the database of MD results with the stress
+			std::string runtimeoutputfile = stressoutputfile;
+			size_t ext = runtimeoutputfile.rfind(".stress");
+			if(ext != std::string::npos) runtimeoutputfile.erase(ext);
+			runtimeoutputfile += ".runtime";
+			write_tensor<dim>(runtimeoutputfile.c_str(), runtime);
 		}
 	}
 }
@@ -22,6 +22,8 @@
 #include "tensor_calc.h"
 #include "stmd_problem.h"
 #include "eqmd_problem.h"
+#include "md_database.h"
+#include "kd_tree.h"
 
 // To avoid conflicts...
 // pointers.h in input.h defines MIN and MAX
@@ -47,8 +49,10 @@ namespace HMM
 		int nflakes;
 		Tensor<1,dim> init_length;
 		Tensor<2,dim> rotam;
+		Tensor<1,dim> normal;
 		SymmetricTensor<2,dim> init_stress;
 		SymmetricTensor<4,dim> init_stiff;
+		double init_strain_ampl;
 	};
 
 
@@ -63,7 +67,11 @@ namespace HMM
 				   std::string nslocin, std::string nslocout, std::string nslocres, std::string nlogloc,
 				   std::string nlogloctmp,std::string nloglochom, std::string mslocout, std::string mdsdir,
 				   int fchpt, int fohom, unsigned int bnmin, unsigned int mppn,
-				   std::vector<std::string> mdt, Tensor<1,dim> cgd, unsigned int nr, bool ups);
+				   std::vector<std::string> mdt, Tensor<1,dim> cgd, unsigned int nr, bool ups,
+				   bool pgrid, double ghcut, bool lbal, double ktol, std::string mdrs, std::string mddb,
+				   unsigned int snn, double stol, double shw, double mdjb,
+				   int lfnss, double lfstrr, double lftol, unsigned int nrmin, double rtol,
+				   double dedq, std::vector<std::string> mdsym);
 		void update (int tstp, double ptime, int nstp);
 
 	private:
@@ -77,6 +85,35 @@ namespace HMM
 		void average_replica_data();
 
 		void prepare_md_simulations();
+		void setup_md_runs(const std::vector<int> &active);
+		void canonicalise_md_runs();
+		Tensor<2,dim> run_rotation(unsigned int c, unsigned int repl);
+		SymmetricTensor<2,dim> canonical_strain(unsigned int c, unsigned int repl, const SymmetricTensor<2,dim> &cg_strain);
+		std::string md_run_key(unsigned int c, unsigned int repl, unsigned long long fp,
+				const SymmetricTensor<2,dim> &cg_strain);
+		void deduplicate_md_runs(const std::vector<int> &active);
+		void fan_out_md_runs();
+
+		void read_applied_strain(unsigned int c, int numrepl, SymmetricTensor<2,dim> &cg_strain);
+		void read_strain_history(unsigned int c, int numrepl, unsigned long long &fp, double history[6]);
+		std::vector<double> surrogate_point(const double strain[6], const double history[6]);
+		double build_surrogate_trees();
+		void interpolate_cell(unsigned int c, const SymmetricTensor<2,dim> &cg_stress,
+				const std::vector<SymmetricTensor<2,dim> > &cg_rep_strain);
+		void remove_cells(const std::vector<int> &skip);
+		void last_md_records(std::map<std::string, unsigned long long> &last_record);
+		SymmetricTensor<2,dim> elastic_stress_prediction(unsigned int c, unsigned int repl,
+				const SymmetricTensor<2,dim> &cg_strain,
+				const std::map<std::string, unsigned long long> &last_record);
+		void skip_md_simulations();
+		void prioritise_md_simulations();
+
+		void read_low_fidelity_bias(unsigned int imd, unsigned int &n, SymmetricTensor<2,dim> &bias);
+		void write_low_fidelity_bias(unsigned int imd, unsigned int n, const SymmetricTensor<2,dim> &bias);
+		void low_fidelity_md_simulations();
+		void update_low_fidelity_bias();
+
+		void tune_kspace_settings();
 
 		void execute_inside_md_simulations();
 
@@ -85,6 +122,9 @@ namespace HMM
 		void execute_pjm_md_simulations();
 
 		void store_md_simulations();
+		void store_md_results(const std::vector<MDRecord> &records);
+		bool next_replica_round(std::vector<int> &active);
+		void average_md_simulations();
 
 		MPI_Comm 							mmd_communicator;
 		MPI_Comm 							md_batch_communicator;
@@ -111,6 +151,7 @@ namespace HMM
 		std::string 						time_id;
 		std::vector<std::string>			cell_id;
 		std::vector<std::string>			cell_mat;
+		std::vector<double>					cell_unc;
 
 		std::vector<std::string>			qpreplogloc;
 		std::vector<std::string>			straininputfile;
@@ -129,6 +170,7 @@ namespace HMM
 		int									md_nsteps_sample;
 		double								md_strain_rate;
 		std::string							md_force_field;
+		std::string							md_run_style;
 
 		std::vector<std::vector<std::string> > md_args;
 
@@ -148,8 +190,40 @@ namespace HMM
 		std::string							nanologlochom;
 
 		std::string							md_scripts_directory;
+		LAMMPSScriptCache					md_scripts;
+
+		std::string							md_database_directory;
+		MDDatabase							md_database;
+
+		unsigned int						surrogate_nneighbours;
+		double								surrogate_tolerance;
+		double								surrogate_history_weight;
+		std::vector<KDTree>					surrogate_trees;
+		double								md_job_budget;
+
+		int									lofi_nsteps_sample;
+		double								lofi_strain_rate;
+		double								lofi_tolerance;
+		bool								md_probe;
+		std::map<std::string, SymmetricTensor<2,dim> > lofi_stress;
+
+		unsigned int						nrepl_min;
+		double								replica_tolerance;
+		std::vector<int>					md_run_batch;
+		std::vector<int>					md_run_leader;
+		double								dedup_quantum;
+		std::vector<std::string>			mdsym;
+		std::vector<Tensor<2,dim> >			md_run_frame;
+		std::vector<int>					md_run_done;
+		std::vector<SymmetricTensor<2,dim> > md_run_stress;
+
 		bool								use_pjm_scheduler;
 
+		bool								md_proc_grid;
+		double								md_ghost_cutoff;
+		bool								md_rcb_balance;
+		double								kspace_tolerance;
+
 	};
 
 
@@ -158,17 +232,21 @@ namespace HMM
 	STMDSync<dim>::STMDSync (MPI_Comm mcomm, int pcolor)
 	:
 		mmd_communicator (mcomm),
+		md_batch_communicator (MPI_COMM_NULL),
 		mmd_n_processes (Utilities::MPI::n_mpi_processes(mmd_communicator)),
 		this_mmd_process (Utilities::MPI::this_mpi_process(mmd_communicator)),
 		mmd_pcolor (pcolor),
-		mcout (std::cout,(this_mmd_process == 0))
+		mcout (std::cout,(this_mmd_process == 0)),
+		md_probe (false)
 	{}
 
 
 
 	template <int dim>
 	STMDSync<dim>::~STMDSync ()
-	{}
+	{
+		if (md_batch_communicator != MPI_COMM_NULL) MPI_Comm_free(&md_batch_communicator);
+	}
 
 
 
@@ -240,7 +318,9 @@ namespace HMM
 			mmd_pcolor = int((md_batch_n_processes*n_md_batches-1)/md_batch_n_processes);
 		*/
 
-		// Definition of the communicators
+		// Definition of the communicators, releasing the ones of the previous batches (the
+		// batches are set up again for every round of MD simulations)
+		if (md_batch_communicator != MPI_COMM_NULL) MPI_Comm_free(&md_batch_communicator);
 		MPI_Comm_split(mmd_communicator, md_batch_pcolor, this_mmd_process, &md_batch_communicator);
 		MPI_Comm_rank(md_batch_communicator,&this_md_batch_process);
 
@@ -320,6 +400,7 @@ namespace HMM
 					// Set the rotation matrix from the replica orientation to common
 					// ground FE/MD orientation (arbitrary choose x-direction)
 					replica_data[imd*nrepl+irep].rotam=compute_rotation_tensor(nvrep,cg_dir);
+					replica_data[imd*nrepl+irep].normal=nvrep;
 				}
 				else{
 					Tensor<2,dim> idmat;
@@ -382,6 +463,15 @@ namespace HMM
 							<< replica_data[imdrun].repl << std::endl;
 				}
 
+				// Copying replica initial dimensions next to the initial system, to set
+				// the processors grid of the first straining of each cell
+				if (statelength_exists && this_mmd_process == 0){
+					char nanofilenameout[1024];
+					sprintf(nanofilenameout, "%s/init.%s_%d.length", nanostatelocout.c_str(),
+							replica_data[imdrun].mat.c_str(), replica_data[imdrun].repl);
+					write_tensor<dim>(nanofilenameout, replica_data[imdrun].init_length);
+				}
+
 				// Load replica initial stresses
 				bool statestress_exists = file_exists(stressoutputfile[imdrun].c_str());
 				if (statestress_exists){
@@ -404,6 +494,13 @@ namespace HMM
 							<< replica_data[imdrun].repl << std::endl;
 				}
 
+				// Load replica strain amplitude of the stiffness measurement (0 if the
+				// equilibration predates its storage)
+				std::string amploutputfile = stiffoutputfile[imdrun].substr(0, stiffoutputfile[imdrun].size()-6) + ".strainampl";
+				replica_data[imdrun].init_strain_ampl = 0.;
+				if (file_exists(amploutputfile.c_str()))
+					read_tensor<dim>(amploutputfile.c_str(), replica_data[imdrun].init_strain_ampl);
+
 				// Copying replica input system
 				bool statesystem_exists = file_exists(systemoutputfile[imdrun].c_str());
 				if (statesystem_exists){
@@ -437,6 +534,7 @@ namespace HMM
 			initial_stiffness_tensor = 0.;
 
 			double initial_density = 0.;
+			double initial_strain_ampl = replica_data[imd*nrepl].init_strain_ampl;
 
 			for(unsigned int repl=0;repl<nrepl;repl++)
 			{
@@ -451,6 +549,9 @@ namespace HMM
 
 				// Averaging density over replicas
 				initial_density += replica_data[imd*nrepl+repl].rho;
+
+				// Smallest strain amplitude for which all the replicas are known to be elastic
+				initial_strain_ampl = std::min(initial_strain_ampl, replica_data[imd*nrepl+repl].init_strain_ampl);
 			}
 
 			initial_stiffness_tensor /= nrepl;
@@ -464,6 +565,10 @@ namespace HMM
 			sprintf(macrofilenameout, "%s/init.%s.density", macrostatelocout.c_str(),
 					mdtype[imd].c_str());
 			write_tensor<dim>(macrofilenameout, initial_density);
+
+			sprintf(macrofilenameout, "%s/init.%s.strainampl", macrostatelocout.c_str(),
+					mdtype[imd].c_str());
+			write_tensor<dim>(macrofilenameout, initial_strain_ampl);
 		}
 	}
 
@@ -504,6 +609,38 @@ namespace HMM
 			while (nline<ncupd && std::getline(ifile, cell_mat[nline])) nline++;
 			ifile.close();
 
+			// Load uncertainty of the surrogates of the FE for the cells to be updated (negative
+			// if not available)
+			cell_unc.assign(ncupd, -1.);
+			sprintf(filenamelist, "%s/last.uncqpupdates", macrostatelocout.c_str());
+			ifile.open (filenamelist);
+			nline = 0;
+			while (nline<ncupd && ifile >> cell_unc[nline]) nline++;
+			ifile.close();
+
+			// Interpolating the stress of the cells close enough to previous MD simulations
+			if (surrogate_nneighbours > 0) skip_md_simulations();
+			if (ncupd == 0) return;
+
+			// Simulating only the most informative cells within the wall-time budget
+			if (md_job_budget > 0.) prioritise_md_simulations();
+		}
+	}
+
+
+
+	// Batches of processes, input strain files and arguments of the active MD simulations
+	// (cell and replica) of the cells to update, either probing (low-fidelity) or full
+	// simulations. The active simulations are spread over the batches.
+	template <int dim>
+	void STMDSync<dim>::setup_md_runs(const std::vector<int> &active)
+	{
+		// Settings of the simulations
+		int nsteps_sample = md_probe ? lofi_nsteps_sample : md_nsteps_sample;
+		double strain_rate = md_probe ? lofi_strain_rate : md_strain_rate;
+		std::string stress_ext = md_probe ? ".lofi.stress" : ".stress";
+
+		if (ncupd>0){
 			// Number of MD simulations at this iteration...
 			int nmdruns = ncupd*nrepl;
 
@@ -517,8 +654,24 @@ namespace HMM
 		        it.clear();
 		    }
 
+			// Identical runs, possibly after mapping their strain onto its representative
+			// under the symmetry of the material, are only simulated once
+			canonicalise_md_runs();
+			deduplicate_md_runs(active);
+
 			// Setting up batch of processes
-			set_md_procs(nmdruns);
+			int nactive = 0;
+			for (int imdrun=0; imdrun<nmdruns; imdrun++)
+				if (active[imdrun] && md_run_leader[imdrun] < 0) nactive++;
+			set_md_procs(nactive);
+
+			// Batch of each run, -1 if not simulated at this round, -2 if duplicating another run
+			md_run_batch.assign(nmdruns, -1);
+			for (int imdrun=0, iactive=0; imdrun<nmdruns; imdrun++)
+				if (active[imdrun]){
+					if (md_run_leader[imdrun] < 0) md_run_batch[imdrun] = (iactive++)%n_md_batches;
+					else md_run_batch[imdrun] = -2;
+				}
 
 			// Preparing strain input file for each replica
 			for (unsigned int c=0; c<ncupd; ++c)
@@ -538,25 +691,23 @@ namespace HMM
 
                                         // Setting up location for temporary log outputs of md simulation, input strains and output stresses
                                         straininputfile[imdrun] = macrostatelocout + "/last." + cell_id[c] + "." + std::to_string(numrepl) + ".upstrain";
-                                        stressoutputfile[imdrun] = macrostatelocout + "/last." + cell_id[c] + "." + std::to_string(numrepl) + ".stress";
+                                        stressoutputfile[imdrun] = macrostatelocout + "/last." + cell_id[c] + "." + std::to_string(numrepl) + stress_ext;
                                         qpreplogloc[imdrun] = nanologloctmp + "/" + time_id  + "." + cell_id[c] + "." + cell_mat[c] + "_" + std::to_string(numrepl);
 
 					// Allocation of a MD run to a batch of processes
-					if (md_batch_pcolor == (imdrun%n_md_batches)){
+					if (md_batch_pcolor == md_run_batch[imdrun]){
 
 						// Operations on disk, need only to be done by one of the processes of the batch
 						if(this_md_batch_process == 0){
 
 							SymmetricTensor<2,dim> loc_rep_strain, cg_loc_rep_strain;
 
-							char filename[1024];
-
 							// Argument of the MD simulation: strain to apply
-							sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id[c].c_str());
-							read_tensor<dim>(filename, cg_loc_rep_strain);
+							read_applied_strain(c, numrepl, cg_loc_rep_strain);
 
-							// Rotate strain tensor from common ground to replica orientation
-							loc_rep_strain = rotate_tensor(cg_loc_rep_strain, transpose(replica_data[imd*nrepl+repl].rotam));
+							// Rotate strain tensor from common ground to replica orientation (and symmetry
+							// frame of the run)
+							loc_rep_strain = rotate_tensor(cg_loc_rep_strain, transpose(run_rotation(c, repl)));
 
 							// Resize applied strain with initial length of the md sample, the resulting variable is not
 							// a strain but a length variation, which will be transformed back into a strain during the
@@ -588,14 +739,986 @@ namespace HMM
 						md_args[imdrun].push_back(std::to_string(numrepl));
 						md_args[imdrun].push_back(std::to_string(md_timestep_length));
 						md_args[imdrun].push_back(std::to_string(md_temperature));
-						md_args[imdrun].push_back(std::to_string(md_nsteps_sample));
-						md_args[imdrun].push_back(std::to_string(md_strain_rate));
+						md_args[imdrun].push_back(std::to_string(nsteps_sample));
+						md_args[imdrun].push_back(std::to_string(strain_rate));
 						md_args[imdrun].push_back(md_force_field);
+						md_args[imdrun].push_back(md_run_style);
 						md_args[imdrun].push_back(std::to_string(output_homog));
 						md_args[imdrun].push_back(std::to_string(checkpoint_save));
+						md_args[imdrun].push_back(std::to_string(md_proc_grid));
+						md_args[imdrun].push_back(std::to_string(md_ghost_cutoff));
+						md_args[imdrun].push_back(std::to_string(md_rcb_balance
+								&& replica_data[imd*nrepl+repl].nflakes > 0));
+						md_args[imdrun].push_back(std::to_string(md_probe));
+					}
+				}
+			}
+		}
+	}
+
+
+
+	// Symmetry frame of each run: the strain applied to the MD sample is the strain of the
+	// replica expressed in this frame, and the stress is rotated back. The frame is chosen
+	// when the replica of the cell leaves its initial state, as the symmetry operation of
+	// the material mapping the strain onto its representative (principal strains for an
+	// isotropic material, strain without in-plane shear for a transversely isotropic one
+	// around the flake normal), and kept afterwards.
+	template <int dim>
+	void STMDSync<dim>::canonicalise_md_runs()
+	{
+		Tensor<2,dim> idmat;
+		idmat = 0.0; for (unsigned int i=0; i<dim; ++i) idmat[i][i] = 1.0;
+		md_run_frame.assign(ncupd*nrepl, idmat);
+
+		bool symmetric = false;
+		for (unsigned int imd=0; imd<mdsym.size(); imd++)
+			if (mdsym[imd] != "none") symmetric = true;
+		if (!symmetric) return;
+
+		std::vector<double> frames (ncupd*nrepl*dim*dim, 0.);
+		if (this_mmd_process == 0){
+			unsigned int ncanonical = 0;
+			for (unsigned int c=0; c<ncupd; ++c)
+			{
+				int imd = 0;
+				for(unsigned int i=0; i<mdtype.size(); i++)
+					if(cell_mat[c]==mdtype[i])
+						imd=i;
+				if (mdsym[imd] == "none") continue;
+
+				for(unsigned int repl=0;repl<nrepl;repl++)
+				{
+					int imdrun=c*nrepl + (repl);
+
+					std::string framefile = nanostatelocout + "/last." + cell_id[c] + "." + cell_mat[c] + "_" + std::to_string(repl+1) + ".frame";
+					if (file_exists(framefile.c_str())){
+						read_tensor<dim>(framefile.c_str(), md_run_frame[imdrun]);
+						continue;
+					}
+
+					unsigned long long fp;
+					double history[6];
+					read_strain_history(c, repl+1, fp, history);
+					if (fp != 0) continue;
+
+					SymmetricTensor<2,dim> cg_loc_rep_strain;
+					read_applied_strain(c, repl+1, cg_loc_rep_strain);
+					SymmetricTensor<2,dim> loc_rep_strain = rotate_tensor(cg_loc_rep_strain,
+							transpose(replica_data[imd*nrepl+repl].rotam));
+
+					if (mdsym[imd] == "isotropic")
+						md_run_frame[imdrun] = symmetric_eigen_frame(loc_rep_strain);
+					else if (mdsym[imd] == "transverse")
+						md_run_frame[imdrun] = transverse_canonical_frame(loc_rep_strain,
+								replica_data[imd*nrepl+repl].normal);
+					ncanonical++;
+				}
+			}
+
+			for (unsigned int imdrun=0; imdrun<ncupd*nrepl; imdrun++)
+				for (unsigned int k=0; k<dim; k++)
+					for (unsigned int l=0; l<dim; l++)
+						frames[(imdrun*dim+k)*dim+l] = md_run_frame[imdrun][k][l];
+
+			mcout << "        " << "...symmetry frames chosen for " << ncanonical << " MD runs from the initial states" << std::endl;
+		}
+
+		MPI_Bcast(&frames[0], frames.size(), MPI_DOUBLE, 0, mmd_communicator);
+		for (unsigned int imdrun=0; imdrun<ncupd*nrepl; imdrun++)
+			for (unsigned int k=0; k<dim; k++)
+				for (unsigned int l=0; l<dim; l++)
+					md_run_frame[imdrun][k][l] = frames[(imdrun*dim+k)*dim+l];
+	}
+
+
+
+	// Rotation from the symmetry frame of a run to the common ground orientation
+	template <int dim>
+	Tensor<2,dim> STMDSync<dim>::run_rotation(unsigned int c, unsigned int repl)
+	{
+		int imd = 0;
+		for(unsigned int i=0; i<mdtype.size(); i++)
+			if(cell_mat[c]==mdtype[i])
+				imd=i;
+
+		return replica_data[imd*nrepl+repl].rotam*md_run_frame[c*nrepl+repl];
+	}
+
+
+
+	// Strain applied to the MD sample of a run, expressed in the common ground orientation as
+	// if the sample had not been rotated by the symmetry frame
+	template <int dim>
+	SymmetricTensor<2,dim> STMDSync<dim>::canonical_strain(unsigned int c, unsigned int repl,
+			const SymmetricTensor<2,dim> &cg_strain)
+	{
+		int imd = 0;
+		for(unsigned int i=0; i<mdtype.size(); i++)
+			if(cell_mat[c]==mdtype[i])
+				imd=i;
+
+		return rotate_tensor(rotate_tensor(cg_strain, transpose(run_rotation(c, repl))),
+				replica_data[imd*nrepl+repl].rotam);
+	}
+
+
+
+	// Key shared by the runs simulated once: material, replica, starting state (fingerprint
+	// of the strain history, null for the initial state) and strain to apply, up to the quantum
+	template <int dim>
+	std::string STMDSync<dim>::md_run_key(unsigned int c, unsigned int repl, unsigned long long fp,
+			const SymmetricTensor<2,dim> &cg_strain)
+	{
+		std::ostringstream key;
+		key << cell_mat[c] << "_" << repl+1 << "_" << fp;
+		for (unsigned int k=0; k<dim; k++)
+			for (unsigned int l=k; l<dim; l++)
+				key << "_" << std::llround(cg_strain[k][l]/dedup_quantum);
+		return key.str();
+	}
+
+
+
+	// Runs sharing the material, the replica, the starting state and the strain to apply, up
+	// to the quantum, are simulated once, the first of them leading the others. Since the
+	// loading is often symmetric, this is frequent, especially before the cells have diverged.
+	template <int dim>
+	void STMDSync<dim>::deduplicate_md_runs(const std::vector<int> &active)
+	{
+		md_run_leader.assign(ncupd*nrepl, -1);
+		if (dedup_quantum <= 0.) return;
+
+		if (this_mmd_process == 0){
+			std::map<std::string, int> leaders;
+			unsigned int nactive = 0, nduplicates = 0;
+
+			for (unsigned int c=0; c<ncupd; ++c)
+				for(unsigned int repl=0;repl<nrepl;repl++)
+				{
+					int imdrun=c*nrepl + (repl);
+					if (!active[imdrun]) continue;
+					nactive++;
+
+					SymmetricTensor<2,dim> cg_loc_rep_strain;
+					unsigned long long fp;
+					double history[6];
+					read_applied_strain(c, repl+1, cg_loc_rep_strain);
+					read_strain_history(c, repl+1, fp, history);
+					cg_loc_rep_strain = canonical_strain(c, repl, cg_loc_rep_strain);
+					std::string key = md_run_key(c, repl, fp, cg_loc_rep_strain);
+
+					std::map<std::string, int>::iterator it = leaders.find(key);
+					if (it == leaders.end()) leaders[key] = imdrun;
+					else{
+						md_run_leader[imdrun] = it->second;
+						nduplicates++;
+					}
+				}
+
+			mcout << "        " << "...deduplicated " << nduplicates << " out of " << nactive
+				  << " MD runs (ratio " << double(nactive)/std::max(nactive-nduplicates, (unsigned int) 1)
+				  << ")" << std::endl;
+		}
+
+		MPI_Bcast(&md_run_leader[0], ncupd*nrepl, MPI_INT, 0, mmd_communicator);
+	}
+
+
+
+	// Copying the results of the leading runs to their duplicates: stress and, for full
+	// simulations, the state of the replica (the runtime of a duplicate being null)
+	template <int dim>
+	void STMDSync<dim>::fan_out_md_runs()
+	{
+		for (unsigned int c=0; c<ncupd; ++c)
+		{
+			if (this_mmd_process != int(c%mmd_n_processes)) continue;
+
+			for(unsigned int repl=0;repl<nrepl;repl++)
+			{
+				int imdrun=c*nrepl + (repl);
+				if (md_run_batch[imdrun] != -2) continue;
+
+				int ilead = md_run_leader[imdrun];
+				unsigned int clead = ilead/nrepl;
+
+				copy_file(stressoutputfile[ilead].c_str(), stressoutputfile[imdrun].c_str());
+
+				std::string runtimefile = stressoutputfile[imdrun];
+				runtimefile.erase(runtimefile.rfind(".stress"));
+				runtimefile += ".runtime";
+				double runtime = 0.;
+				write_tensor<dim>(runtimefile.c_str(), runtime);
+
+				if (md_probe) continue;
+
+				std::string mdstate = cell_mat[c] + "_" + std::to_string(repl+1);
+				std::vector<std::string> src, dst;
+				src.push_back(nanostatelocout + "/last." + cell_id[clead] + "." + mdstate + ".bin");
+				dst.push_back(nanostatelocout + "/last." + cell_id[c] + "." + mdstate + ".bin");
+				src.push_back(nanostatelocout + "/last." + cell_id[clead] + "." + mdstate + ".length");
+				dst.push_back(nanostatelocout + "/last." + cell_id[c] + "." + mdstate + ".length");
+				if (checkpoint_save){
+					src.push_back(nanostatelocres + "/lcts." + cell_id[clead] + "." + mdstate + ".bin");
+					dst.push_back(nanostatelocres + "/lcts." + cell_id[c] + "." + mdstate + ".bin");
+					src.push_back(nanostatelocres + "/lcts." + cell_id[clead] + "." + mdstate + ".length");
+					dst.push_back(nanostatelocres + "/lcts." + cell_id[c] + "." + mdstate + ".length");
+					src.push_back(nanostatelocres + "/" + time_id + "." + cell_id[clead] + "." + mdstate + ".bin");
+					dst.push_back(nanostatelocres + "/" + time_id + "." + cell_id[c] + "." + mdstate + ".bin");
+				}
+				for (unsigned int i=0; i<src.size(); i++)
+					if (!copy_file(src[i].c_str(), dst[i].c_str()))
+						std::cout << "Failed copying the MD state " << src[i] << " to " << dst[i] << std::endl;
+
+				std::string legacyfile = nanostatelocout + "/last." + cell_id[c] + "." + mdstate + ".dump";
+				remove(legacyfile.c_str());
+			}
+		}
+	}
+
+
+
+	// Strain to be applied to a replica of a cell: the strain increment of the cell, plus the
+	// strain increments of the previous updates of the cell which have been interpolated
+	// instead of being simulated
+	template <int dim>
+	void STMDSync<dim>::read_applied_strain(unsigned int c, int numrepl, SymmetricTensor<2,dim> &cg_strain)
+	{
+		char filename[1024];
+		sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id[c].c_str());
+		read_tensor<dim>(filename, cg_strain);
+
+		sprintf(filename, "%s/last.%s.%s_%d.pending", nanostatelocout.c_str(),
+				cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+		if (file_exists(filename)){
+			SymmetricTensor<2,dim> cg_pending_strain;
+			read_tensor<dim>(filename, cg_pending_strain);
+			cg_strain += cg_pending_strain;
+		}
+	}
+
+
+
+	// Fingerprint and cumulative strain of the history of a replica of a cell, both null
+	// if the replica is still in its initial state
+	template <int dim>
+	void STMDSync<dim>::read_strain_history(unsigned int c, int numrepl, unsigned long long &fp, double history[6])
+	{
+		fp = 0;
+		for (unsigned int i=0; i<6; i++) history[i] = 0.;
+
+		char filename[1024];
+		sprintf(filename, "%s/last.%s.%s_%d.history", nanostatelocout.c_str(),
+				cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+		std::ifstream hfile (filename);
+		if (hfile.is_open()){
+			hfile >> fp;
+			for (unsigned int i=0; i<6; i++) hfile >> history[i];
+			hfile.close();
+		}
+	}
+
+
+
+	// Coordinates of a MD simulation for the nearest neighbour search, such that the
+	// euclidean distance matches the norm of the strain tensors (off-diagonal components
+	// counted twice), the history being weighted relatively to the increment
+	template <int dim>
+	std::vector<double> STMDSync<dim>::surrogate_point(const double strain[6], const double history[6])
+	{
+		std::vector<double> p (12);
+		for (unsigned int i=0; i<6; i++){
+			double w = (i==1 || i==2 || i==4) ? sqrt(2.0) : 1.0;
+			p[i] = w*strain[i];
+			p[6+i] = w*surrogate_history_weight*history[i];
+		}
+		return p;
+	}
+
+
+
+	// Search trees of the previous MD simulations, per material and replica
+	template <int dim>
+	double STMDSync<dim>::build_surrogate_trees()
+	{
+		double tstart = MPI_Wtime();
+
+		surrogate_trees.assign(mdtype.size()*nrepl, KDTree(12));
+		for (unsigned long long i=0; i<md_database.size(); i++){
+			const MDRecord &r = md_database.record(i);
+			for (unsigned int imd=0; imd<mdtype.size(); imd++)
+				if (mdtype[imd] == r.mat && r.repl >= 1 && r.repl <= int(nrepl))
+					surrogate_trees[imd*nrepl+r.repl-1].add(surrogate_point(r.strain, r.history), i);
+		}
+		for (unsigned int it=0; it<surrogate_trees.size(); it++) surrogate_trees[it].build();
+
+		return MPI_Wtime() - tstart;
+	}
+
+
+
+	// Stress of a cell which is not simulated at this update, its strain increment being
+	// kept pending to be applied at the next MD simulation of the cell
+	template <int dim>
+	void STMDSync<dim>::interpolate_cell(unsigned int c, const SymmetricTensor<2,dim> &cg_stress,
+			const std::vector<SymmetricTensor<2,dim> > &cg_rep_strain)
+	{
+		char filename[1024];
+		SymmetricTensor<2,dim> cg_loc_stress = cg_stress;
+		sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id[c].c_str());
+		write_tensor<dim>(filename, cg_loc_stress);
+
+		// Flagging the stress as not simulated, so that the FE does not learn from it
+		sprintf(filename, "%s/last.%s.synthetic", macrostatelocout.c_str(), cell_id[c].c_str());
+		std::ofstream sfile (filename);
+		sfile << "interpolated" << std::endl;
+		sfile.close();
+
+		for(unsigned int repl=0;repl<nrepl;repl++)
+		{
+			SymmetricTensor<2,dim> cg_loc_rep_strain = cg_rep_strain[repl];
+			sprintf(filename, "%s/last.%s.%s_%d.pending", nanostatelocout.c_str(),
+					cell_id[c].c_str(), cell_mat[c].c_str(), repl+1);
+			write_tensor<dim>(filename, cg_loc_rep_strain);
+			if (checkpoint_save){
+				sprintf(filename, "%s/lcts.%s.%s_%d.pending", nanostatelocres.c_str(),
+						cell_id[c].c_str(), cell_mat[c].c_str(), repl+1);
+				write_tensor<dim>(filename, cg_loc_rep_strain);
+			}
+		}
+	}
+
+
+
+	// Removing the cells flagged by the first process from the list of cells to simulate
+	template <int dim>
+	void STMDSync<dim>::remove_cells(const std::vector<int> &skip)
+	{
+		std::vector<int> flags (skip);
+		MPI_Bcast(&flags[0], ncupd, MPI_INT, 0, mmd_communicator);
+
+		std::vector<std::string> md_cell_id, md_cell_mat;
+		std::vector<double> md_cell_unc;
+		for (unsigned int c=0; c<ncupd; ++c)
+			if (!flags[c]){
+				md_cell_id.push_back(cell_id[c]);
+				md_cell_mat.push_back(cell_mat[c]);
+				md_cell_unc.push_back(cell_unc[c]);
+			}
+		cell_id = md_cell_id;
+		cell_mat = md_cell_mat;
+		cell_unc = md_cell_unc;
+		ncupd = cell_id.size();
+	}
+
+
+
+	// Last record of the database for each replica of each cell, keyed by CELL_MAT_REPL
+	template <int dim>
+	void STMDSync<dim>::last_md_records(std::map<std::string, unsigned long long> &last_record)
+	{
+		last_record.clear();
+		for (unsigned long long i=md_database.size(); i-- > 0;){
+			const MDRecord &r = md_database.record(i);
+			std::string key = std::string(r.cell) + "_" + r.mat + "_" + std::to_string(r.repl);
+			if (last_record.find(key) == last_record.end()) last_record[key] = i;
+		}
+	}
+
+
+
+	// Elastic prediction of the stress of a replica of a cell (common ground orientation,
+	// initial stress removed): stress of its last simulation plus the initial stiffness of
+	// the replica applied to the strain increment since then
+	template <int dim>
+	SymmetricTensor<2,dim> STMDSync<dim>::elastic_stress_prediction(unsigned int c, unsigned int repl,
+			const SymmetricTensor<2,dim> &cg_strain,
+			const std::map<std::string, unsigned long long> &last_record)
+	{
+		int imd = 0;
+		for(unsigned int i=0; i<mdtype.size(); i++)
+			if(cell_mat[c]==mdtype[i])
+				imd=i;
+
+		SymmetricTensor<2,dim> cg_last_stress;
+		std::string key = cell_id[c] + "_" + cell_mat[c] + "_" + std::to_string(repl+1);
+		std::map<std::string, unsigned long long>::const_iterator it = last_record.find(key);
+		if (it != last_record.end()){
+			const MDRecord &r = md_database.record(it->second);
+			unsigned int iv = 0;
+			for (unsigned int k=0; k<dim; k++)
+				for (unsigned int l=k; l<dim; l++)
+					cg_last_stress[k][l] = r.stress[iv++];
+		}
+
+		SymmetricTensor<4,dim> cg_stiff = rotate_tensor(replica_data[imd*nrepl+repl].init_stiff,
+				replica_data[imd*nrepl+repl].rotam);
+		return cg_last_stress + cg_stiff*cg_strain;
+	}
+
+
+
+	// Cells for which every replica has enough previous MD simulations of the same material
+	// and replica within the distance tolerance, in terms of strain increment and strain
+	// history, get their stress interpolated (inverse distance weighting) and are removed
+	// from the list of cells to simulate. Their strain increment is kept pending, to be
+	// applied at their next MD simulation. The weighted spread of the neighbours stresses
+	// is used as an estimate of the interpolation error.
+	template <int dim>
+	void STMDSync<dim>::skip_md_simulations()
+	{
+		std::vector<int> skip (ncupd, 0);
+
+		if (this_mmd_process == 0){
+			double tbuild = build_surrogate_trees();
+			double tstart = MPI_Wtime();
+
+			unsigned int nskip = 0;
+			double sum_err = 0., max_err = 0.;
+
+			for (unsigned int c=0; c<ncupd; ++c)
+			{
+				int imd = 0;
+				for(unsigned int i=0; i<mdtype.size(); i++)
+					if(cell_mat[c]==mdtype[i])
+						imd=i;
+
+				bool interpolable = true;
+				double cell_err = 0.;
+				SymmetricTensor<2,dim> cg_loc_stress;
+				std::vector<SymmetricTensor<2,dim> > cg_loc_rep_strain (nrepl);
+
+				for(unsigned int repl=0;repl<nrepl && interpolable;repl++)
+				{
+					int numrepl = repl+1;
+
+					unsigned long long fp;
+					double history[6], strain[6];
+					read_applied_strain(c, numrepl, cg_loc_rep_strain[repl]);
+					read_strain_history(c, numrepl, fp, history);
+
+					unsigned int iv = 0;
+					for (unsigned int k=0; k<dim; k++)
+						for (unsigned int l=k; l<dim; l++)
+							strain[iv++] = cg_loc_rep_strain[repl][k][l];
+
+					std::vector<unsigned long long> ids;
+					std::vector<double> dists;
+					surrogate_trees[imd*nrepl+repl].nearest(surrogate_point(strain, history),
+							surrogate_nneighbours, ids, dists);
+
+					if (ids.size() < surrogate_nneighbours || dists.back() > surrogate_tolerance){
+						interpolable = false;
+						continue;
+					}
+
+					double wsum = 0., pred[6] = {0., 0., 0., 0., 0., 0.};
+					std::vector<double> w (ids.size());
+					for (unsigned int n=0; n<ids.size(); n++){
+						w[n] = 1.0/(dists[n] + 1.0e-3*surrogate_tolerance);
+						wsum += w[n];
+						for (unsigned int i=0; i<6; i++) pred[i] += w[n]*md_database.record(ids[n]).stress[i];
 					}
+					for (unsigned int i=0; i<6; i++) pred[i] /= wsum;
+
+					double err = 0.;
+					for (unsigned int n=0; n<ids.size(); n++){
+						double diff[6];
+						for (unsigned int i=0; i<6; i++) diff[i] = md_database.record(ids[n]).stress[i] - pred[i];
+						err += w[n]*md_strain_norm(diff)*md_strain_norm(diff);
+					}
+					cell_err = std::max(cell_err, sqrt(err/wsum));
+
+					iv = 0;
+					for (unsigned int k=0; k<dim; k++)
+						for (unsigned int l=k; l<dim; l++)
+							cg_loc_stress[k][l] += pred[iv++];
 				}
+
+				if (!interpolable) continue;
+
+				cg_loc_stress /= nrepl;
+				interpolate_cell(c, cg_loc_stress, cg_loc_rep_strain);
+
+				skip[c] = 1;
+				nskip++;
+				sum_err += cell_err;
+				max_err = std::max(max_err, cell_err);
 			}
+
+			double tquery = MPI_Wtime() - tstart;
+
+			mcout << "        " << "...interpolated " << nskip << " out of " << ncupd << " cells"
+				  << " (stress error estimate mean: " << ((nskip>0) ? sum_err/nskip : 0.)
+				  << " Pa, max: " << max_err << " Pa, index build: " << tbuild
+				  << " s, queries: " << tquery << " s)" << std::endl;
+
+			std::string fname = nanologloc + "/alltime_surrogate.dat";
+			bool fexists = file_exists(fname.c_str());
+			std::ofstream ofile (fname.c_str(), std::ios_base::app);
+			if (!fexists)
+				ofile << "timestep newtonstep ncells nskipped mean_error max_error build_time query_time" << std::endl;
+			ofile << timestep << " " << newtonstep << " " << ncupd << " " << nskip << " "
+				  << ((nskip>0) ? sum_err/nskip : 0.) << " " << max_err << " "
+				  << tbuild << " " << tquery << std::endl;
+			ofile.close();
+		}
+
+		remove_cells(skip);
+	}
+
+
+
+	// Cells for which the expected information gain of an MD simulation is the highest are
+	// simulated within the wall-time budget of the update, the other cells are deferred.
+	// The gain of a cell combines, averaged over its replicas, the distance to the nearest
+	// previous simulation relatively to the norm of the strain (capped to 1), and the
+	// uncertainty of the surrogates relatively to the elastic stress increment (capped to 1),
+	// scaled by the elastic estimate of the stress level of the cell. The uncertainty is the
+	// one of the FE surrogates (GP standard deviation or NN held-out error), or without them
+	// the spread of the stresses of the nearest previous simulations. The cells whose runs
+	// all duplicate the runs of a previous cell (see deduplicate_md_runs()) are represented
+	// by it: its gain is multiplied by the number of cells it represents, and they follow it
+	// at no cost. The gain also grows with the number of consecutive deferrals of the cell.
+	//
+	// The cost of a cell is estimated from the mean runtime of the last recorded simulations
+	// of its material, for its replicas, spread over the maximum number of batches.
+	// Deferred cells get an elastic prediction of their stress from the last simulation of
+	// their replicas, and their strain increment is kept pending.
+	template <int dim>
+	void STMDSync<dim>::prioritise_md_simulations()
+	{
+		std::vector<int> defer (ncupd, 0);
+
+		if (this_mmd_process == 0){
+			if (surrogate_nneighbours == 0) build_surrogate_trees();
+			unsigned int nneighbours = std::max(surrogate_nneighbours, (unsigned int) 4);
+
+			// Number of consecutive deferrals of the cells deferred at the previous update
+			std::map<std::string, int> ndeferred;
+			std::string deferredfile = nanostatelocout + "/last.deferred";
+			std::ifstream dfile (deferredfile.c_str());
+			std::string dcell;
+			int dcount;
+			while (dfile >> dcell >> dcount) ndeferred[dcell] = dcount;
+			dfile.close();
+
+			// Mean runtime of the last simulations of each material
+			std::vector<double> runtime (mdtype.size(), 0.);
+			std::vector<int> nruntime (mdtype.size(), 0);
+			for (unsigned long long i=md_database.size(); i-- > 0;){
+				const MDRecord &r = md_database.record(i);
+				for (unsigned int imd=0; imd<mdtype.size(); imd++)
+					if (mdtype[imd] == r.mat && nruntime[imd] < 20 && r.runtime > 0.){
+						runtime[imd] += r.runtime;
+						nruntime[imd]++;
+					}
+			}
+			for (unsigned int imd=0; imd<mdtype.size(); imd++)
+				if (nruntime[imd] > 0) runtime[imd] /= nruntime[imd];
+
+			std::map<std::string, unsigned long long> last_record;
+			last_md_records(last_record);
+
+			std::vector<double> gain (ncupd, 0.), cost (ncupd, 0.), stress_level (ncupd, 0.);
+			std::vector<std::string> run_keys (ncupd);
+			std::vector<std::vector<SymmetricTensor<2,dim> > > cg_loc_rep_strain (ncupd,
+					std::vector<SymmetricTensor<2,dim> >(nrepl));
+			bool known_cost = true;
+
+			for (unsigned int c=0; c<ncupd; ++c)
+			{
+				int imd = 0;
+				for(unsigned int i=0; i<mdtype.size(); i++)
+					if(cell_mat[c]==mdtype[i])
+						imd=i;
+
+				cost[c] = nrepl*runtime[imd];
+				if (nruntime[imd] == 0) known_cost = false;
+
+				for(unsigned int repl=0;repl<nrepl;repl++)
+				{
+					int numrepl = repl+1;
+
+					unsigned long long fp;
+					double history[6], strain[6];
+					read_applied_strain(c, numrepl, cg_loc_rep_strain[c][repl]);
+					read_strain_history(c, numrepl, fp, history);
+
+					SymmetricTensor<2,dim> cg_total_strain;
+					unsigned int iv = 0;
+					for (unsigned int k=0; k<dim; k++)
+						for (unsigned int l=k; l<dim; l++){
+							strain[iv] = cg_loc_rep_strain[c][repl][k][l];
+							cg_total_strain[k][l] = history[iv] + strain[iv];
+							iv++;
+						}
+
+					SymmetricTensor<4,dim> cg_stiff = rotate_tensor(replica_data[imd*nrepl+repl].init_stiff,
+							replica_data[imd*nrepl+repl].rotam);
+					double elastic_increment = (cg_stiff*cg_loc_rep_strain[c][repl]).norm() + 1.0;
+					stress_level[c] += (cg_stiff*cg_total_strain).norm()/nrepl;
+
+					std::vector<double> p = surrogate_point(strain, history);
+					if (dedup_quantum > 0.) run_keys[c] += md_run_key(c, repl, fp, cg_loc_rep_strain[c][repl]) + " ";
+
+					std::vector<unsigned long long> ids;
+					std::vector<double> dists;
+					surrogate_trees[imd*nrepl+repl].nearest(p, nneighbours, ids, dists);
+
+					double pnorm = 0.;
+					for (unsigned int i=0; i<p.size(); i++) pnorm += p[i]*p[i];
+					pnorm = sqrt(pnorm) + 1.0e-12;
+
+					double novelty = (ids.size() > 0) ? std::min(1.0, dists[0]/pnorm) : 1.0;
+
+					double spread = 1.0;
+					if (cell_unc[c] >= 0.) spread = std::min(1.0, cell_unc[c]/elastic_increment);
+					else if (ids.size() > 1){
+						double mean[6] = {0., 0., 0., 0., 0., 0.}, var = 0.;
+						for (unsigned int n=0; n<ids.size(); n++)
+							for (unsigned int i=0; i<6; i++) mean[i] += md_database.record(ids[n]).stress[i]/ids.size();
+						for (unsigned int n=0; n<ids.size(); n++){
+							double diff[6];
+							for (unsigned int i=0; i<6; i++) diff[i] = md_database.record(ids[n]).stress[i] - mean[i];
+							var += md_strain_norm(diff)*md_strain_norm(diff)/ids.size();
+						}
+						spread = std::min(1.0, sqrt(var)/elastic_increment);
+					}
+
+					gain[c] += (novelty + spread)/nrepl;
+				}
+			}
+
+			double max_stress_level = *std::max_element(stress_level.begin(), stress_level.end()) + 1.0;
+
+			// Cells represented by a previous cell whose runs they all duplicate
+			std::vector<int> leader (ncupd, -1);
+			std::vector<unsigned int> group_size (ncupd, 1);
+			if (dedup_quantum > 0.){
+				std::map<std::string, int> leaders;
+				for (unsigned int c=0; c<ncupd; ++c){
+					std::map<std::string, int>::iterator it = leaders.find(run_keys[c]);
+					if (it == leaders.end()) leaders[run_keys[c]] = c;
+					else{
+						leader[c] = it->second;
+						group_size[it->second]++;
+					}
+				}
+			}
+
+			for (unsigned int c=0; c<ncupd; ++c){
+				gain[c] *= 1.0 + stress_level[c]/max_stress_level;
+				gain[c] *= group_size[c];
+				if (ndeferred.find(cell_id[c]) != ndeferred.end()) gain[c] *= 1.0 + ndeferred[cell_id[c]];
+			}
+			for (unsigned int c=0; c<ncupd; ++c)
+				if (leader[c] >= 0) gain[c] = gain[leader[c]];
+
+			std::vector<unsigned int> order (ncupd);
+			for (unsigned int c=0; c<ncupd; ++c) order[c] = c;
+			std::sort(order.begin(), order.end(),
+					[&gain](unsigned int a, unsigned int b){ return gain[a] > gain[b]; });
+
+			// Selection of the cells with the highest gain within the budget, at least one
+			int nbatches_max = std::max(1, int(mmd_n_processes/(batch_nnodes_min*machine_ppn)));
+			double capacity = md_job_budget*nbatches_max;
+			double used = 0.;
+			unsigned int nrun = 0;
+			for (unsigned int o=0; o<ncupd; ++o){
+				unsigned int c = order[o];
+				if (leader[c] >= 0) continue;
+				if (!known_cost || nrun == 0 || used + cost[c] <= capacity){
+					used += cost[c];
+					nrun += group_size[c];
+				}
+				else defer[c] = 1;
+			}
+			for (unsigned int c=0; c<ncupd; ++c)
+				if (leader[c] >= 0) defer[c] = defer[leader[c]];
+
+			std::string fname = nanologloc + "/alltime_deferred.dat";
+			bool fexists = file_exists(fname.c_str());
+			std::ofstream lfile (fname.c_str(), std::ios_base::app);
+			if (!fexists) lfile << "timestep newtonstep cell gain ndeferred" << std::endl;
+
+			std::vector<std::string> dfiles (1, deferredfile);
+			if (checkpoint_save) dfiles.push_back(nanostatelocres + "/lcts.deferred");
+			std::vector<std::ofstream *> dofiles;
+			for (unsigned int i=0; i<dfiles.size(); i++)
+				dofiles.push_back(new std::ofstream (dfiles[i].c_str()));
+
+			for (unsigned int c=0; c<ncupd; ++c){
+				if (!defer[c]) continue;
+
+				SymmetricTensor<2,dim> cg_loc_stress;
+				for(unsigned int repl=0;repl<nrepl;repl++)
+					cg_loc_stress += elastic_stress_prediction(c, repl, cg_loc_rep_strain[c][repl], last_record);
+				cg_loc_stress /= nrepl;
+				interpolate_cell(c, cg_loc_stress, cg_loc_rep_strain[c]);
+
+				int nd = (ndeferred.find(cell_id[c]) != ndeferred.end()) ? ndeferred[cell_id[c]] + 1 : 1;
+				lfile << timestep << " " << newtonstep << " " << cell_id[c] << " " << gain[c] << " " << nd << std::endl;
+				for (unsigned int i=0; i<dofiles.size(); i++) *dofiles[i] << cell_id[c] << " " << nd << std::endl;
+			}
+			lfile.close();
+			for (unsigned int i=0; i<dofiles.size(); i++){
+				dofiles[i]->close();
+				delete dofiles[i];
+			}
+
+			mcout << "        " << "...MD budget: simulating " << nrun << " out of " << ncupd << " cells";
+			if (known_cost) mcout << " (estimated " << used/nbatches_max << " s for a budget of " << md_job_budget << " s)";
+			else mcout << " (no runtime recorded yet for some materials)";
+			mcout << ", deferred " << ncupd - nrun << std::endl;
+		}
+
+		remove_cells(defer);
+	}
+
+
+
+	// Correction of the low-fidelity stresses of a material (common ground orientation), and
+	// number of low/high-fidelity pairs it has been learned from
+	template <int dim>
+	void STMDSync<dim>::read_low_fidelity_bias(unsigned int imd, unsigned int &n, SymmetricTensor<2,dim> &bias)
+	{
+		n = 0;
+		bias = 0;
+
+		char filename[1024];
+		sprintf(filename, "%s/last.%s.lofibias", nanostatelocout.c_str(), mdtype[imd].c_str());
+		std::ifstream ifile (filename);
+		if (ifile.is_open()){
+			ifile >> n;
+			for (unsigned int k=0; k<dim; k++)
+				for (unsigned int l=k; l<dim; l++)
+					ifile >> bias[k][l];
+			ifile.close();
+		}
+	}
+
+
+
+	template <int dim>
+	void STMDSync<dim>::write_low_fidelity_bias(unsigned int imd, unsigned int n, const SymmetricTensor<2,dim> &bias)
+	{
+		char filename[1024];
+		std::vector<std::string> bfiles;
+		sprintf(filename, "%s/last.%s.lofibias", nanostatelocout.c_str(), mdtype[imd].c_str());
+		bfiles.push_back(filename);
+		if (checkpoint_save){
+			sprintf(filename, "%s/lcts.%s.lofibias", nanostatelocres.c_str(), mdtype[imd].c_str());
+			bfiles.push_back(filename);
+		}
+
+		for (unsigned int ib=0; ib<bfiles.size(); ib++){
+			std::ofstream ofile (bfiles[ib].c_str());
+			ofile << n << std::endl;
+			for (unsigned int k=0; k<dim; k++)
+				for (unsigned int l=k; l<dim; l++)
+					ofile << std::setprecision(16) << bias[k][l] << std::endl;
+			ofile.close();
+		}
+	}
+
+
+
+	// Probing the cells to update with low-fidelity simulations (shorter sampling, higher
+	// strain rate), which leave the state of the replicas untouched. The bias-corrected
+	// low-fidelity stress of a cell is accepted if the standard error of its mean over the
+	// replicas and its difference with the elastic prediction from the last simulations
+	// are both below the tolerance, and once the correction of the material has been learned
+	// from a few cells. The strain of accepted cells is kept pending, the others are
+	// escalated to full simulations.
+	template <int dim>
+	void STMDSync<dim>::low_fidelity_md_simulations()
+	{
+		md_probe = true;
+		setup_md_runs(std::vector<int> (ncupd*nrepl, 1));
+		tune_kspace_settings();
+
+		mcout << "        " << "...probing with low-fidelity MD runs..." << std::endl;
+		if(use_pjm_scheduler){
+			execute_pjm_md_simulations();
+		}
+		else{
+			execute_inside_md_simulations();
+		}
+		MPI_Barrier(mmd_communicator);
+		fan_out_md_runs();
+		MPI_Barrier(mmd_communicator);
+		md_probe = false;
+
+		std::vector<int> accept (ncupd, 0);
+		lofi_stress.clear();
+
+		if (this_mmd_process == 0){
+			std::map<std::string, unsigned long long> last_record;
+			last_md_records(last_record);
+
+			std::vector<unsigned int> nbias (mdtype.size());
+			std::vector<SymmetricTensor<2,dim> > bias (mdtype.size());
+			for (unsigned int imd=0; imd<mdtype.size(); imd++)
+				read_low_fidelity_bias(imd, nbias[imd], bias[imd]);
+
+			std::string fname = nanologloc + "/alltime_lowfidelity.dat";
+			bool fexists = file_exists(fname.c_str());
+			std::ofstream lfile (fname.c_str(), std::ios_base::app);
+			if (!fexists) lfile << "timestep newtonstep cell mat stderr disagreement escalated" << std::endl;
+
+			unsigned int naccepted = 0;
+			for (unsigned int c=0; c<ncupd; ++c)
+			{
+				int imd = 0;
+				for(unsigned int i=0; i<mdtype.size(); i++)
+					if(cell_mat[c]==mdtype[i])
+						imd=i;
+
+				std::vector<SymmetricTensor<2,dim> > cg_loc_rep_strain (nrepl), cg_loc_rep_stress (nrepl);
+				SymmetricTensor<2,dim> cg_loc_stress, cg_pred_stress;
+				bool complete = true;
+
+				for(unsigned int repl=0;repl<nrepl;repl++)
+				{
+					int numrepl = repl+1;
+					int imdrun=c*nrepl + (repl);
+
+					read_applied_strain(c, numrepl, cg_loc_rep_strain[repl]);
+					cg_pred_stress += elastic_stress_prediction(c, repl, cg_loc_rep_strain[repl], last_record);
+
+					SymmetricTensor<2,dim> loc_rep_stress;
+					if(read_tensor<dim>(stressoutputfile[imdrun].c_str(), loc_rep_stress)){
+						loc_rep_stress -= replica_data[imd*nrepl+repl].init_stress;
+						cg_loc_rep_stress[repl] = rotate_tensor(loc_rep_stress, run_rotation(c, repl));
+						cg_loc_stress += cg_loc_rep_stress[repl];
+						remove(stressoutputfile[imdrun].c_str());
+					}
+					else complete = false;
+
+					std::string runtimefile = macrostatelocout + "/last." + cell_id[c] + "." + std::to_string(numrepl) + ".lofi.runtime";
+					remove(runtimefile.c_str());
+					remove(straininputfile[imdrun].c_str());
+
+					char command[1024];
+					sprintf(command, "rm -rf %s", qpreplogloc[imdrun].c_str());
+					int ret = system(command);
+					if (ret!=0){
+						std::cout << "Failed removing the log files of the MD simulation: " << qpreplogloc[imdrun] << std::endl;
+					}
+				}
+				cg_loc_stress /= nrepl;
+				cg_pred_stress /= nrepl;
+
+				double sem = 0.;
+				if (nrepl > 1){
+					for(unsigned int repl=0;repl<nrepl;repl++){
+						double dev = (cg_loc_rep_stress[repl] - cg_loc_stress).norm();
+						sem += dev*dev/(nrepl-1);
+					}
+					sem = sqrt(sem/nrepl);
+				}
+
+				SymmetricTensor<2,dim> cg_corr_stress = cg_loc_stress + bias[imd];
+				double disagreement = (cg_corr_stress - cg_pred_stress).norm();
+
+				bool escalate = !complete || nbias[imd] < 3
+						|| sem > lofi_tolerance || disagreement > lofi_tolerance;
+
+				if (escalate) lofi_stress[cell_id[c]] = cg_loc_stress;
+				else{
+					interpolate_cell(c, cg_corr_stress, cg_loc_rep_strain);
+					accept[c] = 1;
+					naccepted++;
+				}
+
+				lfile << timestep << " " << newtonstep << " " << cell_id[c] << " " << cell_mat[c]
+					  << " " << sem << " " << disagreement << " " << escalate << std::endl;
+			}
+			lfile.close();
+
+			mcout << "        " << "...low-fidelity MD accepted for " << naccepted << " out of "
+				  << ncupd << " cells, escalated " << ncupd - naccepted << std::endl;
+		}
+
+		remove_cells(accept);
+	}
+
+
+
+	// Learning the correction of the low-fidelity stresses of each material from the cells
+	// escalated to full simulations, as a running mean over the last pairs
+	template <int dim>
+	void STMDSync<dim>::update_low_fidelity_bias()
+	{
+		if (this_mmd_process != 0) return;
+
+		std::vector<unsigned int> nbias (mdtype.size());
+		std::vector<SymmetricTensor<2,dim> > bias (mdtype.size());
+		std::vector<bool> updated (mdtype.size(), false);
+		for (unsigned int imd=0; imd<mdtype.size(); imd++)
+			read_low_fidelity_bias(imd, nbias[imd], bias[imd]);
+
+		for (unsigned int c=0; c<ncupd; ++c)
+		{
+			if (lofi_stress.find(cell_id[c]) == lofi_stress.end()) continue;
+
+			int imd = 0;
+			for(unsigned int i=0; i<mdtype.size(); i++)
+				if(cell_mat[c]==mdtype[i])
+					imd=i;
+
+			SymmetricTensor<2,dim> cg_loc_stress;
+			char filename[1024];
+			sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id[c].c_str());
+			if (!read_tensor<dim>(filename, cg_loc_stress)) continue;
+
+			nbias[imd]++;
+			double w = 1.0/std::min(nbias[imd], (unsigned int) 20);
+			bias[imd] += w*(cg_loc_stress - lofi_stress[cell_id[c]] - bias[imd]);
+			updated[imd] = true;
+		}
+
+		for (unsigned int imd=0; imd<mdtype.size(); imd++)
+			if (updated[imd] || checkpoint_save)
+				write_low_fidelity_bias(imd, nbias[imd], bias[imd]);
+
+		lofi_stress.clear();
+	}
+
+
+
+	// Lazy tuning of the long-range solver settings, for each material to be simulated
+	// at this iteration and the current number of processes per batch, if not already
+	// cached. Materials are spread over the batches.
+	template <int dim>
+	void STMDSync<dim>::tune_kspace_settings()
+	{
+		if (md_force_field != "opls" || kspace_tolerance <= 0.0) return;
+
+		std::vector<std::string> mat_to_tune;
+		for(unsigned int imd=0; imd<mdtype.size(); imd++){
+			if(std::find(cell_mat.begin(), cell_mat.end(), mdtype[imd]) == cell_mat.end()) continue;
+
+			char tunefile[1024];
+			sprintf(tunefile, "%s/kspace.%s.%d.tune", nanostatelocout.c_str(), mdtype[imd].c_str(),
+					md_batch_n_processes);
+			if(!file_exists(tunefile)) mat_to_tune.push_back(mdtype[imd]);
+		}
+
+		if(mat_to_tune.size()>0){
+			mcout << "        " << "...tuning kspace settings for " << mat_to_tune.size()
+				  << " material(s) on " << md_batch_n_processes << " processes..." << std::endl;
+
+			for(unsigned int imt=0; imt<mat_to_tune.size(); imt++){
+				if (md_batch_pcolor == int(imt%n_md_batches)){
+					STMDProblem<3> stmd_problem (md_batch_communicator, md_batch_pcolor, &md_scripts);
+					stmd_problem.tune_kspace(mat_to_tune[imt], nanostatelocout, md_scripts_directory,
+							1, md_timestep_length, md_temperature, kspace_tolerance);
+				}
+			}
+			MPI_Barrier(mmd_communicator);
 		}
 	}
 
@@ -609,6 +1732,11 @@ namespace HMM
 		mcout << "        " << "...cells and replicas completed: " << std::flush;
 		for (unsigned int c=0; c<ncupd; ++c)
 		{
+			int imd = 0;
+			for(unsigned int i=0; i<mdtype.size(); i++)
+				if(cell_mat[c]==mdtype[i])
+					imd=i;
+
 			for(unsigned int repl=0;repl<nrepl;repl++)
 			{
 				// Offset replica number because in filenames, replicas start at 1
@@ -618,7 +1746,7 @@ namespace HMM
 				int imdrun=c*nrepl + (repl);
 
 				// Allocation of a MD run to a batch of processes
-				if (md_batch_pcolor == (imdrun%n_md_batches)){
+				if (md_batch_pcolor == md_run_batch[imdrun]){
 
 					// Executing from an external MPI_Communicator (avoids failure of the main communicator
 					// when the specific/external communicator fails)
@@ -642,13 +1770,15 @@ namespace HMM
 					}*/
 
 					// Executing directly from the current MPI_Communicator (not fault tolerant)
-					STMDProblem<3> stmd_problem (md_batch_communicator, md_batch_pcolor);
+					STMDProblem<3> stmd_problem (md_batch_communicator, md_batch_pcolor, &md_scripts);
 
 					stmd_problem.strain(cell_id[c], time_id, cell_mat[c], nanostatelocout, nanostatelocres,
 								   nanologlochom, qpreplogloc[imdrun], md_scripts_directory, straininputfile[imdrun],
 								   stressoutputfile[imdrun], numrepl, md_timestep_length, md_temperature,
-								   md_nsteps_sample, md_strain_rate, md_force_field,
-								   output_homog, checkpoint_save);
+								   md_probe ? lofi_nsteps_sample : md_nsteps_sample,
+								   md_probe ? lofi_strain_rate : md_strain_rate, md_force_field, md_run_style,
+								   output_homog, checkpoint_save, md_proc_grid, md_ghost_cutoff,
+								   md_rcb_balance && replica_data[imd*nrepl+repl].nflakes > 0, md_probe);
 				}
 			}
 		}
@@ -669,14 +1799,18 @@ namespace HMM
 				// The variable 'imdrun' assigned to a run is a multiple of the batch number the run will be run on
 				int imdrun=c*nrepl + (repl);
 
-				if (md_batch_pcolor == (imdrun%n_md_batches)){
+				if (md_batch_pcolor == md_run_batch[imdrun]){
 					if(this_md_batch_process == 0){
 
 						// Writting the argument list to be passed to the JSON file
 						std::string args_list_separator = " ";
 						std::string args_list = "./strain_md";
 						for (unsigned int i=0; i<md_args[imdrun].size(); i++){
-							args_list += args_list_separator+md_args[imdrun][i];
+							// Arguments containing spaces (run style) are quoted
+							if(md_args[imdrun][i].find(' ') != std::string::npos)
+								args_list += args_list_separator+"\""+md_args[imdrun][i]+"\"";
+							else
+								args_list += args_list_separator+md_args[imdrun][i];
 						}
 						args_list += "";
 
@@ -787,6 +1921,8 @@ namespace HMM
 	template <int dim>
 	void STMDSync<dim>::store_md_simulations()
 	{
+		std::vector<MDRecord> records;
+
 		// Averaging stiffness and stress per cell over replicas
 		for (unsigned int c=0; c<ncupd; ++c)
 		{
@@ -800,10 +1936,6 @@ namespace HMM
 				// Write the new stress and stiffness tensors into two files, respectively
 				// ./macrostate_storage/time.it-cellid.qid.stress and ./macrostate_storage/time.it-cellid.qid.stiff
 
-				//SymmetricTensor<4,dim> cg_loc_stiffness;
-				SymmetricTensor<2,dim> cg_loc_stress;
-				char filename[1024];
-
 				for(unsigned int repl=0;repl<nrepl;repl++)
 				{
 					// Offset replica number because in filenames, replicas start at 1
@@ -812,6 +1944,10 @@ namespace HMM
 					// The variable 'imdrun' assigned to a run is a multiple of the batch number the run will be run on
 					int imdrun=c*nrepl + (repl);
 
+					// Replica not simulated at this round
+					if (md_run_batch[imdrun] == -1) continue;
+					md_run_done[imdrun] = -1;
+
 					// Rotate stress and stiffness tensor from replica orientation to common ground
 
 					//SymmetricTensor<4,dim> cg_loc_stiffness, loc_rep_stiffness;
@@ -831,13 +1967,89 @@ namespace HMM
 						loc_rep_stress -= replica_data[imd*nrepl+repl].init_stress;
 
 						// Rotation of the stress tensor to common ground direction before averaging
-						cg_loc_rep_stress = rotate_tensor(loc_rep_stress, replica_data[imd*nrepl+repl].rotam);
+						cg_loc_rep_stress = rotate_tensor(loc_rep_stress, run_rotation(c, repl));
 
-						cg_loc_stress += cg_loc_rep_stress;
+						md_run_stress[imdrun] = cg_loc_rep_stress;
+						md_run_done[imdrun] = 1;
 
 						// Removing file now it has been used
 						remove(stressoutputfile[imdrun].c_str());
 
+						// Strain applied to the replica, in the common ground orientation
+						SymmetricTensor<2,dim> cg_loc_strain;
+						read_applied_strain(c, numrepl, cg_loc_strain);
+
+						// Recording the result of the simulation in the database, along with
+						// the strain history of the replica of the cell before this simulation
+						MDRecord rec;
+						memset(&rec, 0, sizeof(rec));
+						strncpy(rec.mat, cell_mat[c].c_str(), sizeof(rec.mat)-1);
+						rec.repl = numrepl;
+						strncpy(rec.cell, cell_id[c].c_str(), sizeof(rec.cell)-1);
+						strncpy(rec.time, time_id.c_str(), sizeof(rec.time)-1);
+
+						unsigned int iv = 0;
+						for (unsigned int k=0; k<dim; k++)
+							for (unsigned int l=k; l<dim; l++){
+								rec.strain[iv] = cg_loc_strain[k][l];
+								rec.stress[iv] = cg_loc_rep_stress[k][l];
+								iv++;
+							}
+
+						// The state is identified by the sequence of strains applied to the sample,
+						// in its symmetry frame
+						read_strain_history(c, numrepl, rec.state_key, rec.history);
+						SymmetricTensor<2,dim> cg_canonical_strain = canonical_strain(c, repl, cg_loc_strain);
+						double canonical[6];
+						iv = 0;
+						for (unsigned int k=0; k<dim; k++)
+							for (unsigned int l=k; l<dim; l++)
+								canonical[iv++] = cg_canonical_strain[k][l];
+						rec.history_fp = md_history_fingerprint(rec.state_key, canonical);
+
+						// Symmetry frame of the run, kept for the next simulations of the replica
+						if (mdsym[imd] != "none"){
+							std::string framefile = nanostatelocout + "/last." + cell_id[c] + "." + cell_mat[c] + "_" + std::to_string(numrepl) + ".frame";
+							write_tensor<dim>(framefile.c_str(), md_run_frame[imdrun]);
+							if (checkpoint_save){
+								framefile = nanostatelocres + "/lcts." + cell_id[c] + "." + cell_mat[c] + "_" + std::to_string(numrepl) + ".frame";
+								write_tensor<dim>(framefile.c_str(), md_run_frame[imdrun]);
+							}
+						}
+
+						std::string runtimefile = macrostatelocout + "/last." + cell_id[c] + "." + std::to_string(numrepl) + ".runtime";
+						read_tensor<dim>(runtimefile.c_str(), rec.runtime);
+						remove(runtimefile.c_str());
+
+						records.push_back(rec);
+
+						// Updating the strain history of the replica of the cell, saved with
+						// the state of the system when checkpointing. The strain pending from
+						// interpolated updates has now been applied.
+						char historyfile[1024];
+						char pendingfile[1024];
+						std::vector<std::string> hfiles, pfiles;
+						sprintf(historyfile, "%s/last.%s.%s_%d.history", nanostatelocout.c_str(),
+								cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+						sprintf(pendingfile, "%s/last.%s.%s_%d.pending", nanostatelocout.c_str(),
+								cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+						hfiles.push_back(historyfile); pfiles.push_back(pendingfile);
+						if (checkpoint_save){
+							sprintf(historyfile, "%s/lcts.%s.%s_%d.history", nanostatelocres.c_str(),
+									cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+							sprintf(pendingfile, "%s/lcts.%s.%s_%d.pending", nanostatelocres.c_str(),
+									cell_id[c].c_str(), cell_mat[c].c_str(), numrepl);
+							hfiles.push_back(historyfile); pfiles.push_back(pendingfile);
+						}
+						for (unsigned int ih=0; ih<hfiles.size(); ih++){
+							std::ofstream ofile (hfiles[ih].c_str());
+							ofile << rec.history_fp << std::endl;
+							for (unsigned int i=0; i<6; i++)
+								ofile << std::setprecision(16) << rec.history[i] + rec.strain[i] << std::endl;
+							ofile.close();
+							remove(pfiles[ih].c_str());
+						}
+
 						// Removing replica strain passing file used to average cell stress
 						remove(straininputfile[imdrun].c_str());
 
@@ -857,18 +2069,171 @@ namespace HMM
 					}
 				}
 
-				//cg_loc_stiffness /= nrepl;
-				cg_loc_stress /= nrepl;
+			}
+		}
+
+		store_md_results(records);
+	}
 
-				/*sprintf(filename, "%s/last.%s.stiff", macrostatelocout.c_str(), cell_id[c].c_str());
-				write_tensor<dim>(filename, cg_loc_stiffness);*/
 
-				sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id[c].c_str());
-				write_tensor<dim>(filename, cg_loc_stress);
 
+	// Activating the next replica of the cells for which the standard error of the mean
+	// stress over the replicas simulated so far exceeds the tolerance (or fewer than two
+	// replicas have been simulated). Returns whether another round of simulations is needed.
+	template <int dim>
+	bool STMDSync<dim>::next_replica_round(std::vector<int> &active)
+	{
+		std::vector<int> next (ncupd*nrepl, 0);
+
+		for (unsigned int c=0; c<ncupd; ++c)
+		{
+			if (this_mmd_process != int(c%mmd_n_processes)) continue;
+
+			unsigned int ndone = 0;
+			SymmetricTensor<2,dim> cg_loc_stress;
+			for(unsigned int repl=0;repl<nrepl;repl++)
+				if (md_run_done[c*nrepl+repl] == 1){
+					cg_loc_stress += md_run_stress[c*nrepl+repl];
+					ndone++;
+				}
+			if (ndone > 0) cg_loc_stress /= ndone;
+
+			double sem = 0.;
+			if (ndone > 1){
+				for(unsigned int repl=0;repl<nrepl;repl++)
+					if (md_run_done[c*nrepl+repl] == 1){
+						double dev = (md_run_stress[c*nrepl+repl] - cg_loc_stress).norm();
+						sem += dev*dev/(ndone-1);
+					}
+				sem = sqrt(sem/ndone);
 			}
+
+			if (ndone < 2 || sem > replica_tolerance)
+				for(unsigned int repl=0;repl<nrepl;repl++)
+					if (md_run_done[c*nrepl+repl] == 0){
+						next[c*nrepl+repl] = 1;
+						break;
+					}
 		}
 
+		MPI_Allreduce(&next[0], &active[0], ncupd*nrepl, MPI_INT, MPI_MAX, mmd_communicator);
+
+		return std::find(active.begin(), active.end(), 1) != active.end();
+	}
+
+
+
+	// Averaging the stress of each cell over the replicas which have been simulated, the
+	// strain increment of the other replicas being kept pending. The number of replicas
+	// used and the standard error of the mean are logged for each cell.
+	template <int dim>
+	void STMDSync<dim>::average_md_simulations()
+	{
+		std::vector<int> nused (ncupd, 0);
+		std::vector<double> sem (ncupd, 0.);
+
+		for (unsigned int c=0; c<ncupd; ++c)
+		{
+			if (this_mmd_process != int(c%mmd_n_processes)) continue;
+
+			SymmetricTensor<2,dim> cg_loc_stress;
+			for(unsigned int repl=0;repl<nrepl;repl++)
+				if (md_run_done[c*nrepl+repl] == 1){
+					cg_loc_stress += md_run_stress[c*nrepl+repl];
+					nused[c]++;
+				}
+			if (nused[c] > 0) cg_loc_stress /= nused[c];
+
+			if (nused[c] > 1){
+				for(unsigned int repl=0;repl<nrepl;repl++)
+					if (md_run_done[c*nrepl+repl] == 1){
+						double dev = (md_run_stress[c*nrepl+repl] - cg_loc_stress).norm();
+						sem[c] += dev*dev/(nused[c]-1);
+					}
+				sem[c] = sqrt(sem[c]/nused[c]);
+			}
+
+			char filename[1024];
+			sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id[c].c_str());
+			write_tensor<dim>(filename, cg_loc_stress);
+			sprintf(filename, "%s/last.%s.synthetic", macrostatelocout.c_str(), cell_id[c].c_str());
+			remove(filename);
+
+			// Keeping the strain increment to apply at the next MD simulation of the replicas
+			// which have not been simulated
+			for(unsigned int repl=0;repl<nrepl;repl++)
+			{
+				if (md_run_done[c*nrepl+repl] != 0) continue;
+
+				SymmetricTensor<2,dim> cg_loc_rep_strain;
+				read_applied_strain(c, repl+1, cg_loc_rep_strain);
+
+				std::vector<std::string> pfiles;
+				sprintf(filename, "%s/last.%s.%s_%d.pending", nanostatelocout.c_str(),
+						cell_id[c].c_str(), cell_mat[c].c_str(), repl+1);
+				pfiles.push_back(filename);
+				if (checkpoint_save){
+					sprintf(filename, "%s/lcts.%s.%s_%d.pending", nanostatelocres.c_str(),
+							cell_id[c].c_str(), cell_mat[c].c_str(), repl+1);
+					pfiles.push_back(filename);
+				}
+				for (unsigned int ip=0; ip<pfiles.size(); ip++)
+					write_tensor<dim>(pfiles[ip].c_str(), cg_loc_rep_strain);
+			}
+		}
+
+		if (nrepl_min >= nrepl) return;
+
+		std::vector<int> all_nused (ncupd, 0);
+		std::vector<double> all_sem (ncupd, 0.);
+		MPI_Reduce(&nused[0], &all_nused[0], ncupd, MPI_INT, MPI_SUM, 0, mmd_communicator);
+		MPI_Reduce(&sem[0], &all_sem[0], ncupd, MPI_DOUBLE, MPI_SUM, 0, mmd_communicator);
+
+		if (this_mmd_process == 0){
+			std::string fname = nanologloc + "/alltime_replicas.dat";
+			bool fexists = file_exists(fname.c_str());
+			std::ofstream lfile (fname.c_str(), std::ios_base::app);
+			if (!fexists) lfile << "timestep newtonstep cell nreplicas stderr" << std::endl;
+
+			unsigned int ntotal = 0;
+			for (unsigned int c=0; c<ncupd; ++c){
+				lfile << timestep << " " << newtonstep << " " << cell_id[c] << " "
+					  << all_nused[c] << " " << all_sem[c] << std::endl;
+				ntotal += all_nused[c];
+			}
+			lfile.close();
+
+			mcout << "        " << "...replicas simulated per cell: " << double(ntotal)/ncupd
+				  << " on average, out of " << nrepl << std::endl;
+		}
+	}
+
+
+
+	// Gathering the results of the MD simulations of this iteration on the first process,
+	// which appends them to the database and updates its index
+	template <int dim>
+	void STMDSync<dim>::store_md_results(const std::vector<MDRecord> &records)
+	{
+		int nbytes = records.size()*sizeof(MDRecord);
+		std::vector<int> all_nbytes (mmd_n_processes, 0);
+		MPI_Gather(&nbytes, 1, MPI_INT, &all_nbytes[0], 1, MPI_INT, 0, mmd_communicator);
+
+		std::vector<int> displs (mmd_n_processes, 0);
+		for (int i=1; i<mmd_n_processes; i++) displs[i] = displs[i-1] + all_nbytes[i-1];
+		int total_nbytes = displs[mmd_n_processes-1] + all_nbytes[mmd_n_processes-1];
+
+		std::vector<MDRecord> all_records;
+		if (this_mmd_process == 0) all_records.resize(total_nbytes/sizeof(MDRecord));
+
+		MPI_Gatherv(records.size() > 0 ? (void *) &records[0] : NULL, nbytes, MPI_BYTE,
+				all_records.size() > 0 ? (void *) &all_records[0] : NULL, &all_nbytes[0], &displs[0],
+				MPI_BYTE, 0, mmd_communicator);
+
+		if (this_mmd_process == 0 && all_records.size() > 0){
+			md_database.append(all_records);
+			md_database.build_index();
+		}
 	}
 
 
@@ -877,7 +2242,11 @@ namespace HMM
 			   std::string nslocin, std::string nslocout, std::string nslocres, std::string nlogloc,
 			   std::string nlogloctmp,std::string nloglochom, std::string mslocout,
 			   std::string mdsdir, int fchpt, int fohom, unsigned int bnmin, unsigned int mppn,
-			   std::vector<std::string> mdt, Tensor<1,dim> cgd, unsigned int nr, bool ups){
+			   std::vector<std::string> mdt, Tensor<1,dim> cgd, unsigned int nr, bool ups,
+			   bool pgrid, double ghcut, bool lbal, double ktol, std::string mdrs, std::string mddb,
+			   unsigned int snn, double stol, double shw, double mdjb,
+			   int lfnss, double lfstrr, double lftol, unsigned int nrmin, double rtol,
+			   double dedq, std::vector<std::string> mdsy){
 
 		start_timestep = sstp;
 
@@ -886,6 +2255,7 @@ namespace HMM
 		md_nsteps_sample = nss;
 		md_strain_rate = strr;
 		md_force_field = ffi;
+		md_run_style = mdrs;
 
 		nanostatelocin = nslocin;
 		nanostatelocout = nslocout;
@@ -897,6 +2267,35 @@ namespace HMM
 		macrostatelocout = mslocout;
 		md_scripts_directory = mdsdir;
 
+		// Loading the LAMMPS scripts once for the whole run, they are then submitted from
+		// memory by every MD simulation
+		md_scripts.load(mmd_communicator, md_scripts_directory);
+
+		// Results of the MD simulations are appended to the database by the first process
+		md_database_directory = mddb;
+		surrogate_nneighbours = snn;
+		surrogate_tolerance = stol;
+		surrogate_history_weight = shw;
+		md_job_budget = mdjb;
+
+		lofi_nsteps_sample = lfnss;
+		lofi_strain_rate = lfstrr;
+		lofi_tolerance = lftol;
+
+		nrepl_min = (nrmin > 0) ? nrmin : nr;
+		replica_tolerance = rtol;
+		dedup_quantum = dedq;
+		if (this_mmd_process == 0){
+			mkdir(md_database_directory.c_str(), ACCESSPERMS);
+			if(!md_database.open(md_database_directory, true)){
+				std::cerr << "Failed opening the MD results database in "
+						  << md_database_directory << std::endl;
+				exit(1);
+			}
+			mcout << "        " << "...MD results database: " << md_database.size()
+				  << " records" << std::endl;
+		}
+
 		freq_checkpoint = fchpt;
 		freq_output_homog = fohom;
 
@@ -907,12 +2306,36 @@ namespace HMM
 		cg_dir = cgd;
 		nrepl = nr;
 
+		mdsym = mdsy;
+		mdsym.resize(mdtype.size(), "none");
+
 		use_pjm_scheduler = ups;
 
+		md_proc_grid = pgrid;
+		md_ghost_cutoff = ghcut;
+		md_rcb_balance = lbal;
+		kspace_tolerance = ktol;
+
 		restart ();
 		load_replica_generation_data();
 		load_replica_equilibration_data();
 		average_replica_data();
+
+		// Transverse isotropy is defined around the flake normal of the replicas
+		for(unsigned int imd=0; imd<mdtype.size(); imd++){
+			if (mdsym[imd] != "none" && mdsym[imd] != "isotropic" && mdsym[imd] != "transverse"){
+				std::cerr << "Error: material symmetry of " << mdtype[imd] << " is " << mdsym[imd]
+						  << " but only 'none', 'isotropic' and 'transverse' are implemented..." << std::endl;
+				exit(1);
+			}
+			if (mdsym[imd] == "transverse")
+				for(unsigned int repl=0;repl<nrepl;repl++)
+					if (replica_data[imd*nrepl+repl].nflakes != 1){
+						std::cerr << "Error: transversely isotropic material " << mdtype[imd]
+								  << " requires replicas with a single flake" << std::endl;
+						exit(1);
+					}
+		}
 	}
 
 	template <int dim>
@@ -937,16 +2360,46 @@ namespace HMM
 		prepare_md_simulations();
 
 		MPI_Barrier(mmd_communicator);
+
+		// Low-fidelity probing, only the cells for which it is not accurate enough are
+		// simulated afterwards
+		if (ncupd>0 && lofi_nsteps_sample>0) low_fidelity_md_simulations();
+
 		if (ncupd>0){
-			if(use_pjm_scheduler){
-				execute_pjm_md_simulations();
-			}
-			else{
-				execute_inside_md_simulations();
+			// Rounds of simulations, starting with the minimum number of replicas of each
+			// cell, and adding replicas to the cells whose mean stress is not accurate enough
+			std::vector<int> active (ncupd*nrepl, 0);
+			for (unsigned int c=0; c<ncupd; ++c)
+				for(unsigned int repl=0;repl<std::min(nrepl_min,nrepl);repl++)
+					active[c*nrepl+repl] = 1;
+			md_run_done.assign(ncupd*nrepl, 0);
+			md_run_stress.assign(ncupd*nrepl, SymmetricTensor<2,dim>());
+
+			bool run_round = true;
+			while (run_round){
+				setup_md_runs(active);
+				tune_kspace_settings();
+
+				if(use_pjm_scheduler){
+					execute_pjm_md_simulations();
+				}
+				else{
+					execute_inside_md_simulations();
+				}
+
+				MPI_Barrier(mmd_communicator);
+				fan_out_md_runs();
+				MPI_Barrier(mmd_communicator);
+				store_md_simulations();
+
+				run_round = (nrepl_min < nrepl) && next_replica_round(active);
 			}
+			average_md_simulations();
 
-			MPI_Barrier(mmd_communicator);
-			store_md_simulations();
+			if (lofi_nsteps_sample>0){
+				MPI_Barrier(mmd_communicator);
+				update_low_fidelity_bias();
+			}
 		}
 	}
 }
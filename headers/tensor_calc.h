@@ -68,6 +68,110 @@ rotate_tensor (const SymmetricTensor<2,dim> &tensor,
 	return stmp;
 }
 
+// Proper rotation whose columns are the eigenvectors of a symmetric tensor, sorted by
+// decreasing eigenvalue (cyclic Jacobi method): rotate_tensor(tensor, transpose(frame))
+// is diagonal
+inline
+Tensor<2,3>
+symmetric_eigen_frame (const SymmetricTensor<2,3> &tensor)
+{
+	double a[3][3], v[3][3];
+	double norm2 = 0.;
+	for (unsigned int i=0; i<3; ++i)
+		for (unsigned int j=0; j<3; ++j){
+			a[i][j] = tensor[i][j];
+			v[i][j] = (i==j) ? 1.0 : 0.0;
+			norm2 += a[i][j]*a[i][j];
+		}
+
+	for (unsigned int sweep=0; sweep<50; ++sweep){
+		double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+		if (off <= 1.0e-30*norm2) break;
+
+		for (unsigned int p=0; p<2; ++p)
+			for (unsigned int q=p+1; q<3; ++q){
+				if (a[p][q] == 0.) continue;
+				double theta = (a[q][q] - a[p][p])/(2.0*a[p][q]);
+				double t = ((theta >= 0.) ? 1.0 : -1.0)/(std::fabs(theta) + std::sqrt(theta*theta + 1.0));
+				double c = 1.0/std::sqrt(t*t + 1.0);
+				double s = t*c;
+				for (unsigned int k=0; k<3; ++k){
+					double akp = a[k][p], akq = a[k][q];
+					a[k][p] = c*akp - s*akq;
+					a[k][q] = s*akp + c*akq;
+				}
+				for (unsigned int k=0; k<3; ++k){
+					double apk = a[p][k], aqk = a[q][k];
+					a[p][k] = c*apk - s*aqk;
+					a[q][k] = s*apk + c*aqk;
+					double vkp = v[k][p], vkq = v[k][q];
+					v[k][p] = c*vkp - s*vkq;
+					v[k][q] = s*vkp + c*vkq;
+				}
+			}
+	}
+
+	unsigned int order[3] = {0, 1, 2};
+	for (unsigned int i=0; i<3; ++i)
+		for (unsigned int j=i+1; j<3; ++j)
+			if (a[order[j]][order[j]] > a[order[i]][order[i]]) std::swap(order[i], order[j]);
+
+	Tensor<2,3> frame;
+	for (unsigned int i=0; i<3; ++i)
+		for (unsigned int j=0; j<3; ++j)
+			frame[i][j] = v[i][order[j]];
+
+	if (determinant(frame) < 0.)
+		for (unsigned int i=0; i<3; ++i) frame[i][2] *= -1.0;
+
+	return frame;
+}
+
+// Symmetry operation of a transversely isotropic material of given axis (rotation about
+// the axis, or half-turn about a transverse direction) such that, in a basis (e1, e2, axis),
+// rotate_tensor(tensor, transpose(frame)) has no in-plane shear, in-plane components sorted
+// in decreasing order and non-negative out-of-plane shears
+inline
+Tensor<2,3>
+transverse_canonical_frame (const SymmetricTensor<2,3> &tensor, const Tensor<1,3> &axis)
+{
+	// Orthonormal basis (e1, e2, n), stored as the columns of b
+	Tensor<1,3> n = axis/axis.norm();
+	Tensor<1,3> e1, e2;
+	e1[(std::fabs(n[0]) < 0.9) ? 0 : 1] = 1.0;
+	e1 -= (e1*n)*n;
+	e1 /= e1.norm();
+	e2[0] = n[1]*e1[2] - n[2]*e1[1];
+	e2[1] = n[2]*e1[0] - n[0]*e1[2];
+	e2[2] = n[0]*e1[1] - n[1]*e1[0];
+
+	Tensor<2,3> b;
+	for (unsigned int i=0; i<3; ++i){
+		b[i][0] = e1[i]; b[i][1] = e2[i]; b[i][2] = n[i];
+	}
+
+	SymmetricTensor<2,3> tb = rotate_tensor(tensor, transpose(b));
+
+	// Rotation about the axis cancelling the in-plane shear
+	double theta = 0.5*std::atan2(2.0*tb[0][1], tb[0][0] - tb[1][1]);
+	double c = std::cos(theta), s = std::sin(theta);
+	double e13 = c*tb[0][2] + s*tb[1][2];
+	double e23 = -s*tb[0][2] + c*tb[1][2];
+
+	// Half-turns (about the axis, e1 or e2) making the out-of-plane shears non-negative
+	double sg[3] = {1.0, 1.0, 1.0};
+	if (e13 < 0. && e23 < 0.){ sg[0] = -1.0; sg[1] = -1.0; }
+	else if (e13 < 0.){ sg[1] = -1.0; sg[2] = -1.0; }
+	else if (e23 < 0.){ sg[0] = -1.0; sg[2] = -1.0; }
+
+	Tensor<2,3> l;
+	l[0][0] = c*sg[0]; l[0][1] = -s*sg[1];
+	l[1][0] = s*sg[0]; l[1][1] = c*sg[1];
+	l[2][2] = sg[2];
+
+	return b*l*transpose(b);
+}
+
 template <int dim>
 inline
 SymmetricTensor<4,dim>
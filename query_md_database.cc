@@ -0,0 +1,89 @@
+/* ---------------------------------------------------------------------
+ *
+ * Copyright (C) 2000 - 2015 by the deal.II authors
+ *
+ * This file is part of the deal.II library.
+ *
+ * The deal.II library is free software; you can use it, redistribute
+ * it, and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * The full text of the license can be found in the file LICENSE at
+ * the top level of the deal.II distribution.
+ *
+ * ---------------------------------------------------------------------
+
+ *
+ * Author: Wolfgang Bangerth, University of Heidelberg, 2000
+ */
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+
+// Specifically built header files
+#include "headers/md_database.h"
+
+// Offline query of the database of MD results, either summarizing its content per
+// material, or listing the results of a material for strain increments (common ground
+// orientation, (00, 01, 02, 11, 12, 22) order) within a distance tolerance.
+int main (int argc, char **argv)
+{
+	using namespace HMM;
+
+	if(argc!=2 && argc!=10 && argc!=11){
+		std::cerr << "Wrong number of arguments, expected: "
+				  << "'./query_md_database dbdir' or "
+				  << "'./query_md_database dbdir mat e00 e01 e02 e11 e12 e22 tolerance [replica]'"
+				  << ", but argc is " << argc << std::endl;
+		exit(1);
+	}
+
+	MDDatabase md_database;
+	if(!md_database.open(argv[1], false)){
+		std::cerr << "No MD results database found in " << argv[1] << std::endl;
+		exit(1);
+	}
+
+	if(argc==2){
+		std::map<std::string, unsigned long long> nrecords;
+		std::map<std::string, double> runtime;
+		for(unsigned long long i=0; i<md_database.size(); i++){
+			const MDRecord &r = md_database.record(i);
+			nrecords[r.mat]++;
+			runtime[r.mat] += r.runtime;
+		}
+
+		std::cout << "Number of records: " << md_database.size() << std::endl;
+		for(std::map<std::string, unsigned long long>::iterator it=nrecords.begin(); it!=nrecords.end(); ++it)
+			std::cout << " - material " << it->first << ": " << it->second << " records, "
+					  << runtime[it->first]/it->second << " s per MD simulation" << std::endl;
+		return 0;
+	}
+
+	std::string mat = argv[2];
+	double strain[6];
+	for(unsigned int i=0; i<6; i++) strain[i] = std::stod(argv[3+i]);
+	double tol = std::stod(argv[9]);
+	int repl = (argc==11) ? std::stoi(argv[10]) : 0;
+
+	std::vector<unsigned long long> ids;
+	md_database.query(mat, repl, strain, tol, ids);
+
+	std::cout << "# id repl cell time state_key distance strain(6) history(6) stress(6) runtime" << std::endl;
+	for(unsigned int i=0; i<ids.size(); i++){
+		const MDRecord &r = md_database.record(ids[i]);
+		std::cout << ids[i] << " " << r.repl << " " << r.cell << " " << r.time << " "
+				  << std::hex << r.state_key << std::dec << " "
+				  << std::setprecision(6) << md_strain_distance(r.strain, strain);
+		for(unsigned int j=0; j<6; j++) std::cout << " " << r.strain[j];
+		for(unsigned int j=0; j<6; j++) std::cout << " " << r.history[j];
+		for(unsigned int j=0; j<6; j++) std::cout << " " << r.stress[j];
+		std::cout << " " << r.runtime << std::endl;
+	}
+
+	return 0;
+}
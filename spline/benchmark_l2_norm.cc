@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <chrono>
+#include <random>
+
+#include <mpi.h>
+
+#include "strain2spline.h"
+
+// Scalar routine used by compare_L2_norm() before the vectorised kernel
+double reference_L2_norm(const double *a, const double *b, uint32_t N)
+{
+	double sum = 0;
+	for(uint32_t i = 0; i < N; i++) {
+		double diff = a[i] - b[i];
+		sum += diff*diff;
+	}
+	return sqrt(sum);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* All-pairs search of the most similar history and of the histories within threshold, as done by
+ * compare_histories_with_all_ranks() on a single rank, with the reference routine (mode 0), the
+ * vectorised kernel (mode 1), and the vectorised kernel abandoning comparisons early (mode 2) */
+double search(std::vector<double>& splines, uint32_t num_histories, uint32_t num_points, double threshold, int mode,
+		std::vector<uint32_t>& nearest, uint64_t& num_similar)
+{
+	std::vector<double> best(num_histories, std::numeric_limits<double>::infinity());
+	nearest.assign(num_histories, std::numeric_limits<uint32_t>::max());
+	num_similar = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(uint32_t a = 0; a < num_histories; a++) {
+		const double *sa = &splines[(uint64_t)a*num_points];
+		for(uint32_t b = 0; b < num_histories; b++) {
+			if(a == b) continue;
+			const double *sb = &splines[(uint64_t)b*num_points];
+
+			double diff;
+			if(mode == 0) {
+				diff = reference_L2_norm(sa, sb, num_points);
+			} else {
+				double bound = std::numeric_limits<double>::infinity();
+				if(mode == 2) bound = std::max(threshold, best[a])*std::max(threshold, best[a]);
+				double diff2 = MatHistPredict::squared_L2_distance(sa, sb, num_points, bound);
+				if(diff2 > bound) continue;
+				diff = sqrt(diff2);
+			}
+
+			if(diff < threshold) num_similar++;
+			if(diff < best[a]) {
+				best[a] = diff;
+				nearest[a] = b;
+			}
+		}
+	}
+	return seconds_since(start);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 4) {
+		fprintf(stderr, "Usage: ./benchmark_l2_norm NUM_HISTORIES NUM_SPLINE_POINTS THRESH\n");
+		return 1;
+	}
+
+	uint32_t num_histories = atoi(argv[1]);
+	uint32_t num_points = 6*atoi(argv[2]);
+	double threshold = atof(argv[3]);
+
+	// Random walks as strain histories, so that a few of them are close to each other
+	std::mt19937 gen(1);
+	std::normal_distribution<double> normal(0., 1.);
+	std::vector<double> splines((uint64_t)num_histories*num_points);
+	for(uint32_t h = 0; h < num_histories; h++) {
+		for(uint32_t c = 0; c < 6; c++) {
+			double strain = 0;
+			for(uint32_t n = c; n < num_points; n += 6) {
+				strain += 1.0e-3*normal(gen);
+				splines[(uint64_t)h*num_points + n] = strain;
+			}
+		}
+	}
+
+#if defined(__AVX512F__)
+	const char *simd = "AVX-512";
+#elif defined(__AVX2__)
+	const char *simd = "AVX2";
+#else
+	const char *simd = "scalar";
+#endif
+
+	const char *names[3] = {"reference", "vectorised", "vectorised + early abandon"};
+	std::vector<uint32_t> nearest[3];
+	uint64_t num_similar[3];
+	double times[3];
+	for(int mode = 0; mode < 3; mode++) {
+		times[mode] = search(splines, num_histories, num_points, threshold, mode, nearest[mode], num_similar[mode]);
+	}
+
+	printf("%u histories of %u values, kernel: %s\n", num_histories, num_points, simd);
+	for(int mode = 0; mode < 3; mode++) {
+		uint32_t mismatches = 0;
+		for(uint32_t h = 0; h < num_histories; h++) {
+			if(nearest[mode][h] != nearest[0][h]) mismatches++;
+		}
+		printf("%-28s %8.3fs  speedup %5.2f  similar pairs %lu  nearest mismatches %u\n",
+				names[mode], times[mode], times[0]/times[mode], (unsigned long)num_similar[mode], mismatches);
+	}
+
+	return 0;
+}
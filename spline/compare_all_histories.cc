@@ -3,10 +3,13 @@
 #include <vector>
 #include <stdint.h>
 #include <iostream>
+#include <chrono>
+#include <string>
+#include <thread>
 
 #include <sys/types.h>
 #include <dirent.h>
- 
+
 #include "strain2spline.h"
 
 bool starts_with(std::string mainStr, std::string toMatch)
@@ -28,60 +31,144 @@ void read_directory(const std::string& name, std::vector<std::string>& v)
 	closedir(dirp);
 }
 
+/* Wall-clock time spent in each stage of the tool */
+class Timings
+{
+	public:
+		void start()
+		{
+			stage_start = std::chrono::steady_clock::now();
+		}
+
+		void stop(const char *stage)
+		{
+			stages.push_back(stage);
+			seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - stage_start).count());
+		}
+
+		void print()
+		{
+			double total = 0;
+			for(uint32_t i = 0; i < seconds.size(); i++) total += seconds[i];
+
+			std::cout << "Timing breakdown:\n";
+			for(uint32_t i = 0; i < seconds.size(); i++) {
+				printf("  %-20s %10.3fs %6.1f%%\n", stages[i].c_str(), seconds[i], (total > 0) ? 100.*seconds[i]/total : 0.);
+			}
+			printf("  %-20s %10.3fs\n", "total", total);
+		}
+
+	private:
+		std::chrono::steady_clock::time_point stage_start;
+		std::vector<std::string> stages;
+		std::vector<double> seconds;
+};
+
 int main(int argc, char** argv) {
 
-	if(argc != 3) {
-		fprintf(stderr, "Usage: ./compare_all_histories STRAIN_DIRECTORY NUM_SPLINE_POINTS\n");
+	if(argc != 3 && argc != 5 && argc != 6) {
+		fprintf(stderr, "Usage: ./compare_all_histories STRAIN_DIRECTORY NUM_SPLINE_POINTS [THRESH EDGES_FILE [NUM_THREADS]]\n");
+		fprintf(stderr, "Without THRESH, the difference of every pair of histories is printed. Otherwise, the pairs closer than THRESH\n"
+				"(possibly inf) are written to the binary EDGES_FILE: the number of pairs (uint64), then for each pair the IDs\n"
+				"of both histories (2 x uint32) and their difference (double), sorted by IDs.\n");
 		return 1;
 	}
 	char *straindir = argv[1];
 	uint32_t num_points = atoi(argv[2]);
 
+	bool edges_mode = (argc >= 5);
+	double threshold = edges_mode ? atof(argv[3]) : 0.;
+	uint32_t num_threads = std::thread::hardware_concurrency();
+	if(argc == 6) num_threads = atoi(argv[5]);
+
+	Timings timings;
+
 	// Get list of strain history files in given directory
 	std::vector<std::string> fnames;
 	read_directory(straindir, fnames);
 
 	// Read all strain histories to vector
-	time_t start_read = time(NULL);
-	std::vector<Strain6D*> strains;
+	timings.start();
+	std::vector<MatHistPredict::Strain6D*> strains;
+	std::vector<std::string> strain_fnames;
 	for(std::string fname : fnames) {
 		if(!starts_with(fname, "strain_")) {
-			std::cout << "Ignoring: '" << fname << "'\n";
+			if(!edges_mode) std::cout << "Ignoring: '" << fname << "'\n";
 			continue;
 		}
-		std::cout << "Reading: '" << fname << "'\n";
-		Strain6D *s6D = new Strain6D();
+		if(!edges_mode) std::cout << "Reading: '" << fname << "'\n";
+		MatHistPredict::Strain6D *s6D = new MatHistPredict::Strain6D();
 		s6D->from_file((std::string(straindir) + fname).c_str());
+		s6D->set_ID(atoi(fname.substr(7).c_str()));
 
 		strains.push_back(s6D);
+		strain_fnames.push_back(fname);
 	}
-	time_t end_read = time(NULL);
+	timings.stop("read");
 
 	// Splinify all histories
-	time_t start_spline = time(NULL);
+	timings.start();
 	uint32_t num_cells = strains.size();
 	for(uint32_t i = 0; i < num_cells; i++) {
 		strains[i]->splinify(num_points);
 	}
-	time_t end_spline = time(NULL);
+	timings.stop("spline");
 
-	// Carry out all comparisons
-	time_t start_compare = time(NULL);
-	for(uint32_t i = 0; i < num_cells; i++) {
-		for(uint32_t j = i; j < num_cells; j++) {
-			double L2 = compare_L2_norm(strains[i], strains[j]);
-			std::cout << strains[i]->in_fname << " vs " << strains[j]->in_fname << ":" << L2 << "\n";
+	if(!edges_mode) {
+		// Carry out all comparisons
+		timings.start();
+		for(uint32_t i = 0; i < num_cells; i++) {
+			for(uint32_t j = i; j < num_cells; j++) {
+				double L2 = MatHistPredict::compare_L2_norm(strains[i], strains[j]);
+				std::cout << strain_fnames[i] << " vs " << strain_fnames[j] << ":" << L2 << "\n";
+			}
 		}
-	}
-	time_t end_compare = time(NULL);
+		timings.stop("compare and print");
+	} else {
+		// Pack the splines as the rows of a matrix
+		timings.start();
+		uint32_t num_values = 6*num_points;
+		std::vector<double> splines((uint64_t)num_cells*num_values);
+		for(uint32_t i = 0; i < num_cells; i++) {
+			std::copy(strains[i]->get_spline()->begin(), strains[i]->get_spline()->end(), splines.begin() + (uint64_t)i*num_values);
+		}
+		timings.stop("pack");
+
+		timings.start();
+		std::vector<HISTORY_EDGE> edges;
+		MatHistPredict::distance_edges(splines.data(), num_cells, num_values, threshold, num_threads, edges);
+		timings.stop("distance matrix");
 
-	double read_time = double(end_read - start_read);
-	double spline_time = double(end_spline - start_spline);
-	double compare_time = double(end_compare - start_compare);
+		// Replace the indices of the histories by their IDs, and write the edge list
+		timings.start();
+		for(uint64_t e = 0; e < edges.size(); e++) {
+			uint32_t id_a = strains[edges[e].a]->get_ID(), id_b = strains[edges[e].b]->get_ID();
+			edges[e].a = std::min(id_a, id_b);
+			edges[e].b = std::max(id_a, id_b);
+		}
+		std::sort(edges.begin(), edges.end(), [](const HISTORY_EDGE& x, const HISTORY_EDGE& y) {
+			return (x.a < y.a) || (x.a == y.a && x.b < y.b);
+		});
+
+		FILE *outfile = fopen(argv[4], "wb");
+		if(outfile == NULL) {
+			fprintf(stderr, "Could not open %s for writing.\n", argv[4]);
+			return 1;
+		}
+		uint64_t num_edges = edges.size();
+		fwrite(&num_edges, sizeof(uint64_t), 1, outfile);
+		for(uint64_t e = 0; e < num_edges; e++) {
+			fwrite(&edges[e].a, sizeof(uint32_t), 1, outfile);
+			fwrite(&edges[e].b, sizeof(uint32_t), 1, outfile);
+			fwrite(&edges[e].diff, sizeof(double), 1, outfile);
+		}
+		fclose(outfile);
+		timings.stop("write edges");
+
+		std::cout << num_cells << " histories, " << num_edges << " pairs within " << threshold << ", " << num_threads << " threads\n";
+	}
 
-	std::cout << "Read time: " << read_time << "\n";
-	std::cout << "Spline time: " << spline_time << "\n";
-	std::cout << "Compare time: " << compare_time << "\n";
+	timings.print();
 
 	return 0;
 }
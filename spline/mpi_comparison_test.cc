@@ -46,8 +46,8 @@ void erase_substring(std::string & mainStr, const std::string &toErase)
 
 int main(int argc, char **argv)
 {
-	if(argc != 4) {
-		fprintf(stderr, "Usage: ./mpi_comparison_test STRAIN_DIRECTORY NUM_SPLINE_POINTS THRESH\n");
+	if(argc < 4 || argc > 7) {
+		fprintf(stderr, "Usage: ./mpi_comparison_test STRAIN_DIRECTORY NUM_SPLINE_POINTS THRESH [NUM_LSH_TABLES NUM_LSH_PROJECTIONS [validate] | pca NUM_COMPONENTS | float | int16]\n");
 		return 1;
 	}
 
@@ -55,6 +55,31 @@ int main(int argc, char **argv)
 	uint32_t num_points = atoi(argv[2]);
 	double acceptable_diff_threshold = atof(argv[3]); 
 
+	// Approximate comparison using the LSH index if a number of tables is given,
+	// optionally validated against the exhaustive comparison
+	uint32_t num_lsh_tables = 0, num_lsh_projections = 0;
+	bool validate_index = false;
+	// Or comparison of the descriptors of the histories in a PCA basis with the given number of components
+	uint32_t num_pca_components = 0;
+	// Or exhaustive comparison exchanging the histories in single precision or as scaled 16-bit integers
+	MatHistPredict::ExchangePrecision precision = MatHistPredict::EXCHANGE_DOUBLE;
+	if(argc == 5) {
+		if(std::string(argv[4]) == "float") precision = MatHistPredict::EXCHANGE_FLOAT;
+		else if(std::string(argv[4]) == "int16") precision = MatHistPredict::EXCHANGE_INT16;
+		else {
+			fprintf(stderr, "Unknown exchange precision '%s' (float or int16).\n", argv[4]);
+			return 1;
+		}
+	} else if(argc == 6 && std::string(argv[4]) == "pca") {
+		num_pca_components = atoi(argv[5]);
+	} else if(argc >= 6) {
+		num_lsh_tables = atoi(argv[4]);
+		num_lsh_projections = atoi(argv[5]);
+	}
+	if(argc == 7) {
+		validate_index = (std::string(argv[6]) == "validate");
+	}
+
 	MPI_Comm comm = MPI_COMM_WORLD;
 
 	// set up MPI
@@ -82,12 +107,12 @@ int main(int argc, char **argv)
 			MatHistPredict::Strain6D *new_s6D = new MatHistPredict::Strain6D();
 			new_s6D->from_file((std::string(straindir) + fname).c_str());
 
-			new_s6D->splinify(num_points);
-
 			erase_substring(fname, "strain_");
 			uint32_t id = atoi(fname.c_str());
 //			std::cout << id << "\n";
 			new_s6D->set_ID(id);
+			// Only the histories within threshold are written, the others comparisons can be abandoned
+			new_s6D->set_record_all_similar_histories(false);
 
 			histories.push_back(new_s6D);
 		}
@@ -96,9 +121,28 @@ int main(int argc, char **argv)
 	uint32_t num_histories_on_this_rank = histories.size();
 	//time_t end_read = time(NULL);
 
+	MatHistPredict::splinify_all(histories, num_points);
+
 	
 	// Find the most similar strain histories
-	MatHistPredict::compare_histories_with_all_ranks(histories, acceptable_diff_threshold, comm);
+	if(num_pca_components > 0) {
+		MatHistPredict::Strain6DPCA pca(num_pca_components);
+		pca.fit(histories, comm);
+		MatHistPredict::compare_histories_with_descriptors(histories, acceptable_diff_threshold, comm, pca);
+	} else if(num_lsh_tables == 0) {
+		MatHistPredict::compare_histories_with_all_ranks(histories, acceptable_diff_threshold, comm,
+								256*1024*1024, precision);
+	} else if(validate_index) {
+		MatHistPredict::validate_histories_index(histories, acceptable_diff_threshold, comm, num_lsh_tables, num_lsh_projections);
+	} else {
+		MatHistPredict::compare_histories_with_index(histories, acceptable_diff_threshold, comm, num_lsh_tables, num_lsh_projections);
+	}
+
+	// Coarse-graining of the similarity graph
+	uint32_t num_simulations = MatHistPredict::coarsegrain_similarity_graph(histories, comm);
+	if(this_rank == 0) {
+		std::cout << "Number of simulations required: " << num_simulations << "\n";
+	}
 
 	// Results
 	for(uint32_t i=0; i < num_histories_on_this_rank; i++) {
@@ -4,10 +4,24 @@
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <climits>
+#include <map>
+#include <set>
+#include <random>
+#include <future>
+#include <atomic>
+#include <cfloat>
 #include <stdint.h>
+#include <mpi.h>
 #include <fstream>
 #include <math.h>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 #include "spline.h"
 
 typedef struct
@@ -16,10 +30,32 @@ typedef struct
 	double diff;
 } HISTORY_ID_DIFF_PAIR;
 
+typedef struct
+{
+	uint32_t a;
+	uint32_t b;
+	double diff;
+} HISTORY_EDGE;
+
+typedef struct
+{
+	uint32_t num_histories;
+	uint32_t num_representatives;
+	uint32_t num_kept;		// same history to get the results from as at the previous update
+	uint32_t num_reassigned;	// moved to another representative
+	uint32_t num_reclustered;	// compared and coarse-grained again
+	bool full_refresh;
+} CLUSTERING_CHURN;
+
 namespace MatHistPredict {
 
+	class Strain6D;
+	void splinify_all(std::vector<Strain6D*>& histories, uint32_t num_spline_points_per_component);
+
 	class Strain6D
 	{
+		friend void splinify_all(std::vector<Strain6D*>& histories, uint32_t num_spline_points_per_component);
+
 		public:
 			Strain6D()
 			{
@@ -34,6 +70,12 @@ namespace MatHistPredict {
 				most_similar_history.diff = 0;
 
 				most_similar_histories.clear();
+				record_all_similar_histories = true;
+
+				compression_tolerance = -1;
+				compression_max_knots = 0;
+				segment_open = false;
+				replaying = false;
 
 				ID_to_get_results_from = std::numeric_limits<uint32_t>::max();
 			}
@@ -44,31 +86,48 @@ namespace MatHistPredict {
 				this->ID_is_set = true;
 			}
 
-			void add_current_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz)
+			/* Bound the memory of the history by storing it as a piecewise-linear simplification: the strain
+			 * steps are only kept as the knots of a polyline within tolerance of every step (per component).
+			 * If max_knots is not zero, the tolerance is doubled and the knots simplified again whenever there
+			 * are more knots than max_knots, the error then remaining below twice the final tolerance.
+			 * A negative tolerance (default) keeps every step. Must be set before adding any strain.
+			 */
+			void set_compression(double tolerance, uint32_t max_knots)
 			{
-				up_to_date = false;
+				if(num_steps_added > 0) {
+					fprintf(stderr, "Error: set_compression() must be called before adding strain steps.\n");
+					exit(1);
+				}
+				if(max_knots > 0 && (max_knots < 2 || tolerance <= 0)) {
+					fprintf(stderr, "Error: a maximum number of knots needs at least 2 knots and a positive tolerance.\n");
+					exit(1);
+				}
+				compression_tolerance = tolerance;
+				compression_max_knots = max_knots;
+			}
+
+			double get_compression_tolerance()
+			{
+				return compression_tolerance;
+			}
+
+			/* Number of strain steps held in memory for this history */
+			uint32_t get_num_stored_steps()
+			{
+				return in_steps.size() + (segment_open ? 1 : 0);
+			}
 
-				in_XX.push_back(strain_xx);
-				in_YY.push_back(strain_yy);
-				in_ZZ.push_back(strain_zz);
-				in_XY.push_back(strain_xy);
-				in_XZ.push_back(strain_xz);
-				in_YZ.push_back(strain_yz);
+			void add_current_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz)
+			{
+				double strain[6] = {strain_xx, strain_yy, strain_zz, strain_xy, strain_xz, strain_yz};
+				append_step(num_steps_added, strain);
 				num_steps_added++;
 			}
 
 			void add_current_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz,
 						double stress_xx, double stress_yy, double stress_zz, double stress_xy, double stress_xz, double stress_yz)
 			{
-				up_to_date = false;
-
-				in_XX.push_back(strain_xx);
-				in_YY.push_back(strain_yy);
-				in_ZZ.push_back(strain_zz);
-				in_XY.push_back(strain_xy);
-				in_XZ.push_back(strain_xz);
-				in_YZ.push_back(strain_yz);
-				num_steps_added++;
+				add_current_strain(strain_xx, strain_yy, strain_zz, strain_xy, strain_xz, strain_yz);
 
 				// Also keep track of most recent stress
 				this->stress[0] = stress_xx;
@@ -82,8 +141,6 @@ namespace MatHistPredict {
 			/* Read in strain values from file in_fname */
 			void from_file(const char *in_fname)
 			{
-				up_to_date = false;
-
 				std::ifstream infile(in_fname);
 				if(infile.fail()) {
 					fprintf(stderr, "Could not open %s for reading.\n", in_fname);
@@ -92,14 +149,7 @@ namespace MatHistPredict {
 				double xx, yy, zz, xy, xz, yz;
 				while (infile >> xx >> yy >> zz >> xy >> xz >> yz)
 				{
-					in_XX.push_back(xx);
-					in_YY.push_back(yy);
-					in_ZZ.push_back(zz);
-					in_XY.push_back(xy);
-					in_XZ.push_back(xz);
-					in_YZ.push_back(yz);
-
-					num_steps_added++;
+					add_current_strain(xx, yy, zz, xy, xz, yz);
 				}
 				infile.close();
 			}
@@ -107,6 +157,8 @@ namespace MatHistPredict {
 			/* Build a spline out of the strain steps that have been read-in so far (must be at least 3 steps).
 			 * Each component is represented by num_spline_points_per_component equally spaced points along the
 			 * spline. The total number of points in the final strain vector is therefore num_spline_points_per_component * 6.
+			 * The spline interpolates the stored steps only (linearly between the knots of a compressed history),
+			 * and is not rebuilt if no step has been added since the last call.
 			 */
 			void splinify(uint32_t num_spline_points_per_component)
 			{
@@ -118,23 +170,40 @@ namespace MatHistPredict {
 					exit(1);
 				}
 
+				if(up_to_date && this->num_spline_points_per_component == num_spline_points_per_component) return;
 				this->num_spline_points_per_component = num_spline_points_per_component;
 
 				tk::spline splXX, splYY, splZZ, splXY, splXZ, splYZ;
 
+				// Stored steps, and end of the open segment of the compressed history
+				std::vector<double> *in[6] = {&in_XX, &in_YY, &in_ZZ, &in_XY, &in_XZ, &in_YZ};
+				T.assign(in_steps.begin(), in_steps.end());
+				for(uint32_t c = 0; c < 6; c++) knots[c].assign(in[c]->begin(), in[c]->end());
+				if(segment_open) {
+					T.push_back(segment_end_step);
+					for(uint32_t c = 0; c < 6; c++) knots[c].push_back(segment_end_value(c));
+				}
+
+				// A compressed history may be down to 2 knots, which are completed by their middle point
+				if(T.size() == 2) {
+					T.insert(T.begin() + 1, 0.5*(T[0] + T[1]));
+					for(uint32_t c = 0; c < 6; c++) knots[c].insert(knots[c].begin() + 1, 0.5*(knots[c][0] + knots[c][1]));
+				}
+
 				// Set splines
-				std::vector<double> T;
-				for(uint32_t n = 0; n < num_steps_added; n++) {
-					double t = (double)n/(double)(num_steps_added - 1);
-					T.push_back(t);
+				for(uint32_t n = 0; n < T.size(); n++) {
+					T[n] /= (double)(num_steps_added - 1);
 				}
 
-				splXX.set_points(T,in_XX);
-				splYY.set_points(T,in_YY);
-				splZZ.set_points(T,in_ZZ);
-				splXY.set_points(T,in_XY);
-				splXZ.set_points(T,in_XZ);
-				splYZ.set_points(T,in_YZ);
+				// A compressed history is resampled along its polyline, which is within tolerance of the steps,
+				// whereas a cubic spline through its sparse knots would overshoot at every change of slope
+				bool cubic = (compression_tolerance < 0);
+				splXX.set_points(T,knots[0],cubic);
+				splYY.set_points(T,knots[1],cubic);
+				splZZ.set_points(T,knots[2],cubic);
+				splXY.set_points(T,knots[3],cubic);
+				splXZ.set_points(T,knots[4],cubic);
+				splYZ.set_points(T,knots[5],cubic);
 
 				spline.clear(); // reset the existing spline result to zero
 				spline.reserve(num_spline_points_per_component * 6); // mult by 6 because there are 6 components
@@ -224,7 +293,9 @@ namespace MatHistPredict {
 				hp.diff = candidate_diff;
 				hp.ID = candidate_ID;
 
-				all_similar_histories.push_back(hp);
+				if(record_all_similar_histories) {
+					all_similar_histories.push_back(hp);
+				}
 				if(candidate_diff < threshold) {
 					/*HISTORY_ID_DIFF_PAIR hp;
 					hp.diff = candidate_diff;
@@ -247,6 +318,29 @@ namespace MatHistPredict {
 				}
 			}
 
+			/* Whether the difference with every compared history is kept (all_similar_histories_to_file()).
+			 * If not, the comparisons with histories that can neither be within threshold nor the most
+			 * similar one can be abandoned early. */
+			void set_record_all_similar_histories(bool record)
+			{
+				record_all_similar_histories = record;
+			}
+
+			/* Squared difference beyond which the comparison with a candidate history can be abandoned */
+			double abandon_bound(double threshold)
+			{
+				if(record_all_similar_histories) {
+					return std::numeric_limits<double>::infinity();
+				}
+				double bound = std::max(threshold, most_similar_history.diff);
+				return bound*bound;
+			}
+
+			std::vector<HISTORY_ID_DIFF_PAIR> * get_most_similar_histories()
+			{
+				return &most_similar_histories;
+			}
+
 			void print_most_similar_histories()
 			{
 				for(uint32_t i = 0; i < most_similar_histories.size(); i++) {
@@ -292,52 +386,132 @@ namespace MatHistPredict {
 				return false;
 			}
 
-			/* Read mapping.csv file output from the coarsegrain_dependency_network.py script */
-			void read_coarsegrain_dependency_mapping(const char *in_fname)
+			void set_ID_to_get_results_from(uint32_t ID)
 			{
-				std::ifstream infile(in_fname);
-				if(infile.fail()) {
-					fprintf(stderr, "Could not open %s for reading.\n", in_fname);
-					exit(1);
-				}
-				uint32_t id_from, id_to;
+				this->ID_to_get_results_from = ID;
+			}
 
-				// Skip lines until line that contains this ID
-				// Line number doesn't not always fit cell ID because
-				// if cell has no similar history it is not captured by the python script
-				std::string line;
-				for(uint32_t i = 0; i < ID; i++) {
-					std::getline(infile, line);
-				}
-				infile >> id_from >> id_to;
+			uint32_t get_ID_to_update_from()
+			{
+				return ID_to_get_results_from;
+			}
 
-				//std::cout << "cell " << ID << "id_from " << id_from << "id_to" << id_to << std::endl;
+		private:
+			/* Stream a strain step into the stored history. Without compression, every step is stored.
+			 * Otherwise (swing filter), the open segment starting at the last knot is extended as long as
+			 * a line from the knot passes within tolerance of all its steps, i.e. the cones of admissible
+			 * slopes of all the components remain non-empty. When a step does not fit, the segment is closed
+			 * by a knot at its last step, on the middle line of the cones, and a new segment is opened.
+			 */
+			void append_step(double step, const double strain[6])
+			{
+				up_to_date = false;
 
-				if(id_from != ID) {
-					fprintf(stderr, "ID in mapping file (%u) does not match cell ID (%u)\n", id_from, ID);
-					exit(1);
+				if(compression_tolerance < 0 || in_steps.empty()) {
+					commit_knot(step, strain);
+					return;
 				}
 
-				this->ID_to_get_results_from = id_to;
+				// A new segment always fits the step, unless closing the previous one triggered a recompression
+				for(;;) {
+					std::vector<double> *in[6] = {&in_XX, &in_YY, &in_ZZ, &in_XY, &in_XZ, &in_YZ};
+					double dt = step - in_steps.back();
+					double lo[6], hi[6];
+					bool fits = true;
+					for(uint32_t c = 0; c < 6; c++) {
+						lo[c] = (strain[c] - compression_tolerance - in[c]->back())/dt;
+						hi[c] = (strain[c] + compression_tolerance - in[c]->back())/dt;
+						if(segment_open) {
+							lo[c] = std::max(lo[c], slope_lo[c]);
+							hi[c] = std::min(hi[c], slope_hi[c]);
+						}
+						if(lo[c] > hi[c]) fits = false;
+					}
+
+					if(fits) {
+						for(uint32_t c = 0; c < 6; c++) {
+							slope_lo[c] = lo[c];
+							slope_hi[c] = hi[c];
+						}
+						segment_end_step = step;
+						segment_open = true;
+						return;
+					}
 
-				infile.close();
+					double end[6];
+					for(uint32_t c = 0; c < 6; c++) end[c] = segment_end_value(c);
+					segment_open = false;
+					commit_knot(segment_end_step, end);
+				}
 			}
 
-			void set_ID_to_get_results_from(uint32_t ID)
+			/* Value of a component at the end of the open segment, on the middle line of its cone */
+			double segment_end_value(uint32_t c)
 			{
-				this->ID_to_get_results_from = ID;
+				std::vector<double> *in[6] = {&in_XX, &in_YY, &in_ZZ, &in_XY, &in_XZ, &in_YZ};
+				return in[c]->back() + 0.5*(slope_lo[c] + slope_hi[c])*(segment_end_step - in_steps.back());
 			}
 
-			uint32_t get_ID_to_update_from()
+			void commit_knot(double step, const double strain[6])
 			{
-				return ID_to_get_results_from;
+				in_steps.push_back(step);
+				in_XX.push_back(strain[0]);
+				in_YY.push_back(strain[1]);
+				in_ZZ.push_back(strain[2]);
+				in_XY.push_back(strain[3]);
+				in_XZ.push_back(strain[4]);
+				in_YZ.push_back(strain[5]);
+
+				if(!replaying && compression_max_knots > 0 && in_steps.size() > compression_max_knots) {
+					recompress();
+				}
+			}
+
+			/* Double the tolerance and simplify the stored knots (and the end of the open segment) again,
+			 * until they fit in compression_max_knots. Amortised over the steps, as the number of knots is
+			 * at least halved each time. */
+			void recompress()
+			{
+				replaying = true;
+				while(in_steps.size() > compression_max_knots) {
+					std::vector<double> steps(in_steps);
+					std::vector<double> values[6] = {in_XX, in_YY, in_ZZ, in_XY, in_XZ, in_YZ};
+					if(segment_open) {
+						steps.push_back(segment_end_step);
+						for(uint32_t c = 0; c < 6; c++) values[c].push_back(segment_end_value(c));
+					}
+
+					in_steps.clear();
+					in_XX.clear(); in_YY.clear(); in_ZZ.clear(); in_XY.clear(); in_XZ.clear(); in_YZ.clear();
+					segment_open = false;
+					compression_tolerance *= 2.;
+
+					for(uint32_t n = 0; n < steps.size(); n++) {
+						double strain[6];
+						for(uint32_t c = 0; c < 6; c++) strain[c] = values[c][n];
+						append_step(steps[n], strain);
+					}
+				}
+				replaying = false;
 			}
 
-		private:
 			bool up_to_date;
 
 			uint32_t num_steps_added;
-			std::vector<double> in_XX, in_YY, in_ZZ, in_XY, in_XZ, in_YZ; // input strain at each timestep (used to build spline)
+			std::vector<double> in_XX, in_YY, in_ZZ, in_XY, in_XZ, in_YZ; // input strain at each stored timestep (used to build spline)
+			std::vector<double> in_steps; // index of each stored timestep
+
+			// Piecewise-linear compression of the stored history (swing filter), and its open segment
+			double compression_tolerance;
+			uint32_t compression_max_knots;
+			bool segment_open;
+			double segment_end_step;
+			double slope_lo[6], slope_hi[6];
+			bool replaying;
+
+			// Work buffers of splinify(), kept to avoid reallocations
+			std::vector<double> T;
+			std::vector<double> knots[6];
 
 			// Stress at most recent step
 			double stress[6];
@@ -355,46 +529,324 @@ namespace MatHistPredict {
 			// List of all (other) histories within threshold difference of this history			
 			std::vector<HISTORY_ID_DIFF_PAIR> most_similar_histories;
 			std::vector<HISTORY_ID_DIFF_PAIR> all_similar_histories;
+			bool record_all_similar_histories;
 
 			uint32_t ID_to_get_results_from;
 	};
 
-	class Strain6DReceiver
+	// Size of the blocks of right-hand sides solved together by splinify_all()
+	const uint32_t SPLINE_BATCH_BYTES = 1024*1024;
+
+	/* Equivalent to calling splinify() on every history, but the cubic splines of all the histories
+	 * with the same number of (uncompressed) steps, thus the same abscissae t = n/(N-1), are built
+	 * together: the tridiagonal system of the natural spline is factored once (Thomas algorithm), then
+	 * solved for the 6 components of all these histories at once, stored as rows of right-hand sides
+	 * (step-major, one column per history and component) so that each step of the elimination and of
+	 * the resampling is a contiguous, vectorisable sweep. Compressed histories are built one by one.
+	 */
+	void splinify_all(std::vector<Strain6D*>& histories, uint32_t num_spline_points_per_component)
+	{
+		std::map< uint32_t, std::vector<Strain6D*> > groups;
+		for(uint32_t h = 0; h < histories.size(); h++) {
+			Strain6D *s6D = histories[h];
+			if(s6D->num_steps_added < 3 || s6D->compression_tolerance >= 0
+					|| (s6D->up_to_date && s6D->num_spline_points_per_component == num_spline_points_per_component)) {
+				s6D->splinify(num_spline_points_per_component);
+			} else {
+				groups[s6D->num_steps_added].push_back(s6D);
+			}
+		}
+
+		uint32_t P = num_spline_points_per_component;
+		for(std::map< uint32_t, std::vector<Strain6D*> >::iterator it = groups.begin(); it != groups.end(); ++it) {
+			uint32_t N = it->first;
+			std::vector<Strain6D*>& group = it->second;
+
+			std::vector<double> x(N);
+			for(uint32_t n = 0; n < N; n++) x[n] = (double)n/(double)(N - 1);
+
+			// Factorisation of the interior rows of the system of the b coefficients (b[0] = b[N-1] = 0 for
+			// a natural spline): lower[i] b[i-1] + diag[i] b[i] + upper[i] b[i+1] = rhs[i]
+			std::vector<double> lower(N, 0.), upper(N, 0.), inv_pivot(N, 0.), factor(N, 0.);
+			for(uint32_t i = 1; i < N - 1; i++) {
+				lower[i] = 1.0/3.0*(x[i] - x[i - 1]);
+				upper[i] = 1.0/3.0*(x[i + 1] - x[i]);
+				double pivot = 2.0/3.0*(x[i + 1] - x[i - 1]);
+				if(i > 1) {
+					factor[i] = lower[i]*inv_pivot[i - 1];
+					pivot -= factor[i]*upper[i - 1];
+				}
+				inv_pivot[i] = 1./pivot;
+			}
+
+			// Interval and offset of each resampled point, as found by tk::spline
+			std::vector<uint32_t> interval(P);
+			std::vector<double> offset(P);
+			for(uint32_t p = 0; p < P; p++) {
+				double t = (double)p/(double)(P - 1);
+				int idx = std::max(int(std::lower_bound(x.begin(), x.end(), t) - x.begin()) - 1, 0);
+				interval[p] = std::min((uint32_t)idx, N - 2);
+				offset[p] = t - x[interval[p]];
+			}
+
+			// Blocks of histories whose right-hand sides fit in SPLINE_BATCH_BYTES
+			uint32_t histories_per_block = std::max((uint32_t)1, (uint32_t)(SPLINE_BATCH_BYTES/(3*6*N*sizeof(double))));
+			for(uint32_t h0 = 0; h0 < group.size(); h0 += histories_per_block) {
+				uint32_t h1 = std::min(h0 + histories_per_block, (uint32_t)group.size());
+				uint32_t K = 6*(h1 - h0);
+
+				std::vector<double> Y((uint64_t)N*K), B((uint64_t)N*K, 0.), S((uint64_t)P*K);
+				for(uint32_t h = h0; h < h1; h++) {
+					std::vector<double> *in[6] = {&group[h]->in_XX, &group[h]->in_YY, &group[h]->in_ZZ,
+									&group[h]->in_XY, &group[h]->in_XZ, &group[h]->in_YZ};
+					for(uint32_t c = 0; c < 6; c++) {
+						uint32_t k = 6*(h - h0) + c;
+						for(uint32_t n = 0; n < N; n++) Y[(uint64_t)n*K + k] = (*in[c])[n];
+					}
+				}
+
+				// Right-hand sides and forward elimination
+				for(uint32_t i = 1; i < N - 1; i++) {
+					const double *y0 = &Y[(uint64_t)(i - 1)*K], *y1 = &Y[(uint64_t)i*K], *y2 = &Y[(uint64_t)(i + 1)*K];
+					double *b = &B[(uint64_t)i*K];
+					const double *b_prev = &B[(uint64_t)(i - 1)*K];
+					double dx0 = x[i] - x[i - 1], dx1 = x[i + 1] - x[i], f = factor[i];
+					for(uint32_t k = 0; k < K; k++) {
+						b[k] = (y2[k] - y1[k])/dx1 - (y1[k] - y0[k])/dx0 - f*b_prev[k];
+					}
+				}
+
+				// Back substitution
+				for(uint32_t i = N - 2; i >= 1; i--) {
+					double *b = &B[(uint64_t)i*K];
+					const double *b_next = &B[(uint64_t)(i + 1)*K];
+					double u = (i < N - 2) ? upper[i] : 0., ip = inv_pivot[i];
+					for(uint32_t k = 0; k < K; k++) {
+						b[k] = (b[k] - u*b_next[k])*ip;
+					}
+				}
+
+				// Resampling, from the coefficients of the interval of each point
+				for(uint32_t p = 0; p < P; p++) {
+					uint32_t i = interval[p];
+					const double *y0 = &Y[(uint64_t)i*K], *y1 = &Y[(uint64_t)(i + 1)*K];
+					const double *b0 = &B[(uint64_t)i*K], *b1 = &B[(uint64_t)(i + 1)*K];
+					double *out = &S[(uint64_t)p*K];
+					double dx = x[i + 1] - x[i], h = offset[p];
+					for(uint32_t k = 0; k < K; k++) {
+						double a = 1.0/3.0*(b1[k] - b0[k])/dx;
+						double c = (y1[k] - y0[k])/dx - 1.0/3.0*(2.0*b0[k] + b1[k])*dx;
+						out[k] = ((a*h + b0[k])*h + c)*h + y0[k];
+					}
+				}
+
+				for(uint32_t h = h0; h < h1; h++) {
+					Strain6D *s6D = group[h];
+					s6D->num_spline_points_per_component = P;
+					s6D->spline.resize(6*P);
+					for(uint32_t p = 0; p < P; p++) {
+						for(uint32_t c = 0; c < 6; c++) s6D->spline[6*p + c] = S[(uint64_t)p*K + 6*(h - h0) + c];
+					}
+					s6D->up_to_date = true;
+				}
+			}
+		}
+	}
+
+	// Precision of the spline values of the histories exchanged between the ranks: exact, single precision,
+	// or 16-bit integers scaled by the largest absolute value of each history
+	enum ExchangePrecision {EXCHANGE_DOUBLE, EXCHANGE_FLOAT, EXCHANGE_INT16};
+
+	/* Splines and IDs of a set of Strain6D histories packed in contiguous buffers (structure of arrays),
+	 * so that all the histories of a rank can be exchanged with a few messages of known sizes.
+	 * With a reduced precision, the spline values are quantised (floats or shorts instead of splines),
+	 * and the scale of each history is stored with the L2 norm of its quantisation error (quantization).
+	 */
+	class Strain6DPack
 	{
 		public:
-			Strain6DReceiver(int32_t max_buf_size)
+			Strain6DPack(ExchangePrecision precision = EXCHANGE_DOUBLE)
+			{
+				this->precision = precision;
+			}
+
+			void pack(std::vector<Strain6D*>& histories)
 			{
-				this->max_buf_size = max_buf_size;
-				spline = new double[max_buf_size];
+				uint32_t num_histories = histories.size();
+				uint64_t num_doubles = 0;
+				for(uint32_t h = 0; h < num_histories; h++) {
+					num_doubles += histories[h]->get_spline()->size();
+				}
+
+				resize(num_histories, num_doubles);
+				uint64_t offset = 0;
+				for(uint32_t h = 0; h < num_histories; h++) {
+					std::vector<double> *spline = histories[h]->get_spline();
+					IDs[h] = histories[h]->get_ID();
+					lengths[h] = spline->size();
+					if(precision == EXCHANGE_DOUBLE) {
+						std::copy(spline->begin(), spline->end(), splines.begin() + offset);
+					} else {
+						quantize(h, spline->data(), spline->size(), offset);
+					}
+					offset += spline->size();
+				}
 			}
 
-			~Strain6DReceiver()
+			/* Allocate the buffers for receiving num_histories histories totalling num_doubles spline values */
+			void resize(uint32_t num_histories, uint64_t num_doubles)
 			{
-				delete[] spline;
-				this->max_buf_size = 0;
+				IDs.resize(num_histories);
+				lengths.resize(num_histories);
+				if(precision == EXCHANGE_DOUBLE) splines.resize(num_doubles);
+				else quantization.resize(2*num_histories);
+				if(precision == EXCHANGE_FLOAT) floats.resize(num_doubles);
+				if(precision == EXCHANGE_INT16) shorts.resize(num_doubles);
 			}
 
-			int32_t max_buf_size; // Max number of doubles that can be received from another rank
-			double *spline;
-			uint32_t ID;
-			uint32_t recv_count;
+			uint32_t size()
+			{
+				return IDs.size();
+			}
+
+			/* Number of spline values of all the histories */
+			uint64_t num_values()
+			{
+				if(precision == EXCHANGE_FLOAT) return floats.size();
+				if(precision == EXCHANGE_INT16) return shorts.size();
+				return splines.size();
+			}
+
+			/* Buffer and MPI datatype of the spline values */
+			void *values()
+			{
+				if(precision == EXCHANGE_FLOAT) return floats.data();
+				if(precision == EXCHANGE_INT16) return shorts.data();
+				return splines.data();
+			}
+
+			MPI_Datatype values_type()
+			{
+				if(precision == EXCHANGE_FLOAT) return MPI_FLOAT;
+				if(precision == EXCHANGE_INT16) return MPI_SHORT;
+				return MPI_DOUBLE;
+			}
+
+			uint32_t value_bytes()
+			{
+				if(precision == EXCHANGE_FLOAT) return sizeof(float);
+				if(precision == EXCHANGE_INT16) return sizeof(int16_t);
+				return sizeof(double);
+			}
+
+			ExchangePrecision precision;
+			std::vector<uint32_t> IDs;
+			std::vector<uint32_t> lengths;
+			std::vector<double> splines;
+			std::vector<float> floats;
+			std::vector<int16_t> shorts;
+			std::vector<double> quantization;
+
+		private:
+			/* Quantise the spline of the h-th history, storing its scale and the norm of its error */
+			void quantize(uint32_t h, const double *spline, uint32_t length, uint64_t offset)
+			{
+				double scale = 1.;
+				if(precision == EXCHANGE_INT16) {
+					double largest = 0.;
+					for(uint32_t i = 0; i < length; i++) largest = std::max(largest, fabs(spline[i]));
+					if(largest > 0.) scale = largest/32767.;
+				}
+
+				double error2 = 0.;
+				for(uint32_t i = 0; i < length; i++) {
+					double quantized;
+					if(precision == EXCHANGE_FLOAT) {
+						floats[offset + i] = (float)spline[i];
+						quantized = floats[offset + i];
+					} else {
+						shorts[offset + i] = (int16_t)lrint(spline[i]/scale);
+						quantized = shorts[offset + i]*scale;
+					}
+					error2 += (spline[i] - quantized)*(spline[i] - quantized);
+				}
+				quantization[2*h] = scale;
+				quantization[2*h + 1] = sqrt(error2);
+			}
 	};
 
-	double compare_L2_norm(double *a, double *b, uint32_t num_points_a, uint32_t num_points_b)
-	{
-		if(num_points_a != num_points_b) {
-			fprintf(stderr, "Error in compare_L2_norm(): given strain6D objects have different numbers of spline points (%u and %u)\n", num_points_a, num_points_b);
-			exit(1);
-		}
+	// Number of values summed between two checks of the abandon bound in squared_L2_distance()
+	const uint32_t L2_ABANDON_STRIDE = 32;
+	// Size of the blocks of histories compared together, so that both blocks of splines remain in cache
+	const uint32_t L2_TILE_BYTES = 128*1024;
 
-		uint32_t N = num_points_a;
+	/* Squared L2 difference between a and b (n values each). The summation is abandoned as soon as the
+	 * partial sum exceeds bound, checked every L2_ABANDON_STRIDE values: the returned value is then only
+	 * known to be larger than bound. Vectorised with AVX-512 or AVX2 when compiled for them.
+	 */
+	inline double squared_L2_distance(const double *a, const double *b, uint32_t n, double bound)
+	{
 		double sum = 0;
-		for(uint32_t i = 0; i < N; i++) {
+		uint32_t i = 0;
+#if defined(__AVX512F__)
+		for(; i + L2_ABANDON_STRIDE <= n; i += L2_ABANDON_STRIDE) {
+			__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+			for(uint32_t j = i; j < i + L2_ABANDON_STRIDE; j += 16) {
+				__m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + j), _mm512_loadu_pd(b + j));
+				__m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + j + 8), _mm512_loadu_pd(b + j + 8));
+				acc0 = _mm512_fmadd_pd(d0, d0, acc0);
+				acc1 = _mm512_fmadd_pd(d1, d1, acc1);
+			}
+			double lane[8];
+			_mm512_storeu_pd(lane, _mm512_add_pd(acc0, acc1));
+			sum += ((lane[0] + lane[4]) + (lane[2] + lane[6])) + ((lane[1] + lane[5]) + (lane[3] + lane[7]));
+			if(sum > bound) return sum;
+		}
+#elif defined(__AVX2__)
+		for(; i + L2_ABANDON_STRIDE <= n; i += L2_ABANDON_STRIDE) {
+			__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+			for(uint32_t j = i; j < i + L2_ABANDON_STRIDE; j += 8) {
+				__m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j));
+				__m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + j + 4), _mm256_loadu_pd(b + j + 4));
+#if defined(__FMA__)
+				acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+				acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+#else
+				acc0 = _mm256_add_pd(_mm256_mul_pd(d0, d0), acc0);
+				acc1 = _mm256_add_pd(_mm256_mul_pd(d1, d1), acc1);
+#endif
+			}
+			__m256d acc = _mm256_add_pd(acc0, acc1);
+			__m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+			sum += _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+			if(sum > bound) return sum;
+		}
+#else
+		for(; i + L2_ABANDON_STRIDE <= n; i += L2_ABANDON_STRIDE) {
+			double block = 0;
+			for(uint32_t j = i; j < i + L2_ABANDON_STRIDE; j++) {
+				double diff = a[j] - b[j];
+				block += diff*diff;
+			}
+			sum += block;
+			if(sum > bound) return sum;
+		}
+#endif
+		for(; i < n; i++) {
 			double diff = a[i] - b[i];
 			sum += diff*diff;
 		}
+		return sum;
+	}
+
+	double compare_L2_norm(const double *a, const double *b, uint32_t num_points_a, uint32_t num_points_b)
+	{
+		if(num_points_a != num_points_b) {
+			fprintf(stderr, "Error in compare_L2_norm(): given strain6D objects have different numbers of spline points (%u and %u)\n", num_points_a, num_points_b);
+			exit(1);
+		}
 
-		return sqrt(sum);
+		return sqrt(squared_L2_distance(a, b, num_points_a, std::numeric_limits<double>::infinity()));
 	}
 
 	double compare_L2_norm(Strain6D *a, Strain6D *b)
@@ -406,54 +858,300 @@ namespace MatHistPredict {
 		return compare_L2_norm(hist_A, hist_B, num_points_A, num_points_B);
 	}
 
-	double compare_L2_norm(Strain6D *a, Strain6DReceiver *b)
+	// Handle negative numbers too
+	int32_t modulo_neg(int32_t x, int32_t n)
+	{
+		return ((x%n + n) % n);
+	}
+
+	/* Number of histories of num_points spline values per tile of compared histories */
+	uint32_t histories_per_tile(uint32_t num_points)
 	{
-		double *hist_A = a->get_spline()->data();
-		double *hist_B = b->spline;
-		uint32_t num_points_A = a->get_spline()->size();
-		uint32_t num_points_B = b->recv_count;
-		return compare_L2_norm(hist_A, hist_B, num_points_A, num_points_B);
+		return std::max((uint32_t)1, (uint32_t)(L2_TILE_BYTES/(sizeof(double)*std::max(num_points, (uint32_t)1))));
 	}
 
-	void send_strain6D_mpi(Strain6D *in_s6D, int32_t target_rank, int32_t this_rank, MPI_Comm comm)
+	/* Compare a history with a candidate, skipping the candidate if the comparison has been abandoned */
+	void compare_with_candidate(Strain6D *history, const double *candidate, uint32_t num_points, uint32_t candidate_ID, double threshold)
 	{
-		MPI_Request request;
+		std::vector<double> *spline = history->get_spline();
+		if(spline->size() != num_points) {
+			fprintf(stderr, "Error in compare_L2_norm(): given strain6D objects have different numbers of spline points (%lu and %u)\n", spline->size(), num_points);
+			exit(1);
+		}
 
-		std::vector<double> *strain = in_s6D->get_spline();
-		uint32_t ID = in_s6D->get_ID();
-		int32_t num_doubles_to_send = strain->size();
+		double bound = history->abandon_bound(threshold);
+		double diff2 = squared_L2_distance(spline->data(), candidate, num_points, bound);
+		if(diff2 > bound) return;
+		history->choose_most_similar_history(sqrt(diff2), candidate_ID, threshold);
+	}
 
-		MPI_Isend(&num_doubles_to_send, 1, MPI_UNSIGNED, target_rank, this_rank, comm, &request);
-		MPI_Isend(strain->data(), num_doubles_to_send, MPI_DOUBLE, target_rank, this_rank, comm, &request);
-		MPI_Isend(&ID, 1, MPI_UNSIGNED, target_rank, this_rank, comm, &request);
+	/* Compare all the histories on this rank with num_packed histories received from another rank, given
+	 * as packed IDs, spline lengths and contiguous spline values. Both sets are traversed by tiles. */
+	void compare_with_packed_histories(std::vector<Strain6D*>& histories, const uint32_t *IDs, const uint32_t *lengths,
+						const double *splines, uint32_t num_packed, double threshold)
+	{
+		uint32_t num_histories_on_this_rank = histories.size();
+		if(num_histories_on_this_rank == 0 || num_packed == 0) return;
+
+		std::vector<uint64_t> offsets(num_packed, 0);
+		for(uint32_t r = 1; r < num_packed; r++) offsets[r] = offsets[r - 1] + lengths[r - 1];
+
+		uint32_t tile = histories_per_tile(histories[0]->get_spline()->size());
+		for(uint32_t r0 = 0; r0 < num_packed; r0 += tile) {
+			uint32_t r1 = std::min(r0 + tile, num_packed);
+			for(uint32_t h0 = 0; h0 < num_histories_on_this_rank; h0 += tile) {
+				uint32_t h1 = std::min(h0 + tile, num_histories_on_this_rank);
+				for(uint32_t r = r0; r < r1; r++) {
+					for(uint32_t h = h0; h < h1; h++) {
+						compare_with_candidate(histories[h], splines + offsets[r], lengths[r], IDs[r], threshold);
+					}
+				}
+			}
+		}
 	}
 
-	void receive_strain6D_mpi(Strain6DReceiver *recv, int32_t from_rank, MPI_Comm comm)
+	void compare_with_packed_histories(std::vector<Strain6D*>& histories, Strain6DPack& packed, double threshold)
 	{
-		MPI_Status status;
-		MPI_Recv(&(recv->recv_count), 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
-		MPI_Recv(recv->spline, recv->max_buf_size, MPI_DOUBLE, from_rank, from_rank, comm, &status);
-		MPI_Recv(&(recv->ID), 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
+		compare_with_packed_histories(histories, packed.IDs.data(), packed.lengths.data(), packed.splines.data(),
+						packed.size(), threshold);
 	}
 
-	// Handle negative numbers too
-	int32_t modulo_neg(int32_t x, int32_t n)
+	// Relative margin on the threshold added to the quantisation error of a history
+	const double QUANTIZATION_MARGIN = 1e-9;
+
+	/* Compare all the histories on this rank with num_packed quantised histories received from another rank
+	 * (floats, or shorts with the scale of each history in quantization, followed by the norm of its error).
+	 * The difference with the exact history being within the error e of the difference d with the quantised
+	 * one, a pair is decided on d if d is farther than e from the threshold. Otherwise, the (local index,
+	 * packed index) of the pair is appended to borderline, to be compared exactly.
+	 */
+	void compare_with_quantized_histories(std::vector<Strain6D*>& histories, const uint32_t *IDs, const uint32_t *lengths,
+						const float *floats, const int16_t *shorts, const double *quantization, uint32_t num_packed,
+						double threshold, std::vector< std::pair<uint32_t, uint32_t> >& borderline)
 	{
-		return ((x%n + n) % n);
+		uint32_t num_histories_on_this_rank = histories.size();
+		if(num_histories_on_this_rank == 0 || num_packed == 0) return;
+
+		std::vector<uint64_t> offsets(num_packed + 1, 0);
+		for(uint32_t r = 0; r < num_packed; r++) offsets[r + 1] = offsets[r] + lengths[r];
+
+		uint32_t tile = histories_per_tile(histories[0]->get_spline()->size());
+		std::vector<double> dequantized;
+		for(uint32_t r0 = 0; r0 < num_packed; r0 += tile) {
+			uint32_t r1 = std::min(r0 + tile, num_packed);
+
+			// Spline values of the tile of received histories
+			dequantized.resize(offsets[r1] - offsets[r0]);
+			for(uint32_t r = r0; r < r1; r++) {
+				double *dst = &dequantized[offsets[r] - offsets[r0]];
+				for(uint32_t i = 0; i < lengths[r]; i++) {
+					dst[i] = (floats != NULL) ? floats[offsets[r] + i] : shorts[offsets[r] + i]*quantization[2*r];
+				}
+			}
+
+			for(uint32_t h0 = 0; h0 < num_histories_on_this_rank; h0 += tile) {
+				uint32_t h1 = std::min(h0 + tile, num_histories_on_this_rank);
+				for(uint32_t r = r0; r < r1; r++) {
+					double error = quantization[2*r + 1] + QUANTIZATION_MARGIN*threshold;
+					for(uint32_t h = h0; h < h1; h++) {
+						std::vector<double> *spline = histories[h]->get_spline();
+						if(spline->size() != lengths[r]) {
+							fprintf(stderr, "Error in compare_L2_norm(): given strain6D objects have different numbers of spline points (%lu and %u)\n", spline->size(), lengths[r]);
+							exit(1);
+						}
+
+						// Abandoned if the exact difference is beyond the bound of the history
+						double bound = sqrt(histories[h]->abandon_bound(threshold)) + error;
+						bound *= bound;
+						double diff2 = squared_L2_distance(spline->data(), &dequantized[offsets[r] - offsets[r0]], lengths[r], bound);
+						if(diff2 > bound) continue;
+
+						double diff = sqrt(diff2);
+						if(fabs(diff - threshold) <= error) borderline.push_back(std::make_pair(h, r));
+						else histories[h]->choose_most_similar_history(diff, IDs[r], threshold);
+					}
+				}
+			}
+		}
+	}
+
+	void compare_with_quantized_histories(std::vector<Strain6D*>& histories, Strain6DPack& packed, double threshold,
+						std::vector< std::pair<uint32_t, uint32_t> >& borderline)
+	{
+		compare_with_quantized_histories(histories, packed.IDs.data(), packed.lengths.data(),
+						(packed.precision == EXCHANGE_FLOAT) ? packed.floats.data() : NULL,
+						(packed.precision == EXCHANGE_INT16) ? packed.shorts.data() : NULL,
+						packed.quantization.data(), packed.size(), threshold, borderline);
+	}
+
+	/* Post the nonblocking transfers of one round of the ring: the histories of this rank are sent
+	 * to target_rank and those of from_rank are received in recv, sized from the exchanged counts */
+	void post_ring_round(Strain6DPack& local, Strain6DPack& recv, int32_t target_rank, int32_t from_rank,
+				std::vector<uint64_t>& counts, MPI_Comm comm, MPI_Request *requests)
+	{
+		recv.precision = local.precision;
+		recv.resize(counts[2*from_rank], counts[2*from_rank + 1]);
+
+		MPI_Irecv(recv.IDs.data(), recv.IDs.size(), MPI_UNSIGNED, from_rank, 0, comm, &requests[0]);
+		MPI_Irecv(recv.lengths.data(), recv.lengths.size(), MPI_UNSIGNED, from_rank, 1, comm, &requests[1]);
+		MPI_Irecv(recv.values(), recv.num_values(), recv.values_type(), from_rank, 2, comm, &requests[2]);
+		MPI_Irecv(recv.quantization.data(), recv.quantization.size(), MPI_DOUBLE, from_rank, 3, comm, &requests[3]);
+
+		MPI_Isend(local.IDs.data(), local.IDs.size(), MPI_UNSIGNED, target_rank, 0, comm, &requests[4]);
+		MPI_Isend(local.lengths.data(), local.lengths.size(), MPI_UNSIGNED, target_rank, 1, comm, &requests[5]);
+		MPI_Isend(local.values(), local.num_values(), local.values_type(), target_rank, 2, comm, &requests[6]);
+		MPI_Isend(local.quantization.data(), local.quantization.size(), MPI_DOUBLE, target_rank, 3, comm, &requests[7]);
+	}
+
+	/* Displacements of the blocks of an all-to-all exchange from their counts */
+	int32_t alltoall_displacements(std::vector<int>& counts, std::vector<int>& displs)
+	{
+		int64_t total = 0;
+		displs.resize(counts.size());
+		for(uint32_t r = 0; r < counts.size(); r++) {
+			displs[r] = total;
+			total += counts[r];
+		}
+		if(total > INT_MAX) {
+			fprintf(stderr, "Error: too many values (%ld) to exchange in a single MPI_Alltoallv.\n", (long)total);
+			exit(1);
+		}
+		return total;
+	}
+
+	/* Number of histories and of spline values packed by each rank, gathered on all the ranks */
+	void gather_packed_counts(Strain6DPack& local, std::vector<uint64_t>& counts, MPI_Comm comm)
+	{
+		int32_t num_ranks;
+		MPI_Comm_size(comm, &num_ranks);
+
+		counts.resize(2*num_ranks);
+		uint64_t local_counts[2] = {local.size(), local.num_values()};
+		MPI_Allgather(local_counts, 2, MPI_UINT64_T, counts.data(), 2, MPI_UINT64_T, comm);
 	}
 
-	void compare_histories_with_all_ranks(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm)
+	/* Gather the packed histories of all the ranks on every rank, in rank order, given their counts.
+	 * The histories and spline values of each rank start at history_displs and double_displs (and
+	 * their quantisation at twice history_displs, if quantised). */
+	void allgather_packed_histories(Strain6DPack& local, Strain6DPack& all, std::vector<uint64_t>& counts,
+					std::vector<int>& history_counts, std::vector<int>& history_displs,
+					std::vector<int>& double_displs, MPI_Comm comm)
 	{
-		MPI_Request request;
-		MPI_Status status;
+		int32_t num_ranks;
+		MPI_Comm_size(comm, &num_ranks);
+
+		std::vector<int> double_counts(num_ranks);
+		history_counts.resize(num_ranks);
+		for(int32_t r = 0; r < num_ranks; r++) {
+			history_counts[r] = counts[2*r];
+			double_counts[r] = counts[2*r + 1];
+		}
+		uint32_t total_histories = alltoall_displacements(history_counts, history_displs);
+		uint32_t total_doubles = alltoall_displacements(double_counts, double_displs);
+
+		all.precision = local.precision;
+		all.resize(total_histories, total_doubles);
+		MPI_Allgatherv(local.IDs.data(), local.size(), MPI_UNSIGNED, all.IDs.data(),
+				history_counts.data(), history_displs.data(), MPI_UNSIGNED, comm);
+		MPI_Allgatherv(local.lengths.data(), local.size(), MPI_UNSIGNED, all.lengths.data(),
+				history_counts.data(), history_displs.data(), MPI_UNSIGNED, comm);
+		MPI_Allgatherv(local.values(), local.num_values(), local.values_type(), all.values(),
+				double_counts.data(), double_displs.data(), local.values_type(), comm);
+
+		if(local.precision != EXCHANGE_DOUBLE) {
+			std::vector<int> quantization_counts(num_ranks), quantization_displs(num_ranks);
+			for(int32_t r = 0; r < num_ranks; r++) quantization_counts[r] = 2*history_counts[r];
+			alltoall_displacements(quantization_counts, quantization_displs);
+			MPI_Allgatherv(local.quantization.data(), local.quantization.size(), MPI_DOUBLE, all.quantization.data(),
+					quantization_counts.data(), quantization_displs.data(), MPI_DOUBLE, comm);
+		}
+	}
+
+	/* Exact comparison of the borderline pairs (local index, index in the histories of the rank) left by
+	 * compare_with_quantized_histories() for the histories of each rank: the exact splines of the candidates
+	 * are requested from their ranks, once per candidate. Collective over comm.
+	 */
+	void compare_borderline_histories(std::vector<Strain6D*>& histories,
+						std::vector< std::vector< std::pair<uint32_t, uint32_t> > >& borderline,
+						double threshold, MPI_Comm comm)
+	{
+		int32_t num_ranks;
+		MPI_Comm_size(comm, &num_ranks);
 
+		// Candidates requested from each rank, by increasing index
+		std::vector< std::vector<uint32_t> > requested(num_ranks);
+		std::vector<int> scounts(num_ranks), sdispls, rcounts(num_ranks), rdispls;
+		for(int32_t r = 0; r < num_ranks; r++) {
+			for(uint32_t p = 0; p < borderline[r].size(); p++) requested[r].push_back(borderline[r][p].second);
+			std::sort(requested[r].begin(), requested[r].end());
+			requested[r].erase(std::unique(requested[r].begin(), requested[r].end()), requested[r].end());
+			scounts[r] = requested[r].size();
+		}
+		MPI_Alltoall(scounts.data(), 1, MPI_INT, rcounts.data(), 1, MPI_INT, comm);
+
+		std::vector<uint32_t> requests_out(alltoall_displacements(scounts, sdispls)), requests_in(alltoall_displacements(rcounts, rdispls));
+		for(int32_t r = 0; r < num_ranks; r++) {
+			std::copy(requested[r].begin(), requested[r].end(), requests_out.begin() + sdispls[r]);
+		}
+		MPI_Alltoallv(requests_out.data(), scounts.data(), sdispls.data(), MPI_UNSIGNED,
+				requests_in.data(), rcounts.data(), rdispls.data(), MPI_UNSIGNED, comm);
+
+		// IDs and lengths of the requested histories of this rank, then their splines
+		std::vector<uint32_t> headers_out(2*requests_in.size()), headers_in(2*requests_out.size());
+		std::vector<double> splines_out;
+		std::vector<int> header_scounts(num_ranks), header_sdispls, header_rcounts(num_ranks), header_rdispls;
+		std::vector<int> spline_scounts(num_ranks, 0), spline_sdispls, spline_rcounts(num_ranks, 0), spline_rdispls;
+		for(int32_t r = 0; r < num_ranks; r++) {
+			for(int32_t i = rdispls[r]; i < rdispls[r] + rcounts[r]; i++) {
+				std::vector<double> *spline = histories[requests_in[i]]->get_spline();
+				headers_out[2*i] = histories[requests_in[i]]->get_ID();
+				headers_out[2*i + 1] = spline->size();
+				splines_out.insert(splines_out.end(), spline->begin(), spline->end());
+				spline_scounts[r] += spline->size();
+			}
+			header_scounts[r] = 2*rcounts[r];
+			header_rcounts[r] = 2*scounts[r];
+		}
+		alltoall_displacements(header_scounts, header_sdispls);
+		alltoall_displacements(header_rcounts, header_rdispls);
+		MPI_Alltoallv(headers_out.data(), header_scounts.data(), header_sdispls.data(), MPI_UNSIGNED,
+				headers_in.data(), header_rcounts.data(), header_rdispls.data(), MPI_UNSIGNED, comm);
+
+		for(int32_t r = 0; r < num_ranks; r++) {
+			for(int32_t i = sdispls[r]; i < sdispls[r] + scounts[r]; i++) spline_rcounts[r] += headers_in[2*i + 1];
+		}
+		alltoall_displacements(spline_scounts, spline_sdispls);
+		std::vector<double> splines_in(alltoall_displacements(spline_rcounts, spline_rdispls));
+		MPI_Alltoallv(splines_out.data(), spline_scounts.data(), spline_sdispls.data(), MPI_DOUBLE,
+				splines_in.data(), spline_rcounts.data(), spline_rdispls.data(), MPI_DOUBLE, comm);
+
+		for(int32_t r = 0; r < num_ranks; r++) {
+			std::vector<uint64_t> offsets(scounts[r], spline_rdispls[r]);
+			for(int32_t i = 1; i < scounts[r]; i++) offsets[i] = offsets[i - 1] + headers_in[2*(sdispls[r] + i - 1) + 1];
+
+			for(uint32_t p = 0; p < borderline[r].size(); p++) {
+				uint32_t c = std::lower_bound(requested[r].begin(), requested[r].end(), borderline[r][p].second) - requested[r].begin();
+				uint32_t i = sdispls[r] + c;
+				compare_with_candidate(histories[borderline[r][p].first], &splines_in[offsets[c]], headers_in[2*i + 1],
+							headers_in[2*i], threshold);
+			}
+		}
+	}
+
+	/* Find, for every history on every rank, the most similar histories among those of all the ranks.
+	 * The histories of each rank are packed in contiguous buffers. If all the histories fit in
+	 * max_gather_bytes, they are gathered at once on every rank, otherwise they are cycled around the
+	 * ranks, the transfer of the next round overlapping the comparisons of the current one.
+	 * With a reduced precision, the histories are exchanged quantised: the histories within threshold
+	 * are still those of the exact comparison (the borderline pairs being compared exactly at the end),
+	 * but the differences of the other pairs are only within the quantisation error.
+	 */
+	void compare_histories_with_all_ranks(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm,
+						uint64_t max_gather_bytes = 256*1024*1024, ExchangePrecision precision = EXCHANGE_DOUBLE)
+	{
 		int32_t this_rank, num_ranks;
 		MPI_Comm_rank(comm, &this_rank);
 		MPI_Comm_size(comm, &num_ranks);
-		
-		// For receiving the strain history and ID from another rank
-		const int32_t max_buf_size = 2000;
-		Strain6DReceiver recv(max_buf_size);
 
 		// num strain6D histories on this rank
 		uint32_t num_histories_on_this_rank = histories.size();
@@ -464,53 +1162,1263 @@ namespace MatHistPredict {
 			histories[h]->clear_most_similar_history();
 		}
 
-		// Cycle through all ranks in the communicator in a ring-like fashion, sending
-		// to this_rank+i (periodic) and receiving from this_rank-i (periodic). This
-		// ensures that every rank gets the data from every other rank (for comparison)
-		// wihout ever needing to hold all cells in memory at once.
-		for(int32_t i = 0; i < num_ranks; i++) {
-			int32_t target_rank = modulo_neg(this_rank + i, num_ranks); // send data to target_rank
-			int32_t from_rank = modulo_neg(this_rank - i, num_ranks); // receive data sent by from_rank
-			
-			// If we are not considering cells on the same rank
-//			std::cout << "Rank " << this_rank << ": Targetting " << target_rank << " Expecting " << from_rank << "\n";
-			if(target_rank != this_rank) {
-				// Indicate the number of histories that will be sent to target_rank
-				MPI_Isend(&num_histories_on_this_rank, 1, MPI_UNSIGNED, target_rank, this_rank, comm, &request);
+		// Considering cells on the same rank, by tiles of histories. A comparison is only abandoned
+		// if it can matter to neither of both histories
+		uint32_t tile = (num_histories_on_this_rank > 0) ? histories_per_tile(histories[0]->get_spline()->size()) : 1;
+		for(uint32_t a0 = 0; a0 < num_histories_on_this_rank; a0 += tile) {
+			uint32_t a1 = std::min(a0 + tile, num_histories_on_this_rank);
+			for(uint32_t b0 = a0; b0 < num_histories_on_this_rank; b0 += tile) {
+				uint32_t b1 = std::min(b0 + tile, num_histories_on_this_rank);
+				for(uint32_t a = a0; a < a1; a++) {
+					for(uint32_t b = std::max(b0, a + 1); b < b1; b++) {
+						std::vector<double> *spline_a = histories[a]->get_spline();
+						std::vector<double> *spline_b = histories[b]->get_spline();
+						if(spline_a->size() != spline_b->size()) {
+							fprintf(stderr, "Error in compare_L2_norm(): given strain6D objects have different numbers of spline points (%lu and %lu)\n", spline_a->size(), spline_b->size());
+							exit(1);
+						}
 
-				// Send all histories and IDs
-				for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
-					send_strain6D_mpi(histories[h], target_rank, this_rank, comm);
-				}
+						double bound = std::max(histories[a]->abandon_bound(threshold), histories[b]->abandon_bound(threshold));
+						double diff2 = squared_L2_distance(spline_a->data(), spline_b->data(), spline_a->size(), bound);
+						if(diff2 > bound) continue;
 
-				// Get number of histories to receive from from_rank
-				uint32_t num_histories_to_receive = 0;
-				MPI_Recv(&num_histories_to_receive, 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
+						double diff = sqrt(diff2);
+						histories[a]->choose_most_similar_history(diff, histories[b]->get_ID(), threshold); // both Strain6D's need this info
+						histories[b]->choose_most_similar_history(diff, histories[a]->get_ID(), threshold); // both Strain6D's need this info
+					}
+				}
+			}
+		}
 
-				// Receive histories from rank from_rank, and compare with all histories on this rank
-				for(uint32_t r = 0; r < num_histories_to_receive; r++) {
+		if(num_ranks == 1) return;
 
-					receive_strain6D_mpi(&recv, from_rank, comm);
+		Strain6DPack local(precision);
+		local.pack(histories);
 
-					for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
-						double diff = compare_L2_norm(histories[h], &recv);
-						histories[h]->choose_most_similar_history(diff, recv.ID, threshold);
-//						std::cout << "Comparison between rank " << this_rank << ", cell " << histories[h]->get_ID() << " and rank " <<  from_rank << ", cell " << recv.ID << ": " << diff << "\n";
-					}
-				}
+		// Number of histories and of spline values held by each rank
+		std::vector<uint64_t> counts;
+		gather_packed_counts(local, counts, comm);
 
-			} else { // Considering cells on the same rank
-				for(uint32_t a = 0; a < num_histories_on_this_rank; a++) {
-					for(uint32_t b = a + 1; b < num_histories_on_this_rank; b++) {
-						double diff = compare_L2_norm(histories[a], histories[b]);
-						histories[a]->choose_most_similar_history(diff, histories[b]->get_ID(), threshold); // both Strain6D's need this info
-						histories[b]->choose_most_similar_history(diff, histories[a]->get_ID(), threshold); // both Strain6D's need this info
-						//std::cout << "Same rank comparison (" << this_rank << ") cell " << histories[a]->get_ID() << " vs cell " << histories[b]->get_ID() << ": " << diff << "\n";
-					}
+		uint64_t total_histories = 0, total_doubles = 0;
+		for(int32_t r = 0; r < num_ranks; r++) {
+			total_histories += counts[2*r];
+			total_doubles += counts[2*r + 1];
+		}
+		uint64_t total_bytes = total_doubles*local.value_bytes() + 2*total_histories*sizeof(uint32_t);
+		if(precision != EXCHANGE_DOUBLE) total_bytes += 2*total_histories*sizeof(double);
+
+		// Pairs of quantised histories to compare exactly, by rank of the candidate
+		std::vector< std::vector< std::pair<uint32_t, uint32_t> > > borderline(num_ranks);
+
+		if(total_bytes <= max_gather_bytes && total_doubles <= INT_MAX) {
+			Strain6DPack all;
+			std::vector<int> history_counts, history_displs, double_displs;
+			allgather_packed_histories(local, all, counts, history_counts, history_displs, double_displs, comm);
+
+			// Same order of comparisons as the ring below
+			for(int32_t i = 1; i < num_ranks; i++) {
+				int32_t from_rank = modulo_neg(this_rank - i, num_ranks);
+				if(precision == EXCHANGE_DOUBLE) {
+					compare_with_packed_histories(histories, all.IDs.data() + history_displs[from_rank],
+									all.lengths.data() + history_displs[from_rank],
+									all.splines.data() + double_displs[from_rank],
+									history_counts[from_rank], threshold);
+				} else {
+					compare_with_quantized_histories(histories, all.IDs.data() + history_displs[from_rank],
+									all.lengths.data() + history_displs[from_rank],
+									(precision == EXCHANGE_FLOAT) ? all.floats.data() + double_displs[from_rank] : NULL,
+									(precision == EXCHANGE_INT16) ? all.shorts.data() + double_displs[from_rank] : NULL,
+									all.quantization.data() + 2*history_displs[from_rank],
+									history_counts[from_rank], threshold, borderline[from_rank]);
 				}
 			}
+			if(precision != EXCHANGE_DOUBLE) compare_borderline_histories(histories, borderline, threshold, comm);
+			return;
 		}
-	}
+
+		// Cycle through all ranks in the communicator in a ring-like fashion, sending
+		// to this_rank+i (periodic) and receiving from this_rank-i (periodic). This
+		// ensures that every rank gets the data from every other rank (for comparison)
+		// wihout ever needing to hold more than two other ranks' histories in memory.
+		Strain6DPack recv[2];
+		MPI_Request requests[2][8];
+
+		post_ring_round(local, recv[1], modulo_neg(this_rank + 1, num_ranks),
+				modulo_neg(this_rank - 1, num_ranks), counts, comm, requests[1]);
+
+		for(int32_t i = 1; i < num_ranks; i++) {
+			if(i + 1 < num_ranks) {
+				post_ring_round(local, recv[(i + 1)%2], modulo_neg(this_rank + i + 1, num_ranks),
+						modulo_neg(this_rank - i - 1, num_ranks), counts, comm, requests[(i + 1)%2]);
+			}
+
+			MPI_Waitall(8, requests[i%2], MPI_STATUSES_IGNORE);
+			if(precision == EXCHANGE_DOUBLE) {
+				compare_with_packed_histories(histories, recv[i%2], threshold);
+			} else {
+				compare_with_quantized_histories(histories, recv[i%2], threshold,
+								borderline[modulo_neg(this_rank - i, num_ranks)]);
+			}
+		}
+		if(precision != EXCHANGE_DOUBLE) compare_borderline_histories(histories, borderline, threshold, comm);
+	}
+
+	/* Random projection locality sensitive hashing of the spline vectors (p-stable LSH for the L2 norm).
+	 * Each of the num_tables tables hashes a spline to the bucket floor((a.x + b)/bucket_width) of
+	 * num_projections random gaussian directions a. Splines closer than bucket_width are likely to share
+	 * a bucket in at least one table: more tables increase the recall of similar histories, more
+	 * projections per table reduce the number of candidates to compare. The projections are drawn from a
+	 * fixed seed, so that all the ranks hash identically.
+	 */
+	class Strain6DLSH
+	{
+		public:
+			Strain6DLSH(uint32_t num_tables, uint32_t num_projections, double bucket_width, uint32_t dimension, uint32_t seed = 5489)
+			{
+				this->num_tables = num_tables;
+				this->num_projections = num_projections;
+				this->bucket_width = bucket_width;
+				this->dimension = dimension;
+
+				std::mt19937 gen(seed);
+				std::normal_distribution<double> normal(0., 1.);
+				std::uniform_real_distribution<double> uniform(0., bucket_width);
+
+				directions.resize(num_tables*num_projections*dimension);
+				offsets.resize(num_tables*num_projections);
+				for(uint32_t i = 0; i < directions.size(); i++) directions[i] = normal(gen);
+				for(uint32_t i = 0; i < offsets.size(); i++) offsets[i] = uniform(gen);
+			}
+
+			/* Key of the bucket of the given spline in the given table */
+			uint64_t bucket(uint32_t table, const double *spline)
+			{
+				uint64_t key = 14695981039346656037ULL;
+				for(uint32_t k = 0; k < num_projections; k++) {
+					uint32_t p = table*num_projections + k;
+					const double *a = &directions[(uint64_t)p*dimension];
+					double proj = offsets[p];
+					for(uint32_t i = 0; i < dimension; i++) proj += a[i]*spline[i];
+					int64_t slot = (int64_t)floor(proj/bucket_width);
+
+					// FNV-1a combination of the slots of all the projections
+					for(uint32_t byte = 0; byte < 8; byte++) {
+						key ^= ((uint64_t)slot >> (8*byte)) & 0xff;
+						key *= 1099511628211ULL;
+					}
+				}
+				return key;
+			}
+
+			/* Rank owning the given bucket of the given table, spreading the hash space over the ranks */
+			int32_t owner(uint32_t table, uint64_t key, int32_t num_ranks)
+			{
+				uint64_t z = key + (table + 1)*0x9E3779B97F4A7C15ULL;
+				z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+				z = z ^ (z >> 31);
+				return z%num_ranks;
+			}
+
+			uint32_t get_num_tables()
+			{
+				return num_tables;
+			}
+
+		private:
+			uint32_t num_tables;
+			uint32_t num_projections;
+			double bucket_width;
+			uint32_t dimension;
+
+			std::vector<double> directions;
+			std::vector<double> offsets;
+	};
+
+	/* Approximate alternative to compare_histories_with_all_ranks(): only the histories sharing a bucket
+	 * of the LSH index in at least one table are compared. The buckets are distributed over the ranks by
+	 * hash value; every history is sent once to each rank owning one of its buckets, the owners compare
+	 * the histories of each of their buckets, and send the differences back to the ranks of the histories.
+	 * If bucket_width is not positive, it is set to 4 times the threshold.
+	 */
+	void compare_histories_with_index(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm,
+						uint32_t num_tables, uint32_t num_projections, double bucket_width = 0.)
+	{
+		int32_t this_rank, num_ranks;
+		MPI_Comm_rank(comm, &this_rank);
+		MPI_Comm_size(comm, &num_ranks);
+
+		uint32_t num_histories_on_this_rank = histories.size();
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			histories[h]->clear_most_similar_history();
+		}
+
+		// All the splines are hashed with the same projections, thus need the same number of values
+		uint32_t dimension = 0;
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			dimension = std::max(dimension, (uint32_t)histories[h]->get_spline()->size());
+		}
+		MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, comm);
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			if(histories[h]->get_spline()->size() != dimension) {
+				fprintf(stderr, "Error in compare_histories_with_index(): history %u has %lu spline points instead of %u\n",
+						histories[h]->get_ID(), histories[h]->get_spline()->size(), dimension);
+				exit(1);
+			}
+		}
+
+		if(bucket_width <= 0.) bucket_width = 4.*threshold;
+		Strain6DLSH lsh(num_tables, num_projections, bucket_width, dimension);
+
+		// Histories sent to each rank (ID, length and local index), their splines,
+		// and the (index in the histories sent to the rank, table, key) of their buckets there
+		std::vector< std::vector<uint32_t> > send_hists(num_ranks);
+		std::vector< std::vector<double> > send_splines(num_ranks);
+		std::vector< std::vector<uint64_t> > send_buckets(num_ranks);
+		std::vector<int64_t> last_sent(num_ranks, -1);
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			std::vector<double> *spline = histories[h]->get_spline();
+			for(uint32_t t = 0; t < num_tables; t++) {
+				uint64_t key = lsh.bucket(t, spline->data());
+				int32_t owner = lsh.owner(t, key, num_ranks);
+				if(last_sent[owner] != h) {
+					last_sent[owner] = h;
+					send_hists[owner].push_back(histories[h]->get_ID());
+					send_hists[owner].push_back(spline->size());
+					send_hists[owner].push_back(h);
+					send_splines[owner].insert(send_splines[owner].end(), spline->begin(), spline->end());
+				}
+				send_buckets[owner].push_back(send_hists[owner].size()/3 - 1);
+				send_buckets[owner].push_back(t);
+				send_buckets[owner].push_back(key);
+			}
+		}
+
+		std::vector<int> send_counts(3*num_ranks), recv_counts(3*num_ranks);
+		for(int32_t r = 0; r < num_ranks; r++) {
+			send_counts[3*r] = send_hists[r].size();
+			send_counts[3*r + 1] = send_splines[r].size();
+			send_counts[3*r + 2] = send_buckets[r].size();
+		}
+		MPI_Alltoall(send_counts.data(), 3, MPI_INT, recv_counts.data(), 3, MPI_INT, comm);
+
+		std::vector<uint32_t> hists_out, hists_in;
+		std::vector<double> splines_out, splines_in;
+		std::vector<uint64_t> buckets_out, buckets_in;
+		std::vector<int> scounts[3], sdispls[3], rcounts[3], rdispls[3];
+		for(uint32_t k = 0; k < 3; k++) {
+			scounts[k].resize(num_ranks);
+			rcounts[k].resize(num_ranks);
+			for(int32_t r = 0; r < num_ranks; r++) {
+				scounts[k][r] = send_counts[3*r + k];
+				rcounts[k][r] = recv_counts[3*r + k];
+			}
+		}
+		hists_out.resize(alltoall_displacements(scounts[0], sdispls[0]));
+		splines_out.resize(alltoall_displacements(scounts[1], sdispls[1]));
+		buckets_out.resize(alltoall_displacements(scounts[2], sdispls[2]));
+		hists_in.resize(alltoall_displacements(rcounts[0], rdispls[0]));
+		splines_in.resize(alltoall_displacements(rcounts[1], rdispls[1]));
+		buckets_in.resize(alltoall_displacements(rcounts[2], rdispls[2]));
+		for(int32_t r = 0; r < num_ranks; r++) {
+			std::copy(send_hists[r].begin(), send_hists[r].end(), hists_out.begin() + sdispls[0][r]);
+			std::copy(send_splines[r].begin(), send_splines[r].end(), splines_out.begin() + sdispls[1][r]);
+			std::copy(send_buckets[r].begin(), send_buckets[r].end(), buckets_out.begin() + sdispls[2][r]);
+		}
+
+		MPI_Alltoallv(hists_out.data(), scounts[0].data(), sdispls[0].data(), MPI_UNSIGNED,
+				hists_in.data(), rcounts[0].data(), rdispls[0].data(), MPI_UNSIGNED, comm);
+		MPI_Alltoallv(splines_out.data(), scounts[1].data(), sdispls[1].data(), MPI_DOUBLE,
+				splines_in.data(), rcounts[1].data(), rdispls[1].data(), MPI_DOUBLE, comm);
+		MPI_Alltoallv(buckets_out.data(), scounts[2].data(), sdispls[2].data(), MPI_UINT64_T,
+				buckets_in.data(), rcounts[2].data(), rdispls[2].data(), MPI_UINT64_T, comm);
+
+		// Source rank and spline offset of each received history, and histories of each owned bucket
+		uint32_t num_received = hists_in.size()/3;
+		std::vector<int32_t> source(num_received);
+		std::vector<uint64_t> spline_offset(num_received);
+		std::map< std::pair<uint64_t, uint64_t>, std::vector<uint32_t> > buckets;
+		uint64_t offset = 0;
+		for(int32_t r = 0; r < num_ranks; r++) {
+			uint32_t first = rdispls[0][r]/3;
+			for(uint32_t g = first; g < first + rcounts[0][r]/3; g++) {
+				source[g] = r;
+				spline_offset[g] = offset;
+				offset += hists_in[3*g + 1];
+			}
+			for(int32_t b = rdispls[2][r]; b < rdispls[2][r] + rcounts[2][r]; b += 3) {
+				buckets[std::make_pair(buckets_in[b + 1], buckets_in[b + 2])].push_back(first + buckets_in[b]);
+			}
+		}
+
+		// Compare the histories of each bucket, once per pair over all the owned buckets,
+		// and return the (local index, candidate ID) and difference to the rank of each history
+		std::vector< std::vector<uint32_t> > send_pairs(num_ranks);
+		std::vector< std::vector<double> > send_diffs(num_ranks);
+		std::set< std::pair<uint32_t, uint32_t> > compared;
+		for(std::map< std::pair<uint64_t, uint64_t>, std::vector<uint32_t> >::iterator it = buckets.begin(); it != buckets.end(); ++it) {
+			std::vector<uint32_t>& members = it->second;
+			for(uint32_t a = 0; a < members.size(); a++) {
+				for(uint32_t b = a + 1; b < members.size(); b++) {
+					uint32_t ga = std::min(members[a], members[b]);
+					uint32_t gb = std::max(members[a], members[b]);
+					if(!compared.insert(std::make_pair(ga, gb)).second) continue;
+
+					double diff = compare_L2_norm(&splines_in[spline_offset[ga]], &splines_in[spline_offset[gb]],
+									hists_in[3*ga + 1], hists_in[3*gb + 1]);
+
+					send_pairs[source[ga]].push_back(hists_in[3*ga + 2]);
+					send_pairs[source[ga]].push_back(hists_in[3*gb]);
+					send_diffs[source[ga]].push_back(diff);
+
+					send_pairs[source[gb]].push_back(hists_in[3*gb + 2]);
+					send_pairs[source[gb]].push_back(hists_in[3*ga]);
+					send_diffs[source[gb]].push_back(diff);
+				}
+			}
+		}
+
+		for(uint32_t k = 0; k < 2; k++) {
+			for(int32_t r = 0; r < num_ranks; r++) {
+				scounts[k][r] = (k == 0) ? send_pairs[r].size() : send_diffs[r].size();
+			}
+			MPI_Alltoall(scounts[k].data(), 1, MPI_INT, rcounts[k].data(), 1, MPI_INT, comm);
+		}
+		std::vector<uint32_t> pairs_out(alltoall_displacements(scounts[0], sdispls[0])), pairs_in(alltoall_displacements(rcounts[0], rdispls[0]));
+		std::vector<double> diffs_out(alltoall_displacements(scounts[1], sdispls[1])), diffs_in(alltoall_displacements(rcounts[1], rdispls[1]));
+		for(int32_t r = 0; r < num_ranks; r++) {
+			std::copy(send_pairs[r].begin(), send_pairs[r].end(), pairs_out.begin() + sdispls[0][r]);
+			std::copy(send_diffs[r].begin(), send_diffs[r].end(), diffs_out.begin() + sdispls[1][r]);
+		}
+		MPI_Alltoallv(pairs_out.data(), scounts[0].data(), sdispls[0].data(), MPI_UNSIGNED,
+				pairs_in.data(), rcounts[0].data(), rdispls[0].data(), MPI_UNSIGNED, comm);
+		MPI_Alltoallv(diffs_out.data(), scounts[1].data(), sdispls[1].data(), MPI_DOUBLE,
+				diffs_in.data(), rcounts[1].data(), rdispls[1].data(), MPI_DOUBLE, comm);
+
+		// A pair sharing buckets owned by several ranks is received several times: only keep one
+		// candidate per ID, in increasing ID order so that the result does not depend on the owners
+		std::vector< std::vector< std::pair<uint32_t, double> > > candidates(num_histories_on_this_rank);
+		for(uint32_t i = 0; i < diffs_in.size(); i++) {
+			candidates[pairs_in[2*i]].push_back(std::make_pair(pairs_in[2*i + 1], diffs_in[i]));
+		}
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			std::sort(candidates[h].begin(), candidates[h].end());
+			for(uint32_t c = 0; c < candidates[h].size(); c++) {
+				if(c > 0 && candidates[h][c].first == candidates[h][c - 1].first) continue;
+				histories[h]->choose_most_similar_history(candidates[h][c].second, candidates[h][c].first, threshold);
+			}
+		}
+	}
+
+	/* Validation of the LSH index against the exhaustive comparison: both are run, and the recall of the
+	 * histories within threshold, the agreement on the most similar history and the timings are printed by
+	 * the first rank. The results of the index are left in the histories. Returns the recall.
+	 */
+	double validate_histories_index(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm,
+						uint32_t num_tables, uint32_t num_projections, double bucket_width = 0.)
+	{
+		int32_t this_rank;
+		MPI_Comm_rank(comm, &this_rank);
+		uint32_t num_histories_on_this_rank = histories.size();
+
+		MPI_Barrier(comm);
+		double start = MPI_Wtime();
+		compare_histories_with_all_ranks(histories, threshold, comm);
+		double exhaustive_time = MPI_Wtime() - start;
+
+		std::vector< std::vector<uint32_t> > exact(num_histories_on_this_rank);
+		std::vector<uint32_t> exact_nearest(num_histories_on_this_rank);
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			std::vector<HISTORY_ID_DIFF_PAIR> *similar = histories[h]->get_most_similar_histories();
+			for(uint32_t i = 0; i < similar->size(); i++) exact[h].push_back((*similar)[i].ID);
+			std::sort(exact[h].begin(), exact[h].end());
+			exact_nearest[h] = histories[h]->get_most_similar_history_ID();
+		}
+
+		MPI_Barrier(comm);
+		start = MPI_Wtime();
+		compare_histories_with_index(histories, threshold, comm, num_tables, num_projections, bucket_width);
+		double index_time = MPI_Wtime() - start;
+
+		// Similar pairs found exhaustively, found by the index, histories having a similar one,
+		// and for which the index finds the same most similar history
+		uint64_t counts[4] = {0, 0, 0, 0};
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			std::vector<HISTORY_ID_DIFF_PAIR> *similar = histories[h]->get_most_similar_histories();
+			counts[0] += exact[h].size();
+			for(uint32_t i = 0; i < similar->size(); i++) {
+				if(std::binary_search(exact[h].begin(), exact[h].end(), (*similar)[i].ID)) counts[1]++;
+			}
+			if(exact[h].size() > 0) {
+				counts[2]++;
+				if(histories[h]->get_most_similar_history_ID() == exact_nearest[h]) counts[3]++;
+			}
+		}
+		MPI_Allreduce(MPI_IN_PLACE, counts, 4, MPI_UINT64_T, MPI_SUM, comm);
+		MPI_Allreduce(MPI_IN_PLACE, &exhaustive_time, 1, MPI_DOUBLE, MPI_MAX, comm);
+		MPI_Allreduce(MPI_IN_PLACE, &index_time, 1, MPI_DOUBLE, MPI_MAX, comm);
+
+		double recall = (counts[0] > 0) ? double(counts[1])/double(counts[0]) : 1.;
+		double nearest = (counts[2] > 0) ? double(counts[3])/double(counts[2]) : 1.;
+		if(this_rank == 0) {
+			printf("LSH index validation (%u tables, %u projections): recall %.4f (%lu/%lu similar pairs), "
+					"same most similar history %.4f, exhaustive %.3fs, index %.3fs\n",
+					num_tables, num_projections, recall, (unsigned long)counts[1], (unsigned long)counts[0],
+					nearest, exhaustive_time, index_time);
+		}
+		return recall;
+	}
+
+	/* Eigenvalues (decreasing) and eigenvectors (columns of the row-major n x n matrix) of the symmetric
+	 * row-major n x n matrix A, by cyclic Jacobi rotations. A is overwritten.
+	 */
+	void symmetric_eigen(std::vector<double>& A, uint32_t n, std::vector<double>& eigenvalues, std::vector<double>& eigenvectors)
+	{
+		std::vector<double> V(n*n, 0.);
+		for(uint32_t i = 0; i < n; i++) V[i*n + i] = 1.;
+
+		for(uint32_t sweep = 0; sweep < 100; sweep++) {
+			double off = 0., total = 0.;
+			for(uint32_t i = 0; i < n; i++) {
+				for(uint32_t j = 0; j < n; j++) {
+					total += A[i*n + j]*A[i*n + j];
+					if(i != j) off += A[i*n + j]*A[i*n + j];
+				}
+			}
+			if(off <= 1e-30*total) break;
+
+			for(uint32_t p = 0; p < n; p++) {
+				for(uint32_t q = p + 1; q < n; q++) {
+					double apq = A[p*n + q];
+					if(apq == 0.) continue;
+					double theta = (A[q*n + q] - A[p*n + p])/(2.*apq);
+					double t = ((theta >= 0.) ? 1. : -1.)/(fabs(theta) + sqrt(theta*theta + 1.));
+					double c = 1./sqrt(t*t + 1.), s = t*c;
+					for(uint32_t k = 0; k < n; k++) {
+						double akp = A[k*n + p], akq = A[k*n + q];
+						A[k*n + p] = c*akp - s*akq;
+						A[k*n + q] = s*akp + c*akq;
+					}
+					for(uint32_t k = 0; k < n; k++) {
+						double apk = A[p*n + k], aqk = A[q*n + k];
+						A[p*n + k] = c*apk - s*aqk;
+						A[q*n + k] = s*apk + c*aqk;
+					}
+					for(uint32_t k = 0; k < n; k++) {
+						double vkp = V[k*n + p], vkq = V[k*n + q];
+						V[k*n + p] = c*vkp - s*vkq;
+						V[k*n + q] = s*vkp + c*vkq;
+					}
+				}
+			}
+		}
+
+		std::vector<uint32_t> order(n);
+		for(uint32_t i = 0; i < n; i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [&A, n](uint32_t x, uint32_t y) { return A[x*n + x] > A[y*n + y]; });
+		eigenvalues.resize(n);
+		eigenvectors.resize(n*n);
+		for(uint32_t j = 0; j < n; j++) {
+			eigenvalues[j] = A[order[j]*n + order[j]];
+			for(uint32_t i = 0; i < n; i++) eigenvectors[i*n + j] = V[i*n + order[j]];
+		}
+	}
+
+	/* Principal components of the splines of the histories of all the ranks, to describe each history by
+	 * its first coefficients in this basis (and the norm of its residual) instead of its whole spline.
+	 * The basis is found by a randomised SVD: the range of the centred splines is sketched by products of
+	 * their Gram matrix with a few random vectors (with power iterations), so that only matrices of
+	 * dimension x (num_components + oversampling) values are summed over the ranks.
+	 */
+	class Strain6DPCA
+	{
+		public:
+			Strain6DPCA(uint32_t num_components, uint32_t oversampling = 10, uint32_t num_power_iterations = 2, uint32_t seed = 5489)
+			{
+				this->num_components = num_components;
+				this->oversampling = oversampling;
+				this->num_power_iterations = num_power_iterations;
+				this->seed = seed;
+				dimension = 0;
+			}
+
+			/* Compute the mean and the basis of the splines of the histories of all the ranks (collective over comm) */
+			void fit(std::vector<Strain6D*>& histories, MPI_Comm comm)
+			{
+				dimension = 0;
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					dimension = std::max(dimension, (uint32_t)histories[h]->get_spline()->size());
+				}
+				MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, comm);
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					if(histories[h]->get_spline()->size() != dimension) {
+						fprintf(stderr, "Error in Strain6DPCA::fit(): history %u has %lu spline points instead of %u\n",
+								histories[h]->get_ID(), histories[h]->get_spline()->size(), dimension);
+						exit(1);
+					}
+				}
+
+				// Centred splines of this rank, as rows
+				uint32_t n = histories.size();
+				mean.assign(dimension + 1, 0.);
+				for(uint32_t h = 0; h < n; h++) {
+					std::vector<double> *spline = histories[h]->get_spline();
+					for(uint32_t i = 0; i < dimension; i++) mean[i] += (*spline)[i];
+				}
+				mean[dimension] = n;
+				MPI_Allreduce(MPI_IN_PLACE, mean.data(), dimension + 1, MPI_DOUBLE, MPI_SUM, comm);
+				double total = mean[dimension];
+				mean.resize(dimension);
+				if(total > 0.) for(uint32_t i = 0; i < dimension; i++) mean[i] /= total;
+
+				std::vector<double> X((uint64_t)n*dimension);
+				for(uint32_t h = 0; h < n; h++) {
+					std::vector<double> *spline = histories[h]->get_spline();
+					for(uint32_t i = 0; i < dimension; i++) X[(uint64_t)h*dimension + i] = (*spline)[i] - mean[i];
+				}
+
+				// Random sketch Y = X^T X Omega of the range, then power iterations Y = X^T X Q
+				uint32_t l = std::min(num_components + oversampling, dimension);
+				std::mt19937 gen(seed);
+				std::normal_distribution<double> normal(0., 1.);
+				std::vector<double> Q((uint64_t)dimension*l);
+				for(uint32_t i = 0; i < Q.size(); i++) Q[i] = normal(gen);
+
+				std::vector<double> XQ((uint64_t)n*l);
+				for(uint32_t it = 0; it <= num_power_iterations; it++) {
+					multiply(X, n, Q, l, XQ);
+					std::vector<double> Y((uint64_t)dimension*l, 0.);
+					for(uint32_t h = 0; h < n; h++) {
+						for(uint32_t i = 0; i < dimension; i++) {
+							double x = X[(uint64_t)h*dimension + i];
+							for(uint32_t j = 0; j < l; j++) Y[(uint64_t)i*l + j] += x*XQ[(uint64_t)h*l + j];
+						}
+					}
+					MPI_Allreduce(MPI_IN_PLACE, Y.data(), Y.size(), MPI_DOUBLE, MPI_SUM, comm);
+					l = orthonormalize(Y, l);
+					Q.swap(Y);
+				}
+
+				// Eigenvectors of the Gram matrix restricted to the sketched range: B = (X Q)^T (X Q)
+				multiply(X, n, Q, l, XQ);
+				std::vector<double> B((uint64_t)l*l, 0.);
+				for(uint32_t h = 0; h < n; h++) {
+					for(uint32_t i = 0; i < l; i++) {
+						for(uint32_t j = 0; j < l; j++) B[i*l + j] += XQ[(uint64_t)h*l + i]*XQ[(uint64_t)h*l + j];
+					}
+				}
+				MPI_Allreduce(MPI_IN_PLACE, B.data(), B.size(), MPI_DOUBLE, MPI_SUM, comm);
+
+				std::vector<double> eigenvalues, eigenvectors;
+				symmetric_eigen(B, l, eigenvalues, eigenvectors);
+
+				// Components as rows of the basis: V = Q W
+				num_basis_components = std::min(num_components, l);
+				basis.assign((uint64_t)num_basis_components*dimension, 0.);
+				for(uint32_t c = 0; c < num_basis_components; c++) {
+					for(uint32_t i = 0; i < dimension; i++) {
+						double v = 0.;
+						for(uint32_t j = 0; j < l; j++) v += Q[(uint64_t)i*l + j]*eigenvectors[j*l + c];
+						basis[(uint64_t)c*dimension + i] = v;
+					}
+				}
+			}
+
+			/* Coefficients of the spline in the basis, followed by the norm of its residual (get_descriptor_size() values) */
+			void describe(const double *spline, double *descriptor)
+			{
+				std::vector<double> residual(dimension);
+				for(uint32_t i = 0; i < dimension; i++) residual[i] = spline[i] - mean[i];
+				for(uint32_t c = 0; c < num_basis_components; c++) {
+					const double *v = &basis[(uint64_t)c*dimension];
+					double coefficient = 0.;
+					for(uint32_t i = 0; i < dimension; i++) coefficient += v[i]*(spline[i] - mean[i]);
+					for(uint32_t i = 0; i < dimension; i++) residual[i] -= coefficient*v[i];
+					descriptor[c] = coefficient;
+				}
+				double norm2 = 0.;
+				for(uint32_t i = 0; i < dimension; i++) norm2 += residual[i]*residual[i];
+				descriptor[num_basis_components] = sqrt(norm2);
+			}
+
+			bool is_fitted()
+			{
+				return dimension > 0;
+			}
+
+			uint32_t get_dimension()
+			{
+				return dimension;
+			}
+
+			uint32_t get_num_components()
+			{
+				return num_basis_components;
+			}
+
+			uint32_t get_descriptor_size()
+			{
+				return num_basis_components + 1;
+			}
+
+		private:
+			/* XQ = X Q, with X n x dimension and Q dimension x l */
+			void multiply(std::vector<double>& X, uint32_t n, std::vector<double>& Q, uint32_t l, std::vector<double>& XQ)
+			{
+				XQ.assign((uint64_t)n*l, 0.);
+				for(uint32_t h = 0; h < n; h++) {
+					for(uint32_t i = 0; i < dimension; i++) {
+						double x = X[(uint64_t)h*dimension + i];
+						for(uint32_t j = 0; j < l; j++) XQ[(uint64_t)h*l + j] += x*Q[(uint64_t)i*l + j];
+					}
+				}
+			}
+
+			/* Modified Gram-Schmidt of the l columns of Y (dimension x l), dropping the columns of negligible
+			 * norm (rank-deficient sketch). Y is compacted to the remaining columns, whose number is returned.
+			 */
+			uint32_t orthonormalize(std::vector<double>& Y, uint32_t l)
+			{
+				std::vector<double> Q((uint64_t)dimension*l);
+				uint32_t kept = 0;
+				double first_norm = 0.;
+				for(uint32_t j = 0; j < l; j++) {
+					std::vector<double> y(dimension);
+					for(uint32_t i = 0; i < dimension; i++) y[i] = Y[(uint64_t)i*l + j];
+					double initial_norm = 0.;
+					for(uint32_t i = 0; i < dimension; i++) initial_norm += y[i]*y[i];
+					initial_norm = sqrt(initial_norm);
+					if(j == 0) first_norm = initial_norm;
+
+					// Twice, for the orthogonality of nearly dependent columns
+					for(uint32_t pass = 0; pass < 2; pass++) {
+						for(uint32_t k = 0; k < kept; k++) {
+							double dot = 0.;
+							for(uint32_t i = 0; i < dimension; i++) dot += Q[(uint64_t)i*l + k]*y[i];
+							for(uint32_t i = 0; i < dimension; i++) y[i] -= dot*Q[(uint64_t)i*l + k];
+						}
+					}
+					double norm = 0.;
+					for(uint32_t i = 0; i < dimension; i++) norm += y[i]*y[i];
+					norm = sqrt(norm);
+					if(norm <= 1e-10*std::max(first_norm, initial_norm) || norm == 0.) continue;
+
+					for(uint32_t i = 0; i < dimension; i++) Q[(uint64_t)i*l + kept] = y[i]/norm;
+					kept++;
+				}
+
+				Y.assign((uint64_t)dimension*kept, 0.);
+				for(uint32_t i = 0; i < dimension; i++) {
+					for(uint32_t j = 0; j < kept; j++) Y[(uint64_t)i*kept + j] = Q[(uint64_t)i*l + j];
+				}
+				return kept;
+			}
+
+			uint32_t num_components;
+			uint32_t oversampling;
+			uint32_t num_power_iterations;
+			uint32_t seed;
+
+			uint32_t dimension;
+			uint32_t num_basis_components;
+			std::vector<double> mean;
+			std::vector<double> basis;
+	};
+
+	// Relative margin on the squared threshold within which the lower bound of a difference is not trusted
+	const double DESCRIPTOR_BOUND_MARGIN = 1e-9;
+
+	/* Alternative to compare_histories_with_all_ranks() on the descriptors of the histories in the given
+	 * basis (fitted beforehand), gathered on all the ranks instead of their splines. As the basis is
+	 * orthonormal, the difference of two histories is bounded below by sqrt(dc^2 + (ra - rb)^2), where dc
+	 * is the difference of their coefficients and ra, rb the norms of their residuals. Only the pairs whose
+	 * lower bound is within threshold are compared exactly, the spline of the history being sent to the
+	 * rank of the candidate if needed, so that the histories within threshold and their differences are
+	 * those of the exhaustive comparison. The differences of the other pairs, only used for the most similar
+	 * history beyond threshold, are estimated as sqrt(dc^2 + ra^2 + rb^2) (within the bounds of the difference).
+	 */
+	void compare_histories_with_descriptors(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm,
+							Strain6DPCA& pca)
+	{
+		int32_t this_rank, num_ranks;
+		MPI_Comm_rank(comm, &this_rank);
+		MPI_Comm_size(comm, &num_ranks);
+
+		uint32_t num_histories_on_this_rank = histories.size();
+		uint32_t dimension = pca.get_dimension();
+		uint32_t size = pca.get_descriptor_size();
+		uint32_t num_components = pca.get_num_components();
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			histories[h]->clear_most_similar_history();
+			if(histories[h]->get_spline()->size() != dimension) {
+				fprintf(stderr, "Error in compare_histories_with_descriptors(): history %u has %lu spline points instead of %u\n",
+						histories[h]->get_ID(), histories[h]->get_spline()->size(), dimension);
+				exit(1);
+			}
+		}
+
+		// Descriptors of the histories of all the ranks, in rank order
+		std::vector<uint32_t> local_IDs(num_histories_on_this_rank);
+		std::vector<double> local_descriptors((uint64_t)num_histories_on_this_rank*size);
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			local_IDs[h] = histories[h]->get_ID();
+			pca.describe(histories[h]->get_spline()->data(), &local_descriptors[(uint64_t)h*size]);
+		}
+
+		int num_local = num_histories_on_this_rank;
+		std::vector<int> history_counts(num_ranks), history_displs(num_ranks), descriptor_counts(num_ranks), descriptor_displs(num_ranks);
+		MPI_Allgather(&num_local, 1, MPI_INT, history_counts.data(), 1, MPI_INT, comm);
+		for(int32_t r = 0; r < num_ranks; r++) descriptor_counts[r] = history_counts[r]*size;
+		uint32_t total_histories = alltoall_displacements(history_counts, history_displs);
+		alltoall_displacements(descriptor_counts, descriptor_displs);
+
+		std::vector<uint32_t> IDs(total_histories);
+		std::vector<double> descriptors((uint64_t)total_histories*size);
+		MPI_Allgatherv(local_IDs.data(), num_local, MPI_UNSIGNED, IDs.data(),
+				history_counts.data(), history_displs.data(), MPI_UNSIGNED, comm);
+		MPI_Allgatherv(local_descriptors.data(), num_local*size, MPI_DOUBLE, descriptors.data(),
+				descriptor_counts.data(), descriptor_displs.data(), MPI_DOUBLE, comm);
+
+		// Histories sent to each rank (local index, in order) with their splines, and the pairs
+		// (index in the histories sent to the rank, local index of the candidate there) to compare exactly there
+		std::vector< std::vector<uint32_t> > send_hists(num_ranks), send_pairs(num_ranks);
+		std::vector< std::vector<double> > send_splines(num_ranks);
+		std::vector<int64_t> last_sent(num_ranks, -1);
+		double threshold2 = threshold*threshold;
+		int32_t candidate_rank = 0;
+		for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
+			Strain6D *history = histories[h];
+			std::vector<double> *spline = history->get_spline();
+			const double *da = &local_descriptors[(uint64_t)h*size];
+			double ra = da[num_components];
+
+			candidate_rank = 0;
+			for(uint32_t g = 0; g < total_histories; g++) {
+				while(g >= (uint32_t)(history_displs[candidate_rank] + history_counts[candidate_rank])) candidate_rank++;
+				if(candidate_rank == this_rank && g - history_displs[this_rank] == h) continue;
+
+				const double *db = &descriptors[(uint64_t)g*size];
+				double rb = db[num_components];
+				double bound = history->abandon_bound(threshold)*(1. + DESCRIPTOR_BOUND_MARGIN);
+				double dc2 = squared_L2_distance(da, db, num_components, bound);
+				double lower2 = dc2 + (ra - rb)*(ra - rb);
+				if(lower2 > bound) continue;
+				double upper2 = dc2 + (ra + rb)*(ra + rb);
+
+				if(lower2 > threshold2*(1. + DESCRIPTOR_BOUND_MARGIN)) {
+					double estimate2 = std::min(std::max(dc2 + ra*ra + rb*rb, lower2), upper2);
+					history->choose_most_similar_history(sqrt(estimate2), IDs[g], threshold);
+				}
+				else if(candidate_rank == this_rank) {
+					history->choose_most_similar_history(compare_L2_norm(spline->data(),
+							histories[g - history_displs[this_rank]]->get_spline()->data(), dimension, dimension), IDs[g], threshold);
+				}
+				else {
+					if(last_sent[candidate_rank] != h) {
+						last_sent[candidate_rank] = h;
+						send_hists[candidate_rank].push_back(h);
+						send_splines[candidate_rank].insert(send_splines[candidate_rank].end(), spline->begin(), spline->end());
+					}
+					send_pairs[candidate_rank].push_back(send_hists[candidate_rank].size() - 1);
+					send_pairs[candidate_rank].push_back(g - history_displs[candidate_rank]);
+				}
+			}
+		}
+
+		// Splines and pairs to compare sent to the ranks of the candidates
+		std::vector<int> scounts[2], sdispls[2], rcounts[2], rdispls[2];
+		for(uint32_t k = 0; k < 2; k++) {
+			scounts[k].resize(num_ranks);
+			rcounts[k].resize(num_ranks);
+			for(int32_t r = 0; r < num_ranks; r++) {
+				scounts[k][r] = (k == 0) ? send_splines[r].size() : send_pairs[r].size();
+			}
+			MPI_Alltoall(scounts[k].data(), 1, MPI_INT, rcounts[k].data(), 1, MPI_INT, comm);
+		}
+		std::vector<double> splines_out(alltoall_displacements(scounts[0], sdispls[0])), splines_in(alltoall_displacements(rcounts[0], rdispls[0]));
+		std::vector<uint32_t> pairs_out(alltoall_displacements(scounts[1], sdispls[1])), pairs_in(alltoall_displacements(rcounts[1], rdispls[1]));
+		for(int32_t r = 0; r < num_ranks; r++) {
+			std::copy(send_splines[r].begin(), send_splines[r].end(), splines_out.begin() + sdispls[0][r]);
+			std::copy(send_pairs[r].begin(), send_pairs[r].end(), pairs_out.begin() + sdispls[1][r]);
+		}
+		MPI_Alltoallv(splines_out.data(), scounts[0].data(), sdispls[0].data(), MPI_DOUBLE,
+				splines_in.data(), rcounts[0].data(), rdispls[0].data(), MPI_DOUBLE, comm);
+		MPI_Alltoallv(pairs_out.data(), scounts[1].data(), sdispls[1].data(), MPI_UNSIGNED,
+				pairs_in.data(), rcounts[1].data(), rdispls[1].data(), MPI_UNSIGNED, comm);
+
+		// Exact differences of the received pairs, sent back in the same order
+		std::vector<int> diff_scounts(num_ranks), diff_sdispls, diff_rcounts(num_ranks), diff_rdispls;
+		for(int32_t r = 0; r < num_ranks; r++) {
+			diff_scounts[r] = rcounts[1][r]/2;
+			diff_rcounts[r] = scounts[1][r]/2;
+		}
+		std::vector<double> diffs_out(alltoall_displacements(diff_scounts, diff_sdispls));
+		std::vector<double> diffs_in(alltoall_displacements(diff_rcounts, diff_rdispls));
+		for(int32_t r = 0; r < num_ranks; r++) {
+			for(int32_t p = 0; p < diff_scounts[r]; p++) {
+				const double *received = &splines_in[rdispls[0][r] + (uint64_t)pairs_in[rdispls[1][r] + 2*p]*dimension];
+				Strain6D *candidate = histories[pairs_in[rdispls[1][r] + 2*p + 1]];
+				diffs_out[diff_sdispls[r] + p] = compare_L2_norm(received, candidate->get_spline()->data(), dimension, dimension);
+			}
+		}
+		MPI_Alltoallv(diffs_out.data(), diff_scounts.data(), diff_sdispls.data(), MPI_DOUBLE,
+				diffs_in.data(), diff_rcounts.data(), diff_rdispls.data(), MPI_DOUBLE, comm);
+
+		for(int32_t r = 0; r < num_ranks; r++) {
+			for(int32_t p = 0; p < diff_rcounts[r]; p++) {
+				uint32_t g = history_displs[r] + send_pairs[r][2*p + 1];
+				histories[send_hists[r][send_pairs[r][2*p]]]->choose_most_similar_history(diffs_in[diff_rdispls[r] + p], IDs[g], threshold);
+			}
+		}
+	}
+
+	// Number of histories per tile of the blocked distance matrix
+	const uint32_t GEMM_TILE_ROWS = 64;
+
+	/* Dot products of the histories [a0, a1) with the histories [b0, b1) (num_points values each, stored
+	 * contiguously), four candidates at a time. If the tiles are the same, only the pairs a < b are computed. */
+	void dot_product_tile(const double *splines, uint32_t num_points, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1,
+				double *dots)
+	{
+		uint32_t nb = b1 - b0;
+		for(uint32_t a = a0; a < a1; a++) {
+			const double *x = splines + (uint64_t)a*num_points;
+			uint32_t b = (a0 == b0) ? a + 1 : b0;
+			for(; b + 4 <= b1; b += 4) {
+				const double *y0 = splines + (uint64_t)b*num_points;
+				const double *y1 = y0 + num_points, *y2 = y1 + num_points, *y3 = y2 + num_points;
+				double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+				for(uint32_t k = 0; k < num_points; k++) {
+					s0 += x[k]*y0[k];
+					s1 += x[k]*y1[k];
+					s2 += x[k]*y2[k];
+					s3 += x[k]*y3[k];
+				}
+				double *d = dots + (uint64_t)(a - a0)*nb + (b - b0);
+				d[0] = s0; d[1] = s1; d[2] = s2; d[3] = s3;
+			}
+			for(; b < b1; b++) {
+				const double *y = splines + (uint64_t)b*num_points;
+				double s0 = 0;
+				for(uint32_t k = 0; k < num_points; k++) s0 += x[k]*y[k];
+				dots[(uint64_t)(a - a0)*nb + (b - b0)] = s0;
+			}
+		}
+	}
+
+	/* Differences between all the pairs of num_histories splines of num_points values, stored contiguously,
+	 * using ||a-b||^2 = ||a||^2 + ||b||^2 - 2a.b. The dot products are computed by tiles of GEMM_TILE_ROWS
+	 * histories, shared among num_threads threads. Only the pairs (a < b, as indices of the splines) closer
+	 * than threshold are returned, sorted. As the identity loses precision for differences small compared
+	 * to the norms, the pairs which may be within threshold, or whose difference is not known to a relative
+	 * accuracy of 1e-6, are recomputed exactly.
+	 */
+	void distance_edges(const double *splines, uint32_t num_histories, uint32_t num_points, double threshold,
+				uint32_t num_threads, std::vector<HISTORY_EDGE>& edges)
+	{
+		std::vector<double> norms(num_histories);
+		for(uint32_t a = 0; a < num_histories; a++) {
+			const double *x = splines + (uint64_t)a*num_points;
+			norms[a] = 0;
+			for(uint32_t k = 0; k < num_points; k++) norms[a] += x[k]*x[k];
+		}
+
+		// Pairs of tiles (ta <= tb) of the upper triangle of the matrix, handed out to the threads
+		uint32_t num_tiles = (num_histories + GEMM_TILE_ROWS - 1)/GEMM_TILE_ROWS;
+		std::vector< std::pair<uint32_t, uint32_t> > tile_pairs;
+		for(uint32_t ta = 0; ta < num_tiles; ta++) {
+			for(uint32_t tb = ta; tb < num_tiles; tb++) tile_pairs.push_back(std::make_pair(ta, tb));
+		}
+		std::atomic<uint64_t> next_tile_pair(0);
+		double threshold2 = threshold*threshold;
+		double rounding = 4.*num_points*DBL_EPSILON;
+
+		std::vector< std::future< std::vector<HISTORY_EDGE> > > workers;
+		for(uint32_t t = 0; t < std::max(num_threads, (uint32_t)1); t++) {
+			workers.push_back(std::async(std::launch::async, [&]() {
+				std::vector<HISTORY_EDGE> found;
+				std::vector<double> dots(GEMM_TILE_ROWS*GEMM_TILE_ROWS);
+				for(uint64_t p = next_tile_pair++; p < tile_pairs.size(); p = next_tile_pair++) {
+					uint32_t ta = tile_pairs[p].first, tb = tile_pairs[p].second;
+					uint32_t a0 = ta*GEMM_TILE_ROWS, a1 = std::min(a0 + GEMM_TILE_ROWS, num_histories);
+					uint32_t b0 = tb*GEMM_TILE_ROWS, b1 = std::min(b0 + GEMM_TILE_ROWS, num_histories);
+					dot_product_tile(splines, num_points, a0, a1, b0, b1, dots.data());
+
+					for(uint32_t a = a0; a < a1; a++) {
+						for(uint32_t b = (ta == tb) ? a + 1 : b0; b < b1; b++) {
+							double diff2 = norms[a] + norms[b] - 2.*dots[(uint64_t)(a - a0)*(b1 - b0) + (b - b0)];
+							double error = rounding*(norms[a] + norms[b]);
+							if(diff2 > threshold2 + error) continue;
+							if(diff2 < 1.0e6*error || diff2 > threshold2 - error) {
+								diff2 = squared_L2_distance(splines + (uint64_t)a*num_points, splines + (uint64_t)b*num_points,
+												num_points, std::numeric_limits<double>::infinity());
+								if(!(diff2 < threshold2)) continue;
+							}
+							HISTORY_EDGE edge;
+							edge.a = a;
+							edge.b = b;
+							edge.diff = sqrt(std::max(diff2, 0.));
+							found.push_back(edge);
+						}
+					}
+				}
+				return found;
+			}));
+		}
+
+		edges.clear();
+		for(uint32_t t = 0; t < workers.size(); t++) {
+			std::vector<HISTORY_EDGE> found = workers[t].get();
+			edges.insert(edges.end(), found.begin(), found.end());
+		}
+		std::sort(edges.begin(), edges.end(), [](const HISTORY_EDGE& x, const HISTORY_EDGE& y) {
+			return (x.a < y.a) || (x.a == y.a && x.b < y.b);
+		});
+	}
+
+	/* Greedy coarse-graining of the similarity graph of the histories (edges between the histories within
+	 * threshold, as found by compare_histories_with_all_ranks() or compare_histories_with_index()): the
+	 * history of highest degree among the remaining ones (lowest ID if tied) is simulated, its remaining
+	 * neighbours take their results from it, and all are removed from the graph, until no edge remains.
+	 * The edges of all the ranks are gathered as a CSR graph on the first rank, which sends back to each
+	 * rank the history to get the results from for each of its histories (set_ID_to_get_results_from()).
+	 * Returns, on all the ranks, the number of simulations required for all the histories.
+	 */
+	uint32_t coarsegrain_similarity_graph(std::vector<Strain6D*>& histories, MPI_Comm comm)
+	{
+		int32_t this_rank, num_ranks;
+		MPI_Comm_rank(comm, &this_rank);
+		MPI_Comm_size(comm, &num_ranks);
+
+		// IDs of the histories of this rank, and edges (a < b) with their similar histories
+		std::vector<uint32_t> IDs(histories.size());
+		std::vector<uint32_t> edges;
+		for(uint32_t h = 0; h < histories.size(); h++) {
+			IDs[h] = histories[h]->get_ID();
+			std::vector<HISTORY_ID_DIFF_PAIR> *similar = histories[h]->get_most_similar_histories();
+			for(uint32_t i = 0; i < similar->size(); i++) {
+				if(IDs[h] < (*similar)[i].ID) {
+					edges.push_back(IDs[h]);
+					edges.push_back((*similar)[i].ID);
+				}
+				else if((*similar)[i].ID < IDs[h]) {
+					edges.push_back((*similar)[i].ID);
+					edges.push_back(IDs[h]);
+				}
+			}
+		}
+
+		int num_IDs = IDs.size(), num_edge_values = edges.size();
+		std::vector<int> ID_counts(num_ranks), ID_displs(num_ranks), edge_counts(num_ranks), edge_displs(num_ranks);
+		MPI_Gather(&num_IDs, 1, MPI_INT, ID_counts.data(), 1, MPI_INT, 0, comm);
+		MPI_Gather(&num_edge_values, 1, MPI_INT, edge_counts.data(), 1, MPI_INT, 0, comm);
+		uint32_t total_IDs = alltoall_displacements(ID_counts, ID_displs);
+		uint32_t total_edge_values = alltoall_displacements(edge_counts, edge_displs);
+
+		std::vector<uint32_t> all_IDs(total_IDs), all_edges(total_edge_values), all_mapping(total_IDs);
+		MPI_Gatherv(IDs.data(), num_IDs, MPI_UNSIGNED, all_IDs.data(), ID_counts.data(), ID_displs.data(), MPI_UNSIGNED, 0, comm);
+		MPI_Gatherv(edges.data(), num_edge_values, MPI_UNSIGNED, all_edges.data(), edge_counts.data(), edge_displs.data(), MPI_UNSIGNED, 0, comm);
+
+		uint32_t num_simulations = 0;
+		if(this_rank == 0) {
+			// Nodes are the histories (sorted IDs), each edge being reported by both its histories
+			std::vector<uint32_t> nodes(all_IDs);
+			std::sort(nodes.begin(), nodes.end());
+			nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+			uint32_t num_nodes = nodes.size();
+
+			std::vector< std::pair<uint32_t, uint32_t> > pairs;
+			for(uint32_t e = 0; e < total_edge_values; e += 2) {
+				uint32_t a = std::lower_bound(nodes.begin(), nodes.end(), all_edges[e]) - nodes.begin();
+				uint32_t b = std::lower_bound(nodes.begin(), nodes.end(), all_edges[e + 1]) - nodes.begin();
+				if(a == num_nodes || nodes[a] != all_edges[e] || b == num_nodes || nodes[b] != all_edges[e + 1]) continue;
+				pairs.push_back(std::make_pair(a, b));
+			}
+			std::sort(pairs.begin(), pairs.end());
+			pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+			// CSR adjacency
+			std::vector<uint32_t> offsets(num_nodes + 1, 0), adjacency(2*pairs.size());
+			for(uint32_t e = 0; e < pairs.size(); e++) {
+				offsets[pairs[e].first + 1]++;
+				offsets[pairs[e].second + 1]++;
+			}
+			for(uint32_t n = 0; n < num_nodes; n++) offsets[n + 1] += offsets[n];
+			std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+			for(uint32_t e = 0; e < pairs.size(); e++) {
+				adjacency[fill[pairs[e].first]++] = pairs[e].second;
+				adjacency[fill[pairs[e].second]++] = pairs[e].first;
+			}
+
+			// Greedy removal of the node of highest remaining degree, the nodes being ordered by
+			// decreasing degree then increasing ID
+			std::vector<uint32_t> mapping(num_nodes);
+			std::vector<uint32_t> degree(num_nodes);
+			std::vector<bool> removed(num_nodes, false);
+			std::set< std::pair<int64_t, uint32_t> > queue;
+			for(uint32_t n = 0; n < num_nodes; n++) {
+				mapping[n] = n;
+				degree[n] = offsets[n + 1] - offsets[n];
+				if(degree[n] > 0) queue.insert(std::make_pair(-(int64_t)degree[n], n));
+				else num_simulations++;
+			}
+
+			std::vector<uint32_t> group;
+			while(!queue.empty()) {
+				uint32_t center = queue.begin()->second;
+				group.clear();
+				group.push_back(center);
+				for(uint32_t i = offsets[center]; i < offsets[center + 1]; i++) {
+					if(!removed[adjacency[i]]) group.push_back(adjacency[i]);
+				}
+
+				for(uint32_t g = 0; g < group.size(); g++) {
+					uint32_t n = group[g];
+					mapping[n] = center;
+					removed[n] = true;
+					if(degree[n] > 0) queue.erase(std::make_pair(-(int64_t)degree[n], n));
+				}
+
+				// Update the degree of the remaining neighbours of the removed nodes
+				for(uint32_t g = 0; g < group.size(); g++) {
+					uint32_t n = group[g];
+					for(uint32_t i = offsets[n]; i < offsets[n + 1]; i++) {
+						uint32_t m = adjacency[i];
+						if(removed[m]) continue;
+						queue.erase(std::make_pair(-(int64_t)degree[m], m));
+						degree[m]--;
+						if(degree[m] > 0) queue.insert(std::make_pair(-(int64_t)degree[m], m));
+						else {
+							// Isolated by the removal, the node is simulated for itself
+							removed[m] = true;
+							num_simulations++;
+						}
+					}
+				}
+				num_simulations++;
+			}
+
+			for(uint32_t i = 0; i < total_IDs; i++) {
+				uint32_t n = std::lower_bound(nodes.begin(), nodes.end(), all_IDs[i]) - nodes.begin();
+				all_mapping[i] = nodes[mapping[n]];
+			}
+		}
+
+		std::vector<uint32_t> local_mapping(num_IDs);
+		MPI_Scatterv(all_mapping.data(), ID_counts.data(), ID_displs.data(), MPI_UNSIGNED,
+				local_mapping.data(), num_IDs, MPI_UNSIGNED, 0, comm);
+		MPI_Bcast(&num_simulations, 1, MPI_UNSIGNED, 0, comm);
+
+		for(uint32_t h = 0; h < histories.size(); h++) {
+			histories[h]->set_ID_to_get_results_from(local_mapping[h]);
+		}
+		return num_simulations;
+	}
+
+	/* Incremental coarse-graining of the histories across timesteps. As the histories evolve smoothly,
+	 * most clusters persist from one update to the next: the representatives of the previous update (the
+	 * histories getting the results from themselves) are kept, and every other history is only compared
+	 * with its representative, then with the other representatives of close spline norm if it has drifted
+	 * beyond threshold.
+	 * The histories close to no representative, and the new ones, are compared and coarse-grained among
+	 * themselves. The whole similarity graph is rebuilt every refresh_interval updates (only at the first
+	 * one if 0), with compare_histories_with_index() if num_lsh_tables > 0, or compare_histories_with_descriptors()
+	 * if num_pca_components > 0, the basis being fitted again at each rebuild. The similar histories of a
+	 * history are only updated when it is reclustered. The representative of each history is remembered
+	 * from one update to the next, so that the caller may reset the histories in between.
+	 */
+	class SimilarityClustering
+	{
+		public:
+			SimilarityClustering(uint32_t refresh_interval, uint32_t num_lsh_tables = 0, uint32_t num_lsh_projections = 4,
+						uint32_t num_pca_components = 0)
+			: pca(num_pca_components)
+			{
+				this->refresh_interval = refresh_interval;
+				this->num_lsh_tables = num_lsh_tables;
+				this->num_lsh_projections = num_lsh_projections;
+				this->num_pca_components = num_pca_components;
+				precision = EXCHANGE_DOUBLE;
+				num_updates = 0;
+			}
+
+			/* Precision of the histories exchanged by the exhaustive comparison (compare_histories_with_all_ranks()) */
+			void set_exchange_precision(ExchangePrecision precision)
+			{
+				this->precision = precision;
+			}
+
+			/* Update the history to get the results from of all the histories (set_ID_to_get_results_from()),
+			 * their splines being up to date. Collective over comm, returns the churn summed over all the ranks.
+			 */
+			CLUSTERING_CHURN update(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm)
+			{
+				bool full_refresh = (num_updates == 0) || (refresh_interval > 0 && num_updates % refresh_interval == 0);
+				num_updates++;
+
+				std::vector<uint32_t> previous(histories.size());
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					previous[h] = previous_representative(histories[h]->get_ID());
+				}
+
+				uint32_t num_reclustered;
+				if(full_refresh) {
+					if(num_pca_components > 0) pca.fit(histories, comm);
+					recluster(histories, threshold, comm);
+					num_reclustered = histories.size();
+				} else {
+					num_reclustered = reuse_representatives(histories, threshold, comm);
+				}
+
+				// Histories, representatives, kept, reassigned and reclustered histories of this rank
+				uint32_t local_churn[5] = {(uint32_t)histories.size(), 0, 0, 0, num_reclustered};
+				representative_of.clear();
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					uint32_t current = histories[h]->get_ID_to_update_from();
+					representative_of[histories[h]->get_ID()] = current;
+					if(current == histories[h]->get_ID()) local_churn[1]++;
+					if(current == previous[h]) local_churn[2]++;
+					else if(previous[h] != std::numeric_limits<uint32_t>::max()) local_churn[3]++;
+				}
+
+				uint32_t churn_sums[5];
+				MPI_Allreduce(local_churn, churn_sums, 5, MPI_UNSIGNED, MPI_SUM, comm);
+
+				CLUSTERING_CHURN churn;
+				churn.num_histories = churn_sums[0];
+				churn.num_representatives = churn_sums[1];
+				churn.num_kept = churn_sums[2];
+				churn.num_reassigned = churn_sums[3];
+				churn.num_reclustered = churn_sums[4];
+				churn.full_refresh = full_refresh;
+				return churn;
+			}
+
+		private:
+			/* Representative of the given history at the previous update, the maximum uint32_t if unknown */
+			uint32_t previous_representative(uint32_t ID) const
+			{
+				std::map<uint32_t, uint32_t>::const_iterator it = representative_of.find(ID);
+				if(it == representative_of.end()) return std::numeric_limits<uint32_t>::max();
+				return it->second;
+			}
+
+			/* Compare the given histories of all the ranks among themselves, and coarse-grain their graph */
+			void recluster(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm)
+			{
+				if(num_pca_components > 0) {
+					compare_histories_with_descriptors(histories, threshold, comm, pca);
+				} else if(num_lsh_tables > 0) {
+					compare_histories_with_index(histories, threshold, comm, num_lsh_tables, num_lsh_projections);
+				} else {
+					compare_histories_with_all_ranks(histories, threshold, comm, 256*1024*1024, precision);
+				}
+				coarsegrain_similarity_graph(histories, comm);
+			}
+
+			/* Keep the representatives of the previous update and assign the other histories to them,
+			 * reclustering the histories close to none. A history which has drifted from its representative
+			 * is only compared with the representatives whose spline norm is within threshold of its own
+			 * (triangle inequality), which are all the representatives in the worst case.
+			 * Returns the number of reclustered histories of this rank.
+			 */
+			uint32_t reuse_representatives(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm)
+			{
+				// Gather the representatives of all the ranks
+				std::vector<Strain6D*> representatives;
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					if(previous_representative(histories[h]->get_ID()) == histories[h]->get_ID()) {
+						histories[h]->set_ID_to_get_results_from(histories[h]->get_ID());
+						representatives.push_back(histories[h]);
+					}
+				}
+
+				Strain6DPack local, all;
+				local.pack(representatives);
+				std::vector<uint64_t> counts;
+				gather_packed_counts(local, counts, comm);
+				std::vector<int> rep_counts, rep_displs, double_displs;
+				allgather_packed_histories(local, all, counts, rep_counts, rep_displs, double_displs, comm);
+
+				std::map<uint32_t, uint32_t> rep_index;
+				std::vector<uint64_t> rep_offsets(all.size() + 1, 0);
+				std::vector<std::pair<double, uint32_t> > rep_norms(all.size());
+				for(uint32_t r = 0; r < all.size(); r++) {
+					rep_index[all.IDs[r]] = r;
+					rep_offsets[r + 1] = rep_offsets[r] + all.lengths[r];
+					double norm2 = 0;
+					for(uint64_t j = rep_offsets[r]; j < rep_offsets[r + 1]; j++) norm2 += all.splines[j]*all.splines[j];
+					rep_norms[r] = std::make_pair(sqrt(norm2), r);
+				}
+				std::sort(rep_norms.begin(), rep_norms.end());
+
+				// Slightly widened so that rounding does not drop a representative at threshold
+				double window = threshold*(1 + 1e-9);
+
+				double bound = threshold*threshold;
+				std::vector<Strain6D*> drifted;
+				for(uint32_t h = 0; h < histories.size(); h++) {
+					Strain6D *history = histories[h];
+					uint32_t previous = previous_representative(history->get_ID());
+					if(previous == history->get_ID()) continue;
+
+					// New histories are reclustered
+					if(previous == std::numeric_limits<uint32_t>::max()) {
+						drifted.push_back(history);
+						continue;
+					}
+
+					std::vector<double> *spline = history->get_spline();
+					uint32_t num_points = spline->size();
+
+					// Previous representative first, then the closest one within threshold (lowest ID if tied)
+					std::map<uint32_t, uint32_t>::iterator current = rep_index.find(previous);
+					if(current != rep_index.end() && all.lengths[current->second] == num_points &&
+							squared_L2_distance(spline->data(), &all.splines[rep_offsets[current->second]], num_points, bound) < bound) {
+						history->set_ID_to_get_results_from(previous);
+						continue;
+					}
+
+					double norm2 = 0;
+					for(uint32_t j = 0; j < num_points; j++) norm2 += (*spline)[j]*(*spline)[j];
+					double norm = sqrt(norm2);
+
+					uint32_t nearest = std::numeric_limits<uint32_t>::max();
+					double nearest_diff2 = bound;
+					std::vector<std::pair<double, uint32_t> >::iterator it = std::lower_bound(rep_norms.begin(), rep_norms.end(),
+							std::make_pair(norm - window, (uint32_t)0));
+					for(; it != rep_norms.end() && it->first <= norm + window; ++it) {
+						uint32_t r = it->second;
+						if(all.lengths[r] != num_points) continue;
+						double diff2 = squared_L2_distance(spline->data(), &all.splines[rep_offsets[r]], num_points, nearest_diff2);
+						if(diff2 < nearest_diff2 || (diff2 == nearest_diff2 && nearest != std::numeric_limits<uint32_t>::max() && all.IDs[r] < nearest)) {
+							nearest_diff2 = diff2;
+							nearest = all.IDs[r];
+						}
+					}
+
+					if(nearest != std::numeric_limits<uint32_t>::max()) history->set_ID_to_get_results_from(nearest);
+					else drifted.push_back(history);
+				}
+
+				uint32_t num_drifted = drifted.size(), total_drifted;
+				MPI_Allreduce(&num_drifted, &total_drifted, 1, MPI_UNSIGNED, MPI_SUM, comm);
+				if(total_drifted > 0) recluster(drifted, threshold, comm);
+				return num_drifted;
+			}
+
+			uint32_t refresh_interval;
+			uint32_t num_lsh_tables;
+			uint32_t num_lsh_projections;
+			uint32_t num_pca_components;
+			ExchangePrecision precision;
+			uint32_t num_updates;
+
+			// Representative of each history of this rank at the previous update
+			std::map<uint32_t, uint32_t> representative_of;
+
+			Strain6DPCA pca;
+	};
 }
 #endif /* MATHISTPREDICT_STRAIN2SPLINE_H */
 
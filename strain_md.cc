@@ -57,12 +57,12 @@ int main (int argc, char **argv)
 
 		dealii::Utilities::MPI::MPI_InitFinalize mpi_initialization(argc, argv, 1);
 
-		if(argc!=19){
+		if(argc!=23 && argc!=24){
 			std::cerr << "Wrong number of arguments, expected: "
 					  << "'./single_md cellid timeid cellmat statelocout statelocres"
 					  << "loglochom qpreplogloc scriptsloc macrostatelocout repl"
-					  << "md_timestep_length md_temperature md_nsteps_sample md_strain_rate md_force_field"
-					  << "output_homog checkpoint_save'"
+					  << "md_timestep_length md_temperature md_nsteps_sample md_strain_rate md_force_field md_run_style"
+					  << "output_homog checkpoint_save proc_grid ghost_cutoff rcb_balance [probe]'"
 					  << ", but argc is " << argc << std::endl;
 			exit(1);
 		}
@@ -92,24 +92,37 @@ int main (int argc, char **argv)
 		unsigned int md_nsteps_sample = std::stoi(argv[14]);
 		double md_strain_rate = std::stod(argv[15]);
 		std::string md_force_field = argv[16];
+		std::string md_run_style = argv[17];
 
-		bool output_homog = std::stoi(argv[17]);
-		bool checkpoint_save = std::stoi(argv[18]);
+		bool output_homog = std::stoi(argv[18]);
+		bool checkpoint_save = std::stoi(argv[19]);
+
+		bool proc_grid = std::stoi(argv[20]);
+		double ghost_cutoff = std::stod(argv[21]);
+		bool rcb_balance = std::stoi(argv[22]);
+
+		bool probe = (argc > 23) ? std::stoi(argv[23]) : false;
 
 		if(this_world_process == 0) std::cout << "List of arguments: "
 											  << cellid << " " << timeid << " " << cellmat << " " << statelocout
 											  << " " << statelocres << " " << loglochom << " " << qpreplogloc
 											  << " " << scriptsloc << " " << straininputfile << " " << stressoutputfile
 											  << " " << repl << " " << md_timestep_length << " " << md_temperature
-											  << " " << md_nsteps_sample << " " << md_strain_rate << " " << md_force_field
+											  << " " << md_nsteps_sample << " " << md_strain_rate << " " << md_force_field << " " << md_run_style
 											  << " " << output_homog << " " << checkpoint_save
+										  << " " << proc_grid << " " << ghost_cutoff << " " << rcb_balance << " " << probe
 											  << std::endl;
 
-		STMDProblem<3> stmd_problem (MPI_COMM_WORLD, 0);
+		// Scripts read by the first process only and shared with the others
+		LAMMPSScriptCache md_scripts;
+		md_scripts.load(MPI_COMM_WORLD, scriptsloc);
+
+		STMDProblem<3> stmd_problem (MPI_COMM_WORLD, 0, &md_scripts);
 
 		stmd_problem.strain(cellid, timeid, cellmat, statelocout, statelocres, loglochom,
 					   qpreplogloc, scriptsloc, straininputfile, stressoutputfile, repl, md_timestep_length,
-					   md_temperature, md_nsteps_sample, md_strain_rate, md_force_field, output_homog, checkpoint_save);
+					   md_temperature, md_nsteps_sample, md_strain_rate, md_force_field, md_run_style, output_homog, checkpoint_save,
+					   proc_grid, ghost_cutoff, rcb_balance, probe);
 	}
 	catch (std::exception &exc)
 	{
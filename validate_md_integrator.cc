@@ -0,0 +1,268 @@
+/* ---------------------------------------------------------------------
+ *
+ * Copyright (C) 2000 - 2015 by the deal.II authors
+ *
+ * This file is part of the deal.II library.
+ *
+ * The deal.II library is free software; you can use it, redistribute
+ * it, and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * The full text of the license can be found in the file LICENSE at
+ * the top level of the deal.II distribution.
+ *
+ * ---------------------------------------------------------------------
+
+ *
+ * Author: Wolfgang Bangerth, University of Heidelberg, 2000
+ */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <sys/stat.h>
+#include <math.h>
+
+#include "mpi.h"
+#include "lammps.h"
+#include "input.h"
+#include "library.h"
+#include "atom.h"
+
+#include "boost/property_tree/ptree.hpp"
+#include "boost/property_tree/json_parser.hpp"
+#include "boost/foreach.hpp"
+
+// Specifically built header files
+#include "headers/read_write.h"
+#include "headers/stmd_problem.h"
+
+// To avoid conflicts...
+// pointers.h in input.h defines MIN and MAX
+// which are later redefined in petsc headers
+#undef  MIN
+#undef  MAX
+
+#include <deal.II/base/conditional_ostream.h>
+#include <deal.II/base/symmetric_tensor.h>
+#include <deal.II/base/mpi.h>
+
+// Validation of the straining run style given in the HMM input file against the Verlet
+// integrator: for each material of the input file, the first replica is strained from its
+// equilibrated state by a sequence of increments along two loading paths (uniaxial
+// extension along x, shear in the xy plane), once with each integrator, and the resulting
+// stress-strain curves are compared. The curves are written in the nanoscale log directory.
+// To be run once per force field (i.e. per HMM input file).
+int main (int argc, char **argv)
+{
+	try
+	{
+		using namespace HMM;
+
+		dealii::Utilities::MPI::MPI_InitFinalize mpi_initialization(argc, argv, 1);
+
+		if(argc!=5){
+			std::cerr << "Wrong number of arguments, expected: "
+					  << "'./validate_md_integrator inputs_dealammps.json nincrements strain_increment tolerance'"
+					  << ", but argc is " << argc << std::endl;
+			exit(1);
+		}
+
+		const int dim = 3;
+
+		int this_world_process = Utilities::MPI::this_mpi_process(MPI_COMM_WORLD);
+		ConditionalOStream vcout (std::cout,(this_world_process == 0));
+
+		std::string inputfile = argv[1];
+		int nincr = std::stoi(argv[2]);
+		double strain_increment = std::stod(argv[3]);
+		double tolerance = std::stod(argv[4]);
+
+		if(!file_exists(inputfile)){
+			std::cerr << "Missing HMM input file." << std::endl;
+			exit(1);
+		}
+
+		using boost::property_tree::ptree;
+		std::ifstream jsonFile(inputfile);
+		ptree pt;
+		read_json(jsonFile, pt);
+
+		std::vector<std::string> mdtype;
+		BOOST_FOREACH(boost::property_tree::ptree::value_type &v,
+				get_subbptree(pt, "molecular dynamics material").get_child("list of materials.")) {
+			mdtype.push_back(v.second.data());
+		}
+
+		double md_timestep_length = std::stod(bptree_read(pt, "molecular dynamics parameters", "timestep length"));
+		double md_temperature = std::stod(bptree_read(pt, "molecular dynamics parameters", "temperature"));
+		unsigned int md_nsteps_sample = std::stoi(bptree_read(pt, "molecular dynamics parameters", "number of sampling steps"));
+		double md_strain_rate = std::stod(bptree_read(pt, "molecular dynamics parameters", "strain rate"));
+		std::string md_force_field = bptree_read(pt, "molecular dynamics parameters", "force field");
+		std::string md_scripts_directory = bptree_read(pt, "molecular dynamics parameters", "scripts directory");
+		std::string md_run_style = bptree_read(pt, "molecular dynamics parameters", "straining run style");
+
+		bool md_proc_grid = std::stoi(bptree_read(pt, "computational resources", "md processors grid selection"));
+		double md_ghost_cutoff = std::stod(bptree_read(pt, "computational resources", "md ghost cutoff"));
+
+		std::string nanostatelocin = bptree_read(pt, "directory structure", "nanoscale input");
+		std::string nanologloc = bptree_read(pt, "directory structure", "nanoscale log");
+
+		std::vector<std::string> run_styles;
+		run_styles.push_back("verlet");
+		run_styles.push_back(md_run_style);
+
+		std::vector<std::string> paths;
+		paths.push_back("xx");
+		paths.push_back("xy");
+
+		std::string validloc = nanologloc + "/integrator_validation";
+		if(this_world_process == 0){
+			mkdir(nanologloc.c_str(), ACCESSPERMS);
+			mkdir(validloc.c_str(), ACCESSPERMS);
+		}
+
+		LAMMPSScriptCache md_scripts;
+		md_scripts.load(MPI_COMM_WORLD, md_scripts_directory);
+
+		bool all_valid = true;
+
+		for(unsigned int imd=0; imd<mdtype.size(); imd++)
+		{
+			int repl = 1;
+			std::string mdstate = mdtype[imd] + "_" + std::to_string(repl);
+
+			Tensor<1,dim> init_length;
+			SymmetricTensor<2,dim> init_stress;
+			std::string initfile = nanostatelocin + "/init." + mdstate;
+			read_tensor<dim>((initfile + ".length").c_str(), init_length);
+			read_tensor<dim>((initfile + ".stress").c_str(), init_stress);
+
+			for(unsigned int ip=0; ip<paths.size(); ip++)
+			{
+				int k = 0;
+				int l = (paths[ip]=="xx") ? 0 : 1;
+
+				// Stress of the loaded component after each increment, for each run style
+				std::vector<std::vector<double> > curves (run_styles.size(), std::vector<double> (nincr, 0.0));
+
+				for(unsigned int irs=0; irs<run_styles.size(); irs++)
+				{
+					// Independent state directories for each integrator, starting from
+					// the equilibrated system
+					std::string stateloc = validloc + "/" + std::to_string(irs);
+					std::string logloc = stateloc + "/log";
+					if(this_world_process == 0){
+						mkdir(stateloc.c_str(), ACCESSPERMS);
+						mkdir(logloc.c_str(), ACCESSPERMS);
+
+						std::ifstream  nanoin((initfile + ".bin").c_str(), std::ios::binary);
+						std::ofstream  nanoout((stateloc + "/init." + mdstate + ".bin").c_str(), std::ios::binary);
+						nanoout << nanoin.rdbuf();
+						nanoin.close();
+						nanoout.close();
+
+						write_tensor<dim>((stateloc + "/init." + mdstate + ".length").c_str(), init_length);
+
+						remove((stateloc + "/last." + paths[ip] + "." + mdstate + ".bin").c_str());
+						remove((stateloc + "/last." + paths[ip] + "." + mdstate + ".length").c_str());
+					}
+					MPI_Barrier(MPI_COMM_WORLD);
+
+					vcout << "Straining " << mdstate << " along " << paths[ip]
+						  << " with run style: " << run_styles[irs] << std::endl;
+
+					for(int incr=0; incr<nincr; incr++)
+					{
+						std::string strainfile = stateloc + "/last." + paths[ip] + ".upstrain";
+						std::string stressfile = stateloc + "/last." + paths[ip] + ".stress";
+
+						// Strain increment passed as a length variation, as done in STMDSync
+						if(this_world_process == 0){
+							SymmetricTensor<2,dim> loc_rep_strain;
+							loc_rep_strain[k][l] = strain_increment;
+							for (unsigned int i=0; i<dim; i++){
+								loc_rep_strain[i][i] *= init_length[i];
+								loc_rep_strain[i][(i+1)%dim] *= init_length[(i+2)%dim];
+							}
+							write_tensor<dim>(strainfile.c_str(), loc_rep_strain);
+						}
+						MPI_Barrier(MPI_COMM_WORLD);
+
+						STMDProblem<dim> stmd_problem (MPI_COMM_WORLD, 0, &md_scripts);
+						stmd_problem.strain(paths[ip], std::to_string(incr), mdtype[imd], stateloc, stateloc, logloc,
+									   logloc, md_scripts_directory, strainfile, stressfile, repl, md_timestep_length,
+									   md_temperature, md_nsteps_sample, md_strain_rate, md_force_field, run_styles[irs],
+									   false, false, md_proc_grid, md_ghost_cutoff, false);
+						MPI_Barrier(MPI_COMM_WORLD);
+
+						if(this_world_process == 0){
+							SymmetricTensor<2,dim> loc_rep_stress;
+							read_tensor<dim>(stressfile.c_str(), loc_rep_stress);
+							curves[irs][incr] = loc_rep_stress[k][l] - init_stress[k][l];
+						}
+					}
+					vcout << std::endl;
+				}
+
+				if(this_world_process == 0){
+					// Writing the curves and computing the largest deviation relative to the
+					// largest Verlet stress
+					std::string curvefile = validloc + "/stress_strain." + md_force_field + "." + mdstate + "." + paths[ip] + ".dat";
+					std::ofstream ofile(curvefile.c_str());
+					ofile << "# strain stress_" << run_styles[0] << " stress_" << run_styles[1] << std::endl;
+
+					double max_dev = 0.0, max_ref = 0.0;
+					for(int incr=0; incr<nincr; incr++){
+						ofile << std::setprecision(16) << (incr+1)*strain_increment
+							  << " " << curves[0][incr] << " " << curves[1][incr] << std::endl;
+						max_dev = std::max(max_dev, fabs(curves[1][incr] - curves[0][incr]));
+						max_ref = std::max(max_ref, fabs(curves[0][incr]));
+					}
+					ofile.close();
+
+					double rel_dev = (max_ref > 0.0) ? max_dev/max_ref : max_dev;
+					bool valid = (rel_dev <= tolerance);
+					if(!valid) all_valid = false;
+
+					std::cout << " - " << md_force_field << " " << mdstate << " path " << paths[ip]
+							  << ": max relative stress deviation " << rel_dev
+							  << (valid ? " (valid)" : " (NOT valid)") << std::endl;
+				}
+			}
+		}
+
+		int ret = all_valid ? 0 : 1;
+		MPI_Bcast(&ret, 1, MPI_INT, 0, MPI_COMM_WORLD);
+		return ret;
+	}
+	catch (std::exception &exc)
+	{
+		std::cerr << std::endl << std::endl
+				<< "----------------------------------------------------"
+				<< std::endl;
+		std::cerr << "Exception on processing: " << std::endl
+				<< exc.what() << std::endl
+				<< "Aborting!" << std::endl
+				<< "----------------------------------------------------"
+				<< std::endl;
+
+		return 1;
+	}
+	catch (...)
+	{
+		std::cerr << std::endl << std::endl
+				<< "----------------------------------------------------"
+				<< std::endl;
+		std::cerr << "Unknown exception!" << std::endl
+				<< "Aborting!" << std::endl
+				<< "----------------------------------------------------"
+				<< std::endl;
+		return 1;
+	}
+
+	return 0;
+}